@@ -7,8 +7,10 @@
 #include <signal.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #include "q2pc_client.h"
+#include "q2pc_participant.h"
 #include "../../deps/chaste/chaste.h"
 #include "../transport/q2pc_transport.h"
 #include "../errors/errors.h"
@@ -18,9 +20,9 @@
 static q2pc_trans* trans    = NULL;
 static q2pc_trans_conn conn = {0};
 static i64 client_num       = -1;
-static u64 vote_count       = 0;
-extern i64 msg_size; //HAXK! XXX This is in server.c
+static i64 msg_size         = 0;
 static i64 total_rtos       = 0;
+static i64 vote_delay_us    = 0;
 #define RTOS_MAX (200L * 1000L)
 
 static void term(int signo)
@@ -37,6 +39,22 @@ static void term(int signo)
     exit(0);
 }
 
+//Reliable transports may still be waiting on acks, or have had to retransmit, only a closed stream is a failure
+static bool flush_ok(int result)
+{
+    switch(result){
+        case Q2PC_RTOFIRED:
+            total_rtos++;
+            return true;
+        case Q2PC_ENONE:
+        case Q2PC_EAGAIN:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
 static void init(const transport_s* transport)
 {
     //Signal handling for the main thread
@@ -68,9 +86,11 @@ static void init(const transport_s* transport)
             term(0);
         }
 
-        q2pc_msg* msg   = (q2pc_msg*)data;
-        msg->type       = q2pc_con_msg;
-        msg->src_hostid = transport->client_id;
+        const q2pc_hdr hdr = {
+            .type       = q2pc_con_msg,
+            .src_hostid = transport->client_id,
+        };
+        q2pc_msg_encode((q2pc_msg*)data, &hdr);
 
         //Wait around a bit for the connection to be established
         for(int rtos = 0; /*rtos < RTOS_MAX*/; ){ //Wait forever
@@ -95,6 +115,11 @@ static void init(const transport_s* transport)
             }
         }
 
+        if(!flush_ok(trans_conn_flush(&conn))){
+            ch_log_warn("Cannot write any more from closed stream\n");
+            term(0);
+        }
+
         connected = true;
 
     }
@@ -105,7 +130,7 @@ static void init(const transport_s* transport)
 typedef enum { q2pc_pahse1, q2pc_phase2 } q2pc_phase_t;
 
 
-static q2pc_msg* get_messge(i64 wait_usecs)
+static bool get_messge(i64 wait_usecs, q2pc_hdr* hdr_o)
 {
     char* data = NULL;
     i64 len = 0;
@@ -127,18 +152,34 @@ static q2pc_msg* get_messge(i64 wait_usecs)
         result = conn.beg_read(&conn,&data, &len);
 
         if(result == Q2PC_ENONE){
-            q2pc_msg* msg = (q2pc_msg*)data;
-            ch_log_debug3("Got ts with %li\n", msg->ts) ;
-            ch_log_debug3("Got crto with %i\n", msg->c_rto) ;
-            ch_log_debug3("Got srto with %i\n", msg->s_rto) ;
+            q2pc_msg_decode((q2pc_msg*)data, hdr_o);
+            ch_log_debug3("Got ts with %u\n", hdr_o->ts) ;
+            ch_log_debug3("Got crto with %li\n", hdr_o->c_rto) ;
+            ch_log_debug3("Got srto with %li\n", hdr_o->s_rto) ;
             conn.end_read(&conn);
-            return msg;
+
+            if(hdr_o->version != Q2PC_VERSION){
+                ch_log_error("Server speaks protocol version %li, expected %i\n", hdr_o->version, Q2PC_VERSION);
+                term(0);
+            }
+
+            if(len < msg_size + hdr_o->payload_len){
+                ch_log_error("Message of %liB is too short for its %uB payload\n", len, hdr_o->payload_len);
+                term(0);
+            }
+            return true;
         }
 
         if(result == Q2PC_EFIN){
             ch_log_warn("Server has quit. Cannot read\n");
             conn.end_read(&conn);
-            return NULL;
+            return false;
+        }
+
+        //Anything we sent that hasn't been acknowledged is retransmitted from here
+        if(!flush_ok(trans_conn_flush(&conn))){
+            ch_log_warn("Server has quit. Cannot write\n");
+            return false;
         }
 
         if(wait_usecs >= 0){
@@ -146,17 +187,17 @@ static q2pc_msg* get_messge(i64 wait_usecs)
             ts_now_us = ts_now.tv_sec * 1000 * 1000 + ts_now.tv_usec;
             if(ts_now_us > ts_start_us + wait_usecs){
                 ch_log_warn("Timed out waiting for server response\n");
-                return NULL;
+                return false;
             }
         }
     }
 
     //Unreachable
-    return NULL;
+    return false;
 }
 
 
-static void send_response(q2pc_msg_type_t msg_type, q2pc_msg* old_msg)
+static void send_response(q2pc_msg_type_t msg_type, const q2pc_hdr* old_hdr)
 {
     char* data;
     i64 len;
@@ -175,16 +216,16 @@ static void send_response(q2pc_msg_type_t msg_type, q2pc_msg* old_msg)
         ch_log_fatal("Not enough space to send a Q2PC message. Needed %li, but found %li\n", msg_size, len);
     }
 
-    q2pc_msg* msg = (q2pc_msg*)data;
-    msg->type       = msg_type;
-    msg->src_hostid = client_num;
-    msg->s_rto      = old_msg->s_rto;
-    msg->c_rto      = old_msg->c_rto;
-    msg->ts         = old_msg->ts;
+    q2pc_hdr hdr    = *old_hdr;
+    hdr.type        = msg_type;
+    hdr.src_hostid  = client_num;
+    hdr.payload_len = 0;
+    q2pc_msg_encode((q2pc_msg*)data, &hdr);
+    trans_conn_set_class(&conn, trans_msg_class(msg_type, 0));
 
-    ch_log_debug3("Sent ts with %li\n", msg->ts) ;
-    ch_log_debug3("Sent crto with %i\n", msg->c_rto) ;
-    ch_log_debug3("Sent srto with %i\n", msg->s_rto) ;
+    ch_log_debug3("Sent ts with %u\n", hdr.ts) ;
+    ch_log_debug3("Sent crto with %li\n", hdr.c_rto) ;
+    ch_log_debug3("Sent srto with %li\n", hdr.s_rto) ;
 
 
     //Commit it
@@ -209,70 +250,79 @@ static void send_response(q2pc_msg_type_t msg_type, q2pc_msg* old_msg)
             term(0);
         }
     }
+
+    if(!flush_ok(trans_conn_flush(&conn))){
+        ch_log_error("Stream has ended. Cannot write\n");
+        term(0);
+    }
 }
 
 
 static int do_phase1(i64 timeout)
 {
-    q2pc_msg* msg = get_messge(timeout);
-    if(!msg){
+    q2pc_hdr msg;
+    if(!get_messge(timeout, &msg)){
         ch_log_error("Server has terminated. Cannot continue\n");
         term(0);
     }
 
-    //XXX HACK: 1 in 5 votes will fail
-    u64 vote_yes = (vote_count % 5);
+    //The payload has gone with the read buffer by now, the stand in decision doesn't look at it anyway
+    const bool vote_yes = q2pc_vote_bench(NULL, client_num, msg.txn, NULL, 0);
+
+    //Wait for our slot in the vote window
+    if(vote_delay_us){
+        usleep(vote_delay_us);
+    }
 
 
-    switch(msg->type){
+    switch(msg.type){
     case q2pc_request_msg:
         ch_log_debug2("Q2PC Client: [M]<-- request\n");
 
         if(vote_yes){
             ch_log_debug2("Q2PC Client: [M]--> vote yes\n");
-            send_response(q2pc_vote_yes_msg, msg);
+            send_response(q2pc_vote_yes_msg, &msg);
             break;
         }
         else{
             ch_log_debug2("Q2PC Client: [M]--> vote no\n");
-            send_response(q2pc_vote_no_msg, msg);
+            send_response(q2pc_vote_no_msg, &msg);
             break;
         }
     default:
-        ch_log_debug2("Q2PC Client: [M]<-- Unknown message (%i)\n", msg->type);
-        ch_log_error("Protocol failure, in phase 1 unexpected message type %i\n", msg->type);
+        ch_log_debug2("Q2PC Client: [M]<-- Unknown message (%li)\n", msg.type);
+        ch_log_error("Protocol failure, in phase 1 unexpected message type %li\n", msg.type);
         term(0);
     }
 
-    vote_count++;
     return !vote_yes;
 }
 
 static int do_phase2(i64 timeout)
 {
     int result = 0;
-    q2pc_msg* msg = get_messge(timeout);
-    if(!msg){
+    q2pc_hdr msg;
+    if(!get_messge(timeout, &msg)){
         ch_log_error("Server has terminated. Cannot continue\n");
         term(0);
     }
 
 
-    switch(msg->type){
+    switch(msg.type){
     case q2pc_commit_msg:
         ch_log_debug2("Q2PC Client: [M]<-- commit\n");
-        send_response(q2pc_ack_msg, msg);
+        send_response(q2pc_ack_msg, &msg);
         ch_log_debug2("Q2PC Client: [M]--> ack\n");
         result = 0;
         break;
     case q2pc_cancel_msg:
         ch_log_debug2("Q2PC Client: [M]<-- cancel\n");
-        send_response(q2pc_ack_msg, msg);
+        send_response(q2pc_ack_msg, &msg);
         ch_log_debug2("Q2PC Client: [M]--> ack\n");
         result = 1;
         break;
     default:
-        ch_log_error("Protocol failure, in phase 2 unexpected message type %i\n", msg->type);
+        ch_log_error("Protocol failure, in phase 2 unexpected message type %li\n", msg.type);
         term(0);
     }
 
@@ -281,13 +331,46 @@ static int do_phase2(i64 timeout)
 }
 
 
-void run_client(const transport_s* transport, i64 client_id, i64 wait_time, i64 msize)
+static void halt(int signo)
+{
+    (void)signo;
+    q2pc_participants_halt();
+}
+
+
+//Stand in for a whole cluster. Each participant has its own connection and is stepped along by the threads as
+//messages arrive, so there's no wait time, the server going is the only way out.
+static void run_many(const transport_s* transport, i64 client_count, i64 coord_count, i64 coord_stride, i64 thread_count)
+{
+    signal(SIGHUP,  halt);
+    signal(SIGTERM, halt);
+    signal(SIGINT,  halt);
+
+    ch_log_info("Running participants %li-%li for %li coordinator(s) on %li threads\n", client_num,
+            client_num + client_count - 1, coord_count, thread_count);
+    q2pc_participants_start(transport, client_num, client_count, coord_count, coord_stride, thread_count, msg_size, NULL);
+    q2pc_participants_wait();
+
+    ch_log_info("Terminating...\n");
+    q2pc_participants_stop();
+    ch_log_info("Terminating... Done.\n");
+    exit(0);
+}
+
+
+void run_client(const transport_s* transport, i64 client_id, i64 client_count, i64 coord_count, i64 coord_stride,
+        i64 thread_count, i64 wait_time, i64 msize)
 {
     client_num = client_id;
-    vote_count = client_id; //XXX HACK
-    msg_size  = MAX(msize, (i64)sizeof(q2pc_msg));
+    vote_delay_us = q2pc_vote_delay_us(transport, client_id);
+    ch_log_debug1("Holding votes back %lius\n", vote_delay_us);
+    msg_size  = MAX(msize, (i64)Q2PC_MSG_MIN);
     ch_log_info("Using message size of %li\n", msg_size);
 
+    if(client_count > 1 || coord_count > 1){
+        run_many(transport, client_count, coord_count, coord_stride, thread_count);
+    }
+
     init(transport);
 
     while(1){
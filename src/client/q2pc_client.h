@@ -11,6 +11,9 @@
 #include "../../deps/chaste/chaste.h"
 #include "../transport/q2pc_transport.h"
 
-void run_client(const transport_s* transport, i64 client_id, i64 wait_time, i64 msize);
+//Runs client_count participants, with ids from client_id up, for coord_count coordinators coord_stride ports apart.
+//More than one participant or coordinator are run as in process participants over thread_count threads.
+void run_client(const transport_s* transport, i64 client_id, i64 client_count, i64 coord_count, i64 coord_stride,
+        i64 thread_count, i64 wait_time, i64 msize);
 
 #endif /* Q2PC_CLIENT_H_ */
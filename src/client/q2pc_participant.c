@@ -0,0 +1,520 @@
+/*
+ * q2pc_participant.c
+ */
+
+ //#LINKFLAGS=-lpthread
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+
+#include "q2pc_participant.h"
+#include "../errors/errors.h"
+#include "../protocol/q2pc_protocol.h"
+
+
+bool q2pc_vote_bench(void* arg, i64 client_id, u64 txn, const char* payload, i64 payload_len)
+{
+    (void)arg;
+    (void)payload;
+    (void)payload_len;
+
+    //XXX HACK: 1 in 5 votes will fail. Transactions are numbered from 1, so each client starts at its own id.
+    return (client_id + txn - 1) % 5;
+}
+
+
+static i64 time_now_us()
+{
+    struct timeval ts_now = {0};
+    gettimeofday(&ts_now, NULL);
+    return ts_now.tv_sec * 1000 * 1000 + ts_now.tv_usec;
+}
+
+
+void q2pc_participant_init(q2pc_participant* part, q2pc_trans* trans, i64 client_id, i64 msg_size, i64 vote_delay_us,
+        const q2pc_part_callbacks* callbacks)
+{
+    bzero(part, sizeof(q2pc_participant));
+    part->trans      = trans;
+    part->state      = q2pc_part_connect;
+    part->client_id  = client_id;
+    part->msg_size   = msg_size;
+    part->vote_delay_us = vote_delay_us;
+
+    if(callbacks){
+        part->callbacks = *callbacks;
+    }
+    if(!part->callbacks.vote){
+        part->callbacks.vote = q2pc_vote_bench;
+    }
+}
+
+
+//Get a message ready in the write buffer, push_msg() sends it
+static int begin_msg(q2pc_participant* part, q2pc_msg_type_t msg_type, const q2pc_hdr* old_hdr)
+{
+    char* data;
+    i64 len;
+
+    int result = Q2PC_EAGAIN;
+    while(result == Q2PC_EAGAIN){
+        result = part->conn.beg_write(&part->conn, &data, &len);
+    }
+    if(result){
+        return result;
+    }
+
+    if(len < part->msg_size){
+        ch_log_fatal("Not enough space to send a Q2PC message. Needed %li, but found %li\n", part->msg_size, len);
+    }
+
+    q2pc_hdr hdr = { 0 };
+    if(old_hdr){
+        hdr = *old_hdr;
+    }
+    hdr.type        = msg_type;
+    hdr.src_hostid  = part->client_id;
+    hdr.payload_len = 0;
+    q2pc_msg_encode((q2pc_msg*)data, &hdr);
+    trans_conn_set_class(&part->conn, trans_msg_class(msg_type, 0));
+
+    part->writing = true;
+    return Q2PC_ENONE;
+}
+
+
+//Reliable transports retransmit from flush, a participant with anything unacknowledged has to be flushed until it's not
+static int flush_msgs(q2pc_participant* part)
+{
+    const int result = trans_conn_flush(&part->conn);
+    part->unacked    = result == Q2PC_EAGAIN || result == Q2PC_RTOFIRED;
+
+    switch(result){
+        case Q2PC_RTOFIRED:
+            part->rtos++;
+            return Q2PC_ENONE;
+        case Q2PC_EAGAIN:
+            return Q2PC_ENONE;
+        default:
+            return result;
+    }
+}
+
+
+//Try to get the message out. This doesn't wait, a transport that holds on to it until it's acknowledged is tried again
+//on the next step.
+static int push_msg(q2pc_participant* part)
+{
+    if(part->vote_due_us){
+        if(time_now_us() < part->vote_due_us){
+            return Q2PC_EAGAIN;
+        }
+        part->vote_due_us = 0;
+    }
+
+    int result = part->conn.end_write(&part->conn, part->msg_size);
+    if(result == Q2PC_RTOFIRED){
+        part->rtos++;
+        return Q2PC_EAGAIN;
+    }
+    if(result){
+        return result;
+    }
+
+    part->writing = false;
+    return flush_msgs(part);
+}
+
+
+static int step(q2pc_participant* part)
+{
+    int result;
+
+    if(part->writing){
+        return push_msg(part);
+    }
+
+    switch(part->state){
+        case q2pc_part_done:
+            return Q2PC_EFIN;
+
+        case q2pc_part_connect:
+            result = part->trans->connect(part->trans, &part->conn);
+            if(result){
+                return result;
+            }
+
+            result = begin_msg(part, q2pc_con_msg, NULL);
+            if(result){
+                return result;
+            }
+
+            part->state = q2pc_part_phase1;
+            return push_msg(part);
+
+        default:
+            break;
+    }
+
+    char* data;
+    i64 len;
+    result = part->conn.beg_read(&part->conn, &data, &len);
+    if(result){
+        return result;
+    }
+
+    q2pc_hdr msg;
+    q2pc_msg_decode((q2pc_msg*)data, &msg);
+    q2pc_msg_type_t reply;
+
+    if(msg.version != Q2PC_VERSION){
+        ch_log_fatal("Participant %li got protocol version %li, expected %i\n", part->client_id, msg.version, Q2PC_VERSION);
+    }
+
+    if(len < part->msg_size + msg.payload_len){
+        ch_log_fatal("Participant %li got a message of %liB, too short for its %uB payload\n", part->client_id, len, msg.payload_len);
+    }
+
+    if(part->state == q2pc_part_phase1){
+        if(msg.type != q2pc_request_msg){
+            ch_log_fatal("Participant %li protocol failure, in phase 1 unexpected message type %li\n", part->client_id, msg.type);
+        }
+
+        const bool yes = part->callbacks.vote(part->callbacks.arg, part->client_id, msg.txn, data + part->msg_size,
+                msg.payload_len);
+        reply = yes ? q2pc_vote_yes_msg : q2pc_vote_no_msg;
+        part->state = q2pc_part_phase2;
+        if(part->vote_delay_us){
+            part->vote_due_us = time_now_us() + part->vote_delay_us;
+        }
+    }
+    else{
+        switch(msg.type){
+            case q2pc_commit_msg: part->commits++; break;
+            case q2pc_cancel_msg: part->aborts++;  break;
+            default:
+                ch_log_fatal("Participant %li protocol failure, in phase 2 unexpected message type %li\n", part->client_id, msg.type);
+        }
+
+        if(part->callbacks.apply){
+            part->callbacks.apply(part->callbacks.arg, part->client_id, msg.txn, msg.type == q2pc_commit_msg);
+        }
+
+        reply = q2pc_ack_msg;
+        part->state = q2pc_part_phase1;
+    }
+
+    //The request has to be released before the reply goes out, RUDP reads on to see the reply was acked
+    result = begin_msg(part, reply, &msg);
+    part->conn.end_read(&part->conn);
+    if(result){
+        return result;
+    }
+
+    return push_msg(part);
+}
+
+
+int q2pc_participant_step(q2pc_participant* part)
+{
+    const int result = step(part);
+    if(result == Q2PC_EFIN){
+        part->state = q2pc_part_done;
+    }
+
+    return result;
+}
+
+
+
+/***************************************************************************************************************************/
+
+#define PART_EVENTS_MAX 256
+#define PART_TIMER_MS   1   //How often replies waiting on an ack are looked at, for their retransmit timers
+#define PART_WAIT_MS    100 //How long to sleep with nothing to do before checking whether to stop
+
+typedef struct {
+    pthread_t thread;
+    q2pc_participant* parts;
+    i64 count;
+    i64 live;
+    int epoll_fd;
+    i64* polled;    //Participants that have to be stepped every time round
+    i64 polled_count;
+
+    //Votes held back for their slot are sent when this fires. The poll timer is far too coarse for slots of a few us.
+    int timer_fd;
+    i64 timer_due_us; //0 if it isn't armed
+} part_thread;
+
+static q2pc_participant* parts   = NULL;
+static i64 part_count            = 0;
+static part_thread* part_threads = NULL;
+static i64 part_thread_count     = 0;
+static bool driver_running       = false;
+static volatile bool driver_stop = false;
+
+
+//Step a participant until it runs out of work. Returns true if it has to be polled rather than waited on.
+static bool drive(part_thread* thread, q2pc_participant* part)
+{
+    if(part->state == q2pc_part_done){
+        return false;
+    }
+
+    int result;
+    while( (result = q2pc_participant_step(part)) == Q2PC_ENONE ){
+        //Keep going, there may be more than one message waiting
+    }
+
+    if(result != Q2PC_EFIN && part->unacked){
+        result = flush_msgs(part);
+    }
+
+    if(result == Q2PC_EFIN){
+        if(part->watched){
+            epoll_ctl(thread->epoll_fd, EPOLL_CTL_DEL, trans_conn_fd(&part->conn), NULL);
+            part->watched = false;
+        }
+        thread->live--;
+        return false;
+    }
+
+    //Once connected, wait for the connection to have something rather than polling it
+    if(!part->watched && part->state != q2pc_part_connect){
+        const int fd = trans_conn_fd(&part->conn);
+        if(fd >= 0){
+            struct epoll_event event = { .events = EPOLLIN, .data.ptr = part };
+            if(epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, fd, &event)){
+                ch_log_fatal("Could not watch participant %li on fd=%i: %s\n", part->client_id, fd, strerror(errno));
+            }
+            part->watched = true;
+        }
+    }
+
+    return !part->watched || part->writing || part->unacked;
+}
+
+
+//Wake up when the earliest held vote is due, unless it's already set to go off sooner
+static void arm_timer(part_thread* thread, i64 due_us)
+{
+    if(!due_us || (thread->timer_due_us && thread->timer_due_us <= due_us)){
+        return;
+    }
+
+    const struct itimerspec when = {
+        .it_value = { .tv_sec = due_us / (1000 * 1000), .tv_nsec = due_us % (1000 * 1000) * 1000 },
+    };
+    if(timerfd_settime(thread->timer_fd, TFD_TIMER_ABSTIME, &when, NULL)){
+        ch_log_fatal("Could not set participant vote timer: %s\n", strerror(errno));
+    }
+    thread->timer_due_us = due_us;
+}
+
+
+static i64 earliest(i64 due_us, const q2pc_participant* part)
+{
+    if(!part->vote_due_us){
+        return due_us;
+    }
+
+    return due_us ? MIN(due_us, part->vote_due_us) : part->vote_due_us;
+}
+
+
+static void* run_participants(void* p)
+{
+    part_thread* thread = (part_thread*)p;
+    struct epoll_event events[PART_EVENTS_MAX];
+
+    ch_log_debug1("Running %li participants from %li\n", thread->count, thread->parts[0].client_id);
+    bool spin = true;
+    int ready = 0;
+    while(!driver_stop && thread->live){
+
+        //Go round the polled participants when there's been nothing else to do, or when some have no descriptor
+        i64 due_us = 0;
+        if(spin || ready == 0){
+            spin     = false;
+            i64 kept = 0;
+            for(i64 i = 0; i < thread->polled_count; i++){
+                q2pc_participant* part = &thread->parts[thread->polled[i]];
+                part->polled = drive(thread, part);
+                if(part->polled){
+                    thread->polled[kept++] = thread->polled[i];
+                    spin |= !part->watched;
+                    due_us = earliest(due_us, part);
+                }
+            }
+            thread->polled_count = kept;
+        }
+        arm_timer(thread, due_us);
+
+        const int timeout = spin ? 0 : thread->polled_count ? PART_TIMER_MS : PART_WAIT_MS;
+        ready = epoll_wait(thread->epoll_fd, events, PART_EVENTS_MAX, timeout);
+        if(ready < 0){
+            if(errno != EINTR){
+                ch_log_fatal("Participant epoll wait failed: %s\n", strerror(errno));
+            }
+            ready = 0;
+        }
+
+        due_us = 0;
+        for(int i = 0; i < ready; i++){
+            q2pc_participant* part = (q2pc_participant*)events[i].data.ptr;
+            if(!part){
+                //The vote timer, go round the held votes next time
+                u64 expired;
+                if(read(thread->timer_fd, &expired, sizeof(expired)) < 0 && errno != EAGAIN){
+                    ch_log_fatal("Could not read participant vote timer: %s\n", strerror(errno));
+                }
+                thread->timer_due_us = 0;
+                spin = true;
+                continue;
+            }
+
+            if(drive(thread, part) && !part->polled){
+                part->polled = true;
+                thread->polled[thread->polled_count++] = part - thread->parts;
+            }
+            due_us = earliest(due_us, part);
+        }
+        arm_timer(thread, due_us);
+
+        //Don't steal the CPU from the server if we're sharing one
+        if(spin && !ready){
+            sched_yield();
+        }
+    }
+
+    return NULL;
+}
+
+
+void q2pc_participants_start(const transport_s* transport, i64 first_id, i64 count, i64 coord_count, i64 coord_stride,
+        i64 thread_count, i64 msg_size, const q2pc_part_callbacks* callbacks)
+{
+    coord_count = MAX(coord_count, 1);
+    trans_reserve_fds(transport, count * coord_count);
+
+    //One session per participant per coordinator, a participant's sessions side by side
+    parts = calloc(count * coord_count, sizeof(q2pc_participant));
+    if(!parts){
+        ch_log_fatal("Could not allocate %li participants\n", count * coord_count);
+    }
+    part_count = count * coord_count;
+
+    for(i64 i = 0; i < count; i++){
+        for(i64 k = 0; k < coord_count; k++){
+            transport_s part_transport = *transport;
+            part_transport.server      = false;
+            part_transport.client_id   = first_id + i;
+            part_transport.port        = transport->port + coord_stride * k;
+
+            q2pc_participant_init(&parts[i * coord_count + k], trans_factory(&part_transport), first_id + i, msg_size,
+                    q2pc_vote_delay_us(transport, first_id + i), callbacks);
+        }
+    }
+
+    part_thread_count = MAX(1, MIN(thread_count, count));
+    part_threads      = calloc(part_thread_count, sizeof(part_thread));
+    if(!part_threads){
+        ch_log_fatal("Could not allocate %li participant threads\n", part_thread_count);
+    }
+
+    driver_stop = false;
+    for(i64 t = 0; t < part_thread_count; t++){
+        part_thread* thread = &part_threads[t];
+        const i64 lo        = count * t / part_thread_count * coord_count;
+        const i64 hi        = count * (t + 1) / part_thread_count * coord_count;
+
+        thread->parts    = parts + lo;
+        thread->count    = hi - lo;
+        thread->live     = hi - lo;
+        thread->epoll_fd = epoll_create1(0);
+        if(thread->epoll_fd < 0){
+            ch_log_fatal("Could not create participant epoll set: %s\n", strerror(errno));
+        }
+
+        thread->timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK);
+        struct epoll_event timer_event = { .events = EPOLLIN, .data.ptr = NULL };
+        if(thread->timer_fd < 0 || epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, thread->timer_fd, &timer_event)){
+            ch_log_fatal("Could not create participant vote timer: %s\n", strerror(errno));
+        }
+
+        //Everyone starts off polled, until they've connected
+        thread->polled = calloc(thread->count, sizeof(i64));
+        if(!thread->polled){
+            ch_log_fatal("Could not allocate participant poll list\n");
+        }
+        for(i64 i = 0; i < thread->count; i++){
+            thread->polled[i]       = i;
+            thread->parts[i].polled = true;
+        }
+        thread->polled_count = thread->count;
+
+        pthread_create(&thread->thread, NULL, run_participants, thread);
+    }
+    driver_running = true;
+}
+
+
+void q2pc_participants_wait()
+{
+    if(!driver_running){
+        return;
+    }
+
+    for(i64 t = 0; t < part_thread_count; t++){
+        pthread_join(part_threads[t].thread, NULL);
+    }
+    driver_running = false;
+}
+
+
+void q2pc_participants_halt()
+{
+    driver_stop = true;
+}
+
+
+void q2pc_participants_stop()
+{
+    if(!parts){
+        return;
+    }
+
+    driver_stop = true;
+    __sync_synchronize();
+    q2pc_participants_wait();
+
+    for(i64 t = 0; t < part_thread_count; t++){
+        close(part_threads[t].epoll_fd);
+        close(part_threads[t].timer_fd);
+        free(part_threads[t].polled);
+    }
+    free(part_threads);
+    part_threads = NULL;
+
+    i64 commits = 0;
+    i64 aborts  = 0;
+    i64 rtos    = 0;
+    for(i64 i = 0; i < part_count; i++){
+        commits += parts[i].commits;
+        aborts  += parts[i].aborts;
+        rtos    += parts[i].rtos;
+        if(parts[i].conn.priv){ parts[i].conn.delete(&parts[i].conn); }
+        parts[i].trans->delete(parts[i].trans);
+    }
+    ch_log_info("In process participants saw %li commits and %li aborts, %li retransmits fired\n", commits, aborts, rtos);
+
+    free(parts);
+    parts = NULL;
+}
@@ -0,0 +1,90 @@
+/*
+ * q2pc_participant.h
+ */
+
+#ifndef Q2PC_PARTICIPANT_H_
+#define Q2PC_PARTICIPANT_H_
+
+#include "../../deps/chaste/chaste.h"
+#include "../transport/q2pc_transport.h"
+
+//What a participant does with requests. Both are called on the thread driving the participant.
+typedef struct {
+    //Return true to vote yes. The payload is only there for the length of the call. Without one, participants vote
+    //with q2pc_vote_bench().
+    bool (*vote)(void* arg, i64 client_id, u64 txn, const char* payload, i64 payload_len);
+
+    //Optional. The coordinator's decision, before it is acknowledged.
+    void (*apply)(void* arg, i64 client_id, u64 txn, bool commit);
+
+    void* arg;
+} q2pc_part_callbacks;
+
+//The benchmark's stand in for a real decision, one vote in five is no
+bool q2pc_vote_bench(void* arg, i64 client_id, u64 txn, const char* payload, i64 payload_len);
+
+
+//Replies to a broadcast all arrive at the coordinator at once, and overflow the switch port in front of it. With a vote
+//window, participants hold their votes back by a slot of it picked by client id, so they arrive spread out.
+static inline i64 q2pc_vote_delay_us(const transport_s* transport, i64 client_id)
+{
+    if(!transport->vote_window_us){
+        return 0;
+    }
+
+    const i64 slots = MAX(transport->vote_slots, 1);
+    return (client_id - 1) % slots * transport->vote_window_us / slots;
+}
+
+
+//A non-blocking Q2PC participant. Each call to step does at most one message worth of work, so one thread can drive
+//many of these side by side.
+typedef enum { q2pc_part_connect, q2pc_part_phase1, q2pc_part_phase2, q2pc_part_done } q2pc_part_state_t;
+
+typedef struct {
+    q2pc_trans* trans;
+    q2pc_trans_conn conn;
+    q2pc_part_state_t state;
+    i64 client_id;
+    i64 msg_size;
+    q2pc_part_callbacks callbacks;
+    bool writing;   //A reply is waiting on end_write(), RUDP holds it while its window is full
+    bool unacked;   //Replies have gone but aren't acknowledged yet, RUDP retransmits them from flush
+    i64 vote_delay_us;
+    i64 vote_due_us; //A vote is held back until then, 0 if it isn't
+    i64 commits;
+    i64 aborts;
+    i64 rtos;
+
+    //For the driver
+    bool watched;   //Registered with the driver's epoll set
+    bool polled;    //On the driver's list of participants to step every time round
+} q2pc_participant;
+
+
+//callbacks may be NULL. Votes are held back by vote_delay_us, see q2pc_vote_delay_us().
+void q2pc_participant_init(q2pc_participant* part, q2pc_trans* trans, i64 client_id, i64 msg_size, i64 vote_delay_us,
+        const q2pc_part_callbacks* callbacks);
+
+//Returns Q2PC_ENONE if a message was handled, Q2PC_EAGAIN if there was nothing to do, or a reply is still on its way
+//out, Q2PC_EFIN if the server has gone
+int q2pc_participant_step(q2pc_participant* part);
+
+
+//Run count participants, with ids [first_id, first_id + count), spread over thread_count threads. Each participant
+//takes part in the transactions of coord_count coordinators, listening coord_stride ports apart, with a transport to
+//each. Its sessions are driven by the same thread, so its callbacks are never called concurrently. Each thread waits
+//on its participants' connections with epoll, connections without a descriptor are polled.
+void q2pc_participants_start(const transport_s* transport, i64 first_id, i64 count, i64 coord_count, i64 coord_stride,
+        i64 thread_count, i64 msg_size, const q2pc_part_callbacks* callbacks);
+
+//Wait until every participant has seen the server go, or until halted
+void q2pc_participants_wait();
+
+//Safe to call from a signal handler
+void q2pc_participants_halt();
+
+//Halt, wait and clean up
+void q2pc_participants_stop();
+
+#endif /* Q2PC_PARTICIPANT_H_ */
@@ -13,6 +13,7 @@
 #define Q2PC_EAGAIN (-1)
 #define Q2PC_EFIN (-2)
 #define Q2PC_RTOFIRED (-3)
+#define Q2PC_ETOOBIG (-4)
 
 
 
@@ -0,0 +1,14 @@
+/*
+ * libq2pc.h
+ */
+
+#ifndef LIBQ2PC_H_
+#define LIBQ2PC_H_
+
+//Everything needed to embed a Q2PC coordinator or participants in an application
+#include "errors/errors.h"
+#include "transport/q2pc_transport.h"
+#include "server/q2pc_coord.h"
+#include "client/q2pc_participant.h"
+
+#endif /* LIBQ2PC_H_ */
@@ -8,6 +8,9 @@
 #ifndef Q2PC_PROTOCOL_H_
 #define Q2PC_PROTOCOL_H_
 
+#include <endian.h>
+#include <string.h>
+
 #include "../../deps/chaste/chaste.h"
 
 typedef enum {
@@ -21,13 +24,143 @@ typedef enum {
     q2pc_con_msg
 } q2pc_msg_type_t;
 
-typedef struct __attribute__((__packed__)) {
-    i16 type;
-    i16 src_hostid;
-    i16 c_rto;
-    i16 s_rto;
-    i64 ts;
 
+#define Q2PC_VERSION        1
+#define Q2PC_VERSION_SHIFT  4
+#define Q2PC_FLAGS_MASK     0x0F
+
+#define Q2PC_FLAG_PAYLOAD   0x01    //The message carries on past the message size with a payload
+#define Q2PC_FLAG_ACK       0x02    //Not a message but a transport acknowledgement, see q2pc_trans_rudp.c
+#define Q2PC_FLAG_FRAG      0x08    //Not a message but a transport fragment of one, see udp_frag.h
+
+//Messages from the coordinator, participants are numbered from 1
+#define Q2PC_HOSTID_COORD   0xFFFFFFFFU
+
+#define Q2PC_RTO_MAX        0xFF
+
+
+//On the wire, little endian. Everything here is set by the protocol except the sequence and acknowledgement numbers,
+//which belong to transports that need them (RUDP) and are left alone by q2pc_msg_encode(). The header is followed by the payload
+//length and then padding up to the message size. If there is a payload, it comes after that.
+typedef struct __attribute__((__packed__)) {
+    u8  ver_flags;  //Version in the top nibble, flags in the bottom
+    u8  type;
+    u8  c_rto;      //Retransmit counts saturate at Q2PC_RTO_MAX
+    u8  s_rto;
+    u32 src_hostid;
+    u64 txn;
+    u32 ts;         //Low 32 bits of the time (us) the coordinator sent the request
+    u16 seq;
+    u16 ack;        //Last sequence number the sender has taken from the other end
 } q2pc_msg;
 
+//Messages are never smaller than this, 28B. That's up from 16B (24B with the RUDP sequence numbers) before the header
+//was fixed up: transaction ids are 64 bits so they don't wrap, host ids are 32 bits so more than 32K participants can be
+//told apart, and the u32 payload length follows the header.
+#define Q2PC_MSG_MIN (sizeof(q2pc_msg) + sizeof(u32))
+
+
+//Unpacked header
+typedef struct {
+    i64 version;
+    i64 flags;
+    i64 type;
+    i64 src_hostid;
+    i64 c_rto;
+    i64 s_rto;
+    u64 txn;
+    u32 ts;
+    u32 payload_len;
+} q2pc_hdr;
+
+
+//None of these branch, they're on the path of every message
+//msg must have room for Q2PC_MSG_MIN bytes
+static inline void q2pc_msg_encode(q2pc_msg* msg, const q2pc_hdr* hdr)
+{
+    const u32 payload_len = htole32(hdr->payload_len);
+    memcpy(msg + 1, &payload_len, sizeof(payload_len));
+
+    msg->ver_flags  = (Q2PC_VERSION << Q2PC_VERSION_SHIFT) | (hdr->flags & Q2PC_FLAGS_MASK);
+    msg->ver_flags |= (hdr->payload_len != 0) * Q2PC_FLAG_PAYLOAD;
+    msg->type       = hdr->type;
+    msg->c_rto      = MIN(hdr->c_rto, Q2PC_RTO_MAX);
+    msg->s_rto      = MIN(hdr->s_rto, Q2PC_RTO_MAX);
+    msg->src_hostid = htole32(hdr->src_hostid);
+    msg->txn        = htole64(hdr->txn);
+    msg->ts         = htole32(hdr->ts);
+}
+
+
+//The payload length is read whether it's there or not, msg must have Q2PC_MSG_MIN bytes
+static inline u32 q2pc_msg_payload_len(const q2pc_msg* msg)
+{
+    u32 payload_len;
+    memcpy(&payload_len, msg + 1, sizeof(payload_len));
+    return le32toh(payload_len) & -(u32)(msg->ver_flags & Q2PC_FLAG_PAYLOAD);
+}
+
+
+static inline void q2pc_msg_decode(const q2pc_msg* msg, q2pc_hdr* hdr)
+{
+    hdr->version    = msg->ver_flags >> Q2PC_VERSION_SHIFT;
+    hdr->flags      = msg->ver_flags & Q2PC_FLAGS_MASK;
+    hdr->type       = msg->type;
+    hdr->c_rto      = msg->c_rto;
+    hdr->s_rto      = msg->s_rto;
+    hdr->src_hostid = le32toh(msg->src_hostid);
+    hdr->txn        = le64toh(msg->txn);
+    hdr->ts         = le32toh(msg->ts);
+    hdr->payload_len = q2pc_msg_payload_len(msg);
+}
+
+
+//Length of the message at the front of a stream of them, 0 if there isn't enough of it there to tell yet
+static inline i64 q2pc_msg_delimit(const char* buff, i64 len, i64 msg_size)
+{
+    if(len < msg_size){
+        return 0;
+    }
+
+    return msg_size + q2pc_msg_payload_len((const q2pc_msg*)buff);
+}
+
+
+//Bump a retransmit counter in place without wrapping
+static inline void q2pc_msg_rto_inc(u8* rto)
+{
+    *rto += *rto < Q2PC_RTO_MAX;
+}
+
+
+static inline u16 q2pc_msg_seq(const q2pc_msg* msg)
+{
+    return le16toh(msg->seq);
+}
+
+
+static inline void q2pc_msg_set_seq(q2pc_msg* msg, u16 seq)
+{
+    msg->seq = htole16(seq);
+}
+
+
+static inline u16 q2pc_msg_ack(const q2pc_msg* msg)
+{
+    return le16toh(msg->ack);
+}
+
+
+static inline void q2pc_msg_set_ack(q2pc_msg* msg, u16 ack)
+{
+    msg->ack = htole16(ack);
+}
+
+
+//Recover a full time stamp from the 32 bits on the wire, given a time less than 2^32us (~71 minutes) after it
+static inline i64 q2pc_ts_expand(u32 ts, i64 now_us)
+{
+    return now_us - (u32)((u32)now_us - ts);
+}
+
 #endif /* Q2PC_PROTOCOL_H_ */
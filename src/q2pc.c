@@ -5,6 +5,7 @@
 #include "server/q2pc_server.h"
 #include "client/q2pc_client.h"
 #include "transport/q2pc_transport.h"
+#include "protocol/q2pc_protocol.h"
 
 USE_CH_LOGGER(CH_LOG_LVL_INFO,true,ch_log_tostderr,NULL);
 USE_CH_OPTIONS;
@@ -13,16 +14,24 @@ static struct {
 	//Server Options
 	i64 server;
 	i64 threads;
+	i64 coord_count;
+	i64 coord_stride;
 
 	//Client Options
 	char* client;
 	i64 client_id;
+	i64 client_count;
 
 	//Transports
 	bool trans_tcp_ln;
 	bool trans_udp_ln;
 	bool trans_rdp_ln;
 	bool trans_udp_qj;
+	bool trans_xdp_qj;
+	bool trans_pkt_qj;
+	bool trans_mcast_ln;
+	bool trans_shm_ln;
+	bool trans_mem_lo;
 
 	//Transport options
     char* bcast;
@@ -31,6 +40,19 @@ static struct {
 	i64 qjump_psize;
 	char* iface;
 	i64 msize;
+	i64 payload_size;
+	i64 sock_rcvbuf;
+	i64 sock_sndbuf;
+	i64 timestamping;
+	bool phc_synced;
+	i64 vote_window_us;
+	i64 vote_slots;
+	i64 xdp_queue;
+	char* mcast_group;
+	bool shm_doorbell;
+	bool tcp_nagle;
+	bool tcp_zero_copy;
+	bool hugepages;
 
 	//Logging options
 	bool log_no_colour;
@@ -54,22 +76,45 @@ int main(int argc, char** argv)
 	//Server options
     ch_opt_addii(CH_OPTION_OPTIONAL,'s',"server","Put q2pc in server mode, specify the number of clients", &options.server, 0);
     ch_opt_addii(CH_OPTION_OPTIONAL,'T',"threads","The number of threads to use", &options.threads, 1);
+    ch_opt_addii(CH_OPTION_OPTIONAL,'K',"coordinators","The number of independent coordinators, each pinned to 1 + threads cores of its own (clients must match)", &options.coord_count, 1);
+    ch_opt_addii(CH_OPTION_OPTIONAL,'G',"coord-stride","Port distance between coordinators, must clear every port a coordinator uses", &options.coord_stride, 1000);
 
     //Client options
     ch_opt_addsi(CH_OPTION_OPTIONAL,'c',"client","Put q2pc in client mode, specify server address in x.x.x.x format", &options.client, NULL);
     ch_opt_addii(CH_OPTION_OPTIONAL,'C',"id","The client ID to use for this client (must be >0)", &options.client_id, -1);
+    ch_opt_addii(CH_OPTION_OPTIONAL,'A',"client-count","The number of participants to run in this client, with ids counting up from --id", &options.client_count, 1);
 
     //Transports
     ch_opt_addbi(CH_OPTION_FLAG,    'u',"udp-ln","Use Linux based UDP transport [default]", &options.trans_udp_ln, false);
     ch_opt_addbi(CH_OPTION_FLAG,    't',"tcp-ln","Use Linux based TCP transport", &options.trans_tcp_ln, false);
     ch_opt_addbi(CH_OPTION_FLAG,    'r',"rdp-ln","Use Linux based UDP transport with reliability", &options.trans_rdp_ln, false);
     ch_opt_addbi(CH_OPTION_FLAG,    'q',"udp-qj","Use NetMap based UDP transport over Q-Jump", &options.trans_udp_qj, false);
+    ch_opt_addbi(CH_OPTION_FLAG,    'x',"xdp-qj","Use AF_XDP kernel bypass UDP transport over Q-Jump", &options.trans_xdp_qj, false);
+    ch_opt_addbi(CH_OPTION_FLAG,    'k',"pkt-qj","Use PACKET_MMAP ring based UDP transport over Q-Jump", &options.trans_pkt_qj, false);
+    ch_opt_addbi(CH_OPTION_FLAG,    'M',"mcast-ln","Use Linux based UDP transport with reliable multicast dissemination", &options.trans_mcast_ln, false);
+    ch_opt_addbi(CH_OPTION_FLAG,    'l',"shm-ln","Use shared memory transport for clients on the same host", &options.trans_shm_ln, false);
+    ch_opt_addbi(CH_OPTION_FLAG,    'I',"mem-lo","Use in process memory transport, the server runs its own clients", &options.trans_mem_lo, false);
 
     //Qjump Transport options
     ch_opt_addii(CH_OPTION_OPTIONAL,'p',"port","Port to use for all transports", &options.port, 7331);
     ch_opt_addsi(CH_OPTION_OPTIONAL,'B',"broadcast","The broadcast IP address to use in UDP mode ini x.x.x.x format", &options.bcast, "127.0.0.0");
+    ch_opt_addii(CH_OPTION_OPTIONAL,'e',"qjump-epoch","Q-Jump network epoch (us), 0 to leave pacing to the Q-Jump qdisc", &options.qjump_epoch, 0);
+    ch_opt_addii(CH_OPTION_OPTIONAL,'L',"qjump-limit","Bytes a host may send at high priority each Q-Jump epoch, the rest goes at low priority", &options.qjump_psize, 0);
     ch_opt_addsi(CH_OPTION_OPTIONAL,'i',"iface","The interface name to use", &options.iface, "eth4");
     ch_opt_addii(CH_OPTION_OPTIONAL,'m',"message-size","Size of the messages to use", &options.msize, 128);
+    ch_opt_addii(CH_OPTION_OPTIONAL,'P',"payload-size","Size of the payload sent with each request (clients must match the server)", &options.payload_size, 0);
+    ch_opt_addii(CH_OPTION_OPTIONAL,'b',"rcvbuf","Socket receive buffer size (bytes) in the UDP transports, 0 for the kernel default", &options.sock_rcvbuf, 0);
+    ch_opt_addii(CH_OPTION_OPTIONAL,'d',"sndbuf","Socket send buffer size (bytes) in the UDP transports, 0 for the kernel default", &options.sock_sndbuf, 0);
+    ch_opt_addii(CH_OPTION_OPTIONAL,'E',"timestamping","Kernel receive timestamps in the UDP transports, 0 off, 1 software, 2 hardware (needs --phc-synced)", &options.timestamping, 0);
+    ch_opt_addbi(CH_OPTION_FLAG,    'y',"phc-synced","The NIC clock is kept on system time (e.g. by phc2sys), so its timestamps can be used", &options.phc_synced, false);
+    ch_opt_addii(CH_OPTION_OPTIONAL,'V',"vote-window","Spread votes over this long (us) so they don't all arrive at once, 0 for no pacing", &options.vote_window_us, 0);
+    ch_opt_addii(CH_OPTION_OPTIONAL,'Y',"vote-slots","How many slots the vote window is cut into, participants take them by client id", &options.vote_slots, 16);
+    ch_opt_addii(CH_OPTION_OPTIONAL,'Q',"xdp-queue","The NIC queue to bind to in XDP mode", &options.xdp_queue, 0);
+    ch_opt_addsi(CH_OPTION_OPTIONAL,'g',"mcast-group","The multicast group to use in multicast mode in x.x.x.x format", &options.mcast_group, "239.1.3.37");
+    ch_opt_addbi(CH_OPTION_FLAG,    'D',"shm-doorbell","Let clients sleep on a futex instead of polling in shared memory mode", &options.shm_doorbell, false);
+    ch_opt_addbi(CH_OPTION_FLAG,    'N',"tcp-nagle","Leave Nagle's algorithm on in TCP mode (writes are batched and flushed explicitly anyway)", &options.tcp_nagle, false);
+    ch_opt_addbi(CH_OPTION_FLAG,    'Z',"tcp-zerocopy","Use MSG_ZEROCOPY for large TCP writes", &options.tcp_zero_copy, false);
+    ch_opt_addbi(CH_OPTION_FLAG,    'H',"hugepages","Back connection buffers with huge pages where possible", &options.hugepages, false);
 
     //Q2PC Logging
     ch_opt_addbi(CH_OPTION_FLAG,     'n', "no-colour",  "Turn off colour log output",     &options.log_no_colour, false);
@@ -128,14 +173,24 @@ int main(int argc, char** argv)
     transport_opt_count += options.trans_tcp_ln ? 1 : 0;
     transport_opt_count += options.trans_rdp_ln ? 1 : 0;
     transport_opt_count += options.trans_udp_qj ? 1 : 0;
+    transport_opt_count += options.trans_xdp_qj ? 1 : 0;
+    transport_opt_count += options.trans_pkt_qj ? 1 : 0;
+    transport_opt_count += options.trans_mcast_ln ? 1 : 0;
+    transport_opt_count += options.trans_shm_ln ? 1 : 0;
+    transport_opt_count += options.trans_mem_lo ? 1 : 0;
 
     //Make sure only 1 choice has been made
     if(transport_opt_count > 1){
-        ch_log_fatal("Q2PC: Can only use one transport at a time, you've selected the following [%s%s%s%s%s ]\n ",
+        ch_log_fatal("Q2PC: Can only use one transport at a time, you've selected the following [%s%s%s%s%s%s%s%s%s ]\n ",
                 options.trans_udp_ln ? "udp-ln " : "",
                 options.trans_tcp_ln ? "tcp-ln " : "",
                 options.trans_tcp_ln ? "rdp-ln " : "",
-                options.trans_udp_qj ? "udp-qj " : ""
+                options.trans_udp_qj ? "udp-qj " : "",
+                options.trans_xdp_qj ? "xdp-qj " : "",
+                options.trans_pkt_qj ? "pkt-qj " : "",
+                options.trans_mcast_ln ? "mcast-ln " : "",
+                options.trans_shm_ln ? "shm-ln " : "",
+                options.trans_mem_lo ? "mem-lo " : ""
         );
     }
 
@@ -144,12 +199,21 @@ int main(int argc, char** argv)
         options.trans_udp_ln = 1;
     }
 
+    if(options.timestamping > 1 && !options.phc_synced){
+        ch_log_warn("Hardware timestamps are on the NIC's clock, which may not be on system time. Using software ones, pass --phc-synced if it is\n");
+    }
+
     //Finally figure out he actual one that we want
     transport_s transport = {0};
     transport.type          = options.trans_udp_ln ? udp_ln : transport.type;
     transport.type          = options.trans_tcp_ln ? tcp_ln : transport.type;
     transport.type          = options.trans_udp_qj ? udp_qj : transport.type;
     transport.type          = options.trans_rdp_ln ? rdp_ln : transport.type;
+    transport.type          = options.trans_xdp_qj ? xdp_qj : transport.type;
+    transport.type          = options.trans_pkt_qj ? pkt_qj : transport.type;
+    transport.type          = options.trans_mcast_ln ? mcast_ln : transport.type;
+    transport.type          = options.trans_shm_ln ? shm_ln : transport.type;
+    transport.type          = options.trans_mem_lo ? mem_lo : transport.type;
     transport.qjump_epoch   = options.qjump_epoch;
     transport.qjump_limit   = options.qjump_psize;
     transport.port          = options.port;
@@ -160,7 +224,20 @@ int main(int argc, char** argv)
     transport.bcast         = options.bcast;
     transport.iface         = options.iface;
     transport.rto_us        = options.rto_us;
-    transport.msize         = options.msize;
+    transport.msize         = MAX(options.msize, (i64)Q2PC_MSG_MIN);
+    transport.payload_size  = options.payload_size;
+    transport.sock_rcvbuf   = options.sock_rcvbuf;
+    transport.sock_sndbuf   = options.sock_sndbuf;
+    transport.timestamping  = options.timestamping;
+    transport.phc_synced    = options.phc_synced;
+    transport.vote_window_us = options.vote_window_us;
+    transport.vote_slots    = options.vote_slots;
+    transport.xdp_queue     = options.xdp_queue;
+    transport.mcast_group   = options.mcast_group;
+    transport.shm_doorbell  = options.shm_doorbell;
+    transport.tcp_nagle     = options.tcp_nagle;
+    transport.tcp_zero_copy = options.tcp_zero_copy;
+    transport.hugepages     = options.hugepages;
 
 
     //Configure application options
@@ -172,19 +249,49 @@ int main(int argc, char** argv)
     }
 
 
+    if(options.client && options.trans_mem_lo){
+        ch_log_fatal("Q2PC: Configuration error, in process memory transport only works in server mode.\n");
+    }
+
+    if(options.payload_size < 0 || options.payload_size > 0xFFFFFFFFL){
+        ch_log_fatal("Q2PC: Configuration error, payload size must be between 0 and 4GB.\n");
+    }
+
     if(options.client && options.client_id < 0){
         ch_log_fatal("Q2PC: Configuration error, in client mode, you must specify a client id >0.\n");
     }
 
+    if(options.coord_count < 1){
+        ch_log_fatal("Q2PC: Configuration error, there must be at least 1 coordinator.\n");
+    }
+
+    if(options.coord_count > 1 && options.coord_stride < 1){
+        ch_log_fatal("Q2PC: Configuration error, coordinators can't share a port.\n");
+    }
+
+    if(options.sock_rcvbuf < 0 || options.sock_rcvbuf > 0x7FFFFFFF || options.sock_sndbuf < 0 || options.sock_sndbuf > 0x7FFFFFFF){
+        ch_log_fatal("Q2PC: Configuration error, socket buffer sizes must be between 0 and 2GB.\n");
+    }
+
+    if(options.vote_window_us < 0 || options.vote_slots < 1){
+        ch_log_fatal("Q2PC: Configuration error, the vote window can't be negative and needs at least 1 slot.\n");
+    }
+
+    if(options.client_count < 1){
+        ch_log_fatal("Q2PC: Configuration error, client count must be at least 1.\n");
+    }
+
 
     /********************************************************/
     //real work begins here:
     /********************************************************/
     if(options.client){
-        run_client(&transport, options.client_id, options.waittime, options.msize);
+        run_client(&transport, options.client_id, options.client_count, options.coord_count, options.coord_stride,
+                options.threads, options.waittime, options.msize);
     }
     else{
-        run_server(options.threads, options.server,&transport, options.waittime, options.report_int, options.stats_len, options.msize);
+        run_server(options.threads, options.server, options.coord_count, options.coord_stride, &transport,
+                options.waittime, options.report_int, options.stats_len);
     }
 
     return 0;
@@ -0,0 +1,719 @@
+/*
+ * q2pc_coord.c
+ */
+
+ //#LINKFLAGS=-lpthread
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE //For CPU affinity
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+
+#include "q2pc_coord.h"
+#include "q2pc_server_worker.h"
+#include "../transport/q2pc_transport.h"
+#include "../errors/errors.h"
+#include "../protocol/q2pc_protocol.h"
+
+#define COORD_IDLE_US (100 * 1000) //How long the coordinator sleeps on an empty queue before checking whether to stop
+#define CACHE_LINE 64
+
+//What goes on the submission ring
+typedef struct {
+    u64 txn;
+    void* user;
+    i64 submit_us;
+    int payload_count;
+    i64 payload_len;
+    struct iovec payload[Q2PC_PAYLOAD_IOV_MAX];
+} q2pc_submission;
+
+typedef enum {  q2pc_request_success, q2pc_request_fail, q2pc_commit_success, q2pc_commit_fail, q2pc_cluster_fail } q2pc_commit_status_t;
+
+
+static i64 time_now_us()
+{
+    struct timeval ts_now = {0};
+    gettimeofday(&ts_now, NULL);
+    return ts_now.tv_sec * 1000 * 1000 + ts_now.tv_usec;
+}
+
+
+//Wait for all clients to connect
+static void do_connectall(q2pc_coord* coord)
+{
+    coord->cons = CH_ARRAY_NEW(TRANS_CONN,coord->client_count,NULL);
+    if(!coord->cons){ ch_log_fatal("Cannot allocate connections array\n"); }
+
+    i64 connected = 0;
+    while(connected < coord->client_count){
+        for(int i = 0; i < coord->client_count; i++){
+
+            q2pc_trans_conn* conn = coord->cons->off(coord->cons,i);
+
+            if(!conn->priv){
+                //Connections are non-blocking
+                if(coord->trans->connect(coord->trans, conn)){
+                    continue;
+                }
+                coord->table.fd[i] = trans_conn_fd(conn);
+            }
+
+
+            char* data;
+            i64 len;
+            if(conn->beg_read(conn,&data, &len)){
+                continue;
+            }
+
+            if(len < coord->msg_size){
+                ch_log_fatal("Message is smaller than Q2PC message should be. (%li<%li)\n", len, coord->msg_size);
+            }
+
+            q2pc_hdr hdr;
+            q2pc_msg_decode((q2pc_msg*)data, &hdr);
+            if(hdr.version != Q2PC_VERSION){
+                ch_log_fatal("Client speaks protocol version %li, expected %i\n", hdr.version, Q2PC_VERSION);
+            }
+
+            switch(hdr.type){
+                case q2pc_con_msg: connected++; break;
+                default:
+                    ch_log_fatal("Unexpected message of type %li\n", hdr.type);
+            }
+
+            ch_log_debug3("Connection from %li at index %i\n", hdr.src_hostid, i);
+
+            conn->end_read(conn);
+        }
+    }
+
+}
+
+
+//Announce the next message, each worker sends it out on its own connections, and does their retransmits. The payload
+//is referenced, not copied, where the transport allows. It must stay put until the request is done. Returns false if
+//the cluster has failed.
+static bool send_request(q2pc_coord* coord, q2pc_msg_type_t msg_type, const q2pc_submission* sub)
+{
+    coord->send_type          = msg_type;
+    coord->send_payload       = sub->payload;
+    coord->send_payload_count = sub->payload_count;
+    coord->send_payload_len   = sub->payload_len;
+    __sync_synchronize(); //Everything above is seen before the round moves on
+
+    const u64 round = ++coord->send_round;
+    for(int i = 0; i < coord->real_thread_count && !coord->stop_signal; ){
+        if(coord->sends_done[i] == round){
+            i++;
+            continue;
+        }
+        __asm__("pause");
+    }
+
+    return !coord->send_failed;
+}
+
+
+static void wait_for_votes(q2pc_coord* coord)
+{
+    const i64 ts_start_us = time_now_us();
+
+    //Wait to either timeout or for all votes to be counted
+    //Every worker has started counting this round by now, send_request() waits for them
+    ch_log_debug2("Q2PC Server: [M] Waiting for votes\n");
+    while(!coord->stop_signal){
+        if(coord->wait_time_us >= 0 && time_now_us() > ts_start_us + coord->wait_time_us){
+            ch_log_warn("Timed out waiting for client response(s)\n");
+            break;
+        }
+
+        i64 total_votes = 0;
+        for(int i = 0; i < coord->real_thread_count; i++){
+            total_votes+= coord->votes_count[i];
+        }
+        if(total_votes >= coord->client_count){
+            ch_log_debug2("Q2PC Server: [M] Done, collected %li votes\n", total_votes);
+            break;
+        }
+    }
+
+}
+
+
+static q2pc_commit_status_t do_phase1(q2pc_coord* coord, const q2pc_submission* sub)
+{
+
+    q2pc_commit_status_t result = q2pc_request_success;
+
+    //Both phases carry the same transaction number, votes for anything else are stale
+    coord->txn_id = sub->txn;
+
+    //send out a broadcast message to all servers
+    ch_log_debug2("Q2PC Server: [M]--> request\n");
+    if(!send_request(coord, q2pc_request_msg, sub)){
+        return q2pc_cluster_fail;
+    }
+
+    //wait for all the responses
+    wait_for_votes(coord);
+
+    //The workers carry on, anything they count from here on is too late for this round
+    const u64 round = coord->send_round;
+    for(int i = 0; i < coord->client_count && !coord->stop_signal; i++){
+        __builtin_prefetch((const void*)(coord->table.votes + i + CACHE_LINE / sizeof(i64))); //A line ahead
+        const i64 vote = q2pc_vote_in_round(coord->table.votes[i], round);
+        switch(vote){
+            case q2pc_vote_yes_msg:
+                ch_log_debug1("client %li voted yes.\n",i);
+                continue;
+
+            case q2pc_vote_no_msg:
+                ch_log_debug1("client %li voted no.\n",i);
+                result = q2pc_request_fail;
+                break;
+
+            case q2pc_lost_msg:
+                ch_log_warn("Q2PC: phase 1 - client %li message lost, cluster failed\n",i);
+                result = q2pc_cluster_fail;
+                break;
+
+            default:
+                ch_log_debug1("Q2PC: Server [M] phase 1 - client %li sent an unexpected message type %i\n",i,vote);
+                ch_log_error("Protocol violation\n");
+                result = q2pc_cluster_fail;
+        }
+
+        if(result == q2pc_cluster_fail){
+            break;
+        }
+    }
+
+    return result;
+}
+
+
+static q2pc_commit_status_t do_phase2(q2pc_coord* coord, q2pc_commit_status_t phase1_status)
+{
+    static const q2pc_submission no_payload = {0};
+
+    switch(phase1_status){
+        case q2pc_request_success:
+            ch_log_debug2("Q2PC Server: [M]--> commit\n");
+            if(!send_request(coord, q2pc_commit_msg, &no_payload)){
+                return q2pc_cluster_fail;
+            }
+            break;
+        case q2pc_request_fail:
+            ch_log_debug2("Q2PC Server: [M]--> cancel\n");
+            if(!send_request(coord, q2pc_cancel_msg, &no_payload)){
+                return q2pc_cluster_fail;
+            }
+            break;
+        case q2pc_cluster_fail:
+            return q2pc_cluster_fail;
+        default:
+            ch_log_fatal("Internal error: unexpected result from phase 1\n");
+    }
+
+    //wait for all the responses
+    wait_for_votes(coord);
+
+    const u64 round = coord->send_round;
+    q2pc_commit_status_t result = q2pc_commit_success;
+    for(int i = 0; i < coord->client_count && !coord->stop_signal; i++){
+        __builtin_prefetch((const void*)(coord->table.votes + i + CACHE_LINE / sizeof(i64))); //A line ahead
+
+        const i64 vote = q2pc_vote_in_round(coord->table.votes[i], round);
+        switch(vote){
+            case q2pc_ack_msg:
+                continue;
+
+            case q2pc_lost_msg:
+                ch_log_warn("Q2PC: Server [M] phase 2 - client %li message lost, cluster failed\n",i);
+                result = q2pc_cluster_fail;
+                break;
+            default:
+                ch_log_debug1("Q2PC: Server [M] phase 2 - client %li sent an unexpected message type %i\n",i,vote);
+                result = q2pc_cluster_fail;
+        }
+    }
+
+    if(result == q2pc_cluster_fail){
+        return q2pc_cluster_fail;
+    }
+
+    switch(phase1_status){
+        case q2pc_request_success:  return q2pc_commit_success;
+        case q2pc_request_fail:     return q2pc_commit_fail;
+        default:
+            ch_log_fatal("Internal error: unexpected result from phase 1\n");
+    }
+
+    //Unreachable
+    return -1;
+
+}
+
+
+static q2pc_txn_status_t run_txn(q2pc_coord* coord, const q2pc_submission* sub)
+{
+    q2pc_commit_status_t status;
+    status = do_phase1(coord, sub);
+    status = do_phase2(coord, status);
+
+    //Lost votes are down to the stop, not the cluster
+    if(coord->stop_signal){
+        return q2pc_txn_stopped;
+    }
+
+    switch(status){
+        case q2pc_commit_success:   ch_log_debug1("Commit success!\n"); return q2pc_txn_commit;
+        case q2pc_commit_fail:      ch_log_debug1("Commit fail!\n");    return q2pc_txn_abort;
+        case q2pc_cluster_fail:     return q2pc_txn_failed;
+        default:
+            ch_log_fatal("Internal error: unexpected result from phase 2\n");
+    }
+
+    //Unreachable
+    return -1;
+}
+
+
+//Completions wait for room, the application has to keep up
+static void complete(q2pc_coord* coord, const q2pc_submission* sub, q2pc_txn_status_t status)
+{
+    const q2pc_completion completion = {
+        .txn        = sub->txn,
+        .status     = status,
+        .user       = sub->user,
+        .latency_us = time_now_us() - sub->submit_us,
+    };
+
+    if(coord->on_complete){
+        coord->on_complete(&completion, coord->on_complete_arg);
+        return;
+    }
+
+    char* data;
+    i64 len;
+    while(!spsc_ring_beg_write(coord->complete_ring, &data, &len)){
+        sched_yield();
+    }
+
+    memcpy(data, &completion, sizeof(completion));
+    spsc_ring_end_write(coord->complete_ring, sizeof(completion));
+    spsc_ring_ring(coord->complete_ring, false);
+}
+
+
+static void* run_coord(void* p)
+{
+    q2pc_coord* coord = (q2pc_coord*)p;
+
+    while(!coord->stop_signal){
+        char* data;
+        i64 len;
+        if(!spsc_ring_beg_read(coord->submit_ring, &data, &len)){
+            spsc_ring_wait(coord->submit_ring, COORD_IDLE_US, false);
+            continue;
+        }
+
+        q2pc_submission sub;
+        memcpy(&sub, data, sizeof(sub));
+        spsc_ring_end_read(coord->submit_ring);
+
+        const q2pc_txn_status_t status = run_txn(coord, &sub);
+        complete(coord, &sub, status);
+
+        if(status == q2pc_txn_failed){
+            coord->stop_signal = true;
+        }
+    }
+
+    //Nothing else gets in, anything already in never runs
+    pthread_mutex_lock(&coord->submit_lock);
+    coord->closed = true;
+    pthread_mutex_unlock(&coord->submit_lock);
+
+    char* data;
+    i64 len;
+    while(spsc_ring_beg_read(coord->submit_ring, &data, &len)){
+        q2pc_submission sub;
+        memcpy(&sub, data, sizeof(sub));
+        spsc_ring_end_read(coord->submit_ring);
+        complete(coord, &sub, q2pc_txn_stopped);
+    }
+
+    return NULL;
+}
+
+
+//One field of the connection table, zeroed, on a line of its own
+static void* new_column(i64 count, i64 size, const char* what)
+{
+    void* column = NULL;
+    posix_memalign(&column, CACHE_LINE, MAX(count * size, CACHE_LINE));
+    if(!column){
+        ch_log_fatal("Could not allocate memory for %s\n", what);
+    }
+
+    bzero(column, MAX(count * size, CACHE_LINE));
+    return column;
+}
+
+
+static spsc_ring* new_ring(i64 slots, i64 slot_size)
+{
+    spsc_ring* ring = aligned_alloc(SPSC_RING_CACHELINE, spsc_ring_bytes(slots, slot_size));
+    if(!ring){
+        ch_log_fatal("Could not allocate a ring of %li slots\n", slots);
+    }
+
+    spsc_ring_init(ring, slots, slot_size);
+    return ring;
+}
+
+
+static void pin_thread(pthread_t thread, i64 core, const char* what)
+{
+    const i64 cores = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core % cores, &cpus);
+    if(pthread_setaffinity_np(thread, sizeof(cpus), &cpus)){
+        ch_log_warn("Could not pin %s to core %li\n", what, core % cores);
+    }
+}
+
+
+q2pc_coord* q2pc_coord_new(const transport_s* transport, const q2pc_coord_config* config)
+{
+    q2pc_coord* coord = calloc(1, sizeof(q2pc_coord));
+    if(!coord){
+        ch_log_fatal("Could not allocate coordinator\n");
+    }
+
+    coord->client_count    = config->client_count;
+    coord->trans_type      = transport->type;
+    coord->msg_size        = transport->msize;
+    coord->payload_size    = transport->payload_size;
+    coord->wait_time_us    = config->wait_time_us;
+    coord->on_complete     = config->on_complete;
+    coord->on_complete_arg = config->on_complete_arg;
+    coord->txn_first       = config->coord_id;
+    coord->txn_stride      = MAX(config->coord_count, 1);
+    pthread_mutex_init(&coord->submit_lock, NULL);
+    pthread_mutex_init(&coord->complete_lock, NULL);
+
+    coord->submit_ring   = new_ring(config->queue_len, sizeof(q2pc_submission));
+    coord->complete_ring = new_ring(config->queue_len, sizeof(q2pc_completion));
+
+    //Set up and init the connection table, the voting scoreboard is in there too
+    coord->table.fd      = new_column(coord->client_count, sizeof(int), "connection descriptors");
+    coord->table.pending = new_column(coord->client_count, sizeof(i64), "pending writes");
+    coord->table.rtos    = new_column(coord->client_count, sizeof(i64), "RTO fired counter");
+    coord->table.votes   = new_column(coord->client_count, sizeof(i64), "votes scoreboard");
+    for(i64 i = 0; i < coord->client_count; i++){
+        coord->table.fd[i] = -1;
+    }
+
+
+    //Set up all the connections
+    ch_log_info("Waiting for clients to connect...\n\r");
+    trans_reserve_fds(transport, coord->client_count);
+    coord->trans = trans_factory(transport);
+    do_connectall(coord);
+    ch_log_info("Waiting for clients to connect... Done.\n");
+
+
+    //Calculate the connection to thread mappings
+    i64 cons_per_thread      = MAX( (coord->client_count + config->thread_count -1) / config->thread_count, 1);
+    coord->real_thread_count = MIN(config->thread_count, coord->client_count);
+    coord->stats_len         = config->stats_len / coord->real_thread_count;
+    i64 lo = 0;
+    i64 hi = lo + cons_per_thread;
+
+    posix_memalign((void*)&coord->votes_count, sizeof(i64), sizeof(i64) * coord->real_thread_count);
+    if(!coord->votes_count){
+        ch_log_fatal("Could not allocate memory for votes counter\n");
+    }
+    bzero((void*)coord->votes_count,sizeof(i64) * coord->real_thread_count);
+
+    coord->sends_done = calloc(coord->real_thread_count, sizeof(u64));
+    if(!coord->sends_done){
+        ch_log_fatal("Could not allocate memory for send rounds\n");
+    }
+
+    coord->cycles = calloc(coord->real_thread_count, sizeof(worker_cycles_t));
+    if(!coord->cycles){
+        ch_log_fatal("Could not allocate memory for cycle counts\n");
+    }
+
+
+    ch_log_debug1("Allocating stats mem for %li threads with size %i\n", coord->real_thread_count, sizeof(stat_t*));
+    coord->stats_mem  = calloc(coord->real_thread_count, sizeof(stat_t*));
+    coord->stats_used = calloc(coord->real_thread_count, sizeof(i64));
+    if(!coord->stats_mem || !coord->stats_used){
+        ch_log_fatal("Could not allocate memory for stats arrays fired counter\n");
+    }
+
+
+    //Fire up the threads
+    coord->threads = (pthread_t*)calloc(coord->real_thread_count, sizeof(pthread_t));
+    for(int i = 0; i < coord->real_thread_count; i++){
+        ch_log_debug2("Starting thread %i with connections [%li,%li]\n", i, lo, hi -1);
+
+        if(coord->stats_len){
+            coord->stats_mem[i] = calloc(coord->stats_len, sizeof(stat_t));
+            if(!coord->stats_mem[i]){
+                ch_log_fatal("Could not allocate %liB of memory for statistics counter\n", sizeof(stat_t) * coord->stats_len);
+            }
+        }
+
+        //Do this to avoid synchronisation errors
+        thread_params_t* params = (thread_params_t*)calloc(1,sizeof(thread_params_t));
+        if(!params){
+            ch_log_fatal("Cannot allocate thread parameters\n");
+        }
+        params->coord       = coord;
+        params->lo          = lo;
+        params->hi          = hi;
+        params->thread_id   = i;
+
+        pthread_create(coord->threads + i, NULL, run_thread, (void*)params);
+        if(config->pin){
+            pin_thread(coord->threads[i], config->first_core + 1 + i, "worker");
+        }
+
+        lo = hi;
+        hi = lo + cons_per_thread;
+        hi = MIN(coord->cons->size,hi); //Clip so we don't go over the bounds
+    }
+
+    pthread_create(&coord->coord_thread, NULL, run_coord, coord);
+    if(config->pin){
+        pin_thread(coord->coord_thread, config->first_core, "coordinator");
+    }
+    return coord;
+}
+
+
+int q2pc_coord_submit(q2pc_coord* coord, const struct iovec* payload, int payload_count, void* user, u64* txn_o)
+{
+    q2pc_submission sub = {
+        .user          = user,
+        .submit_us     = time_now_us(),
+        .payload_count = payload_count,
+    };
+
+    if(payload_count > Q2PC_PAYLOAD_IOV_MAX){
+        return Q2PC_ETOOBIG;
+    }
+
+    for(int i = 0; i < payload_count; i++){
+        sub.payload[i]   = payload[i];
+        sub.payload_len += payload[i].iov_len;
+    }
+
+    if(sub.payload_len > coord->payload_size){
+        return Q2PC_ETOOBIG;
+    }
+
+    pthread_mutex_lock(&coord->submit_lock);
+    if(coord->closed){
+        pthread_mutex_unlock(&coord->submit_lock);
+        return Q2PC_EFIN;
+    }
+
+    char* data;
+    i64 len;
+    if(!spsc_ring_beg_write(coord->submit_ring, &data, &len)){
+        pthread_mutex_unlock(&coord->submit_lock);
+        return Q2PC_EAGAIN;
+    }
+
+    //Numbered in the order they'll run
+    sub.txn = coord->txn_first + coord->txn_stride * ++coord->txn_next;
+    memcpy(data, &sub, sizeof(sub));
+    spsc_ring_end_write(coord->submit_ring, sizeof(sub));
+    pthread_mutex_unlock(&coord->submit_lock);
+
+    spsc_ring_ring(coord->submit_ring, false);
+
+    if(txn_o){
+        *txn_o = sub.txn;
+    }
+    return Q2PC_ENONE;
+}
+
+
+i64 q2pc_coord_poll(q2pc_coord* coord, q2pc_completion* completions_o, i64 max)
+{
+    i64 count = 0;
+
+    pthread_mutex_lock(&coord->complete_lock);
+    char* data;
+    i64 len;
+    while(count < max && spsc_ring_beg_read(coord->complete_ring, &data, &len)){
+        memcpy(&completions_o[count], data, sizeof(q2pc_completion));
+        spsc_ring_end_read(coord->complete_ring);
+        count++;
+    }
+    pthread_mutex_unlock(&coord->complete_lock);
+
+    return count;
+}
+
+
+bool q2pc_coord_wait(q2pc_coord* coord, i64 timeout_us)
+{
+    return spsc_ring_wait(coord->complete_ring, timeout_us, false);
+}
+
+
+void q2pc_coord_stop(q2pc_coord* coord)
+{
+    coord->stop_signal = true;
+    __sync_synchronize(); //Full fence
+}
+
+
+void q2pc_coord_join(q2pc_coord* coord)
+{
+    if(coord->joined){
+        return;
+    }
+
+    q2pc_coord_stop(coord);
+    pthread_join(coord->coord_thread, NULL);
+    for(int i = 0; i < coord->real_thread_count; i++){
+        pthread_join(coord->threads[i],NULL);
+    }
+    coord->joined = true;
+}
+
+
+i64 q2pc_coord_rtos(const q2pc_coord* coord)
+{
+    return coord->total_rtos;
+}
+
+
+void q2pc_coord_cycles(const q2pc_coord* coord, u64* rx_cycles_o, u64* rx_msgs_o, u64* tx_cycles_o, u64* tx_msgs_o)
+{
+    for(i64 i = 0; i < coord->real_thread_count; i++){
+        *rx_cycles_o += coord->cycles[i].rx_cycles;
+        *rx_msgs_o   += coord->cycles[i].rx_msgs;
+        *tx_cycles_o += coord->cycles[i].tx_cycles;
+        *tx_msgs_o   += coord->cycles[i].tx_msgs;
+    }
+}
+
+
+i64 q2pc_coord_drops(const q2pc_coord* coord)
+{
+    i64 drops = 0;
+    for(i64 i = 0; i < coord->client_count; i++){
+        q2pc_trans_conn* conn = coord->cons->first + i;
+        if(conn->priv){
+            drops += trans_conn_drops(conn);
+        }
+    }
+
+    return drops;
+}
+
+
+i64 q2pc_coord_latencies(const q2pc_coord* coord, bool wire_to_user, i64* lat_o, i64 max)
+{
+    i64 count = 0;
+    for(i64 i = 0; i < coord->real_thread_count; i++){
+        for(i64 j = 0; j < coord->stats_used[i]; j++){
+            const stat_t* stat = &coord->stats_mem[i][j];
+            if(wire_to_user && !stat->time_rx){
+                continue;
+            }
+
+            if(count < max){
+                lat_o[count] = stat->time_end - (wire_to_user ? stat->time_rx : stat->time_start);
+            }
+            count++;
+        }
+    }
+
+    return count;
+}
+
+
+void q2pc_coord_write_stats(const q2pc_coord* coord, int fd)
+{
+    char tmp_line[1024] = {0};
+    i64 start_us = 0;
+
+    for(int i = 0; i < coord->real_thread_count; i++){
+        for(int j = 0; j < coord->stats_used[i]; j++){
+            const stat_t* stat = &coord->stats_mem[i][j];
+            if(j == 0){
+                start_us = stat->time_start;
+            }
+
+            int len = snprintf(tmp_line,1024,"%li %li %li %li %li %li %li %li %li %li %li %li\n",
+                    stat->time_start - start_us,
+                    stat->thread_id,
+                    stat->client_id,
+                    stat->c_rtos,
+                    stat->s_rtos,
+                    stat->time_start,
+                    stat->time_end,
+                    stat->time_end -  stat->time_start,
+                    stat->type,
+                    stat->drops,
+                    stat->time_rx,
+                    stat->time_rx ? stat->time_end - stat->time_rx : 0);
+            write(fd,tmp_line, len);
+        }
+    }
+}
+
+
+void q2pc_coord_delete(q2pc_coord* coord)
+{
+    if(!coord){
+        return;
+    }
+
+    q2pc_coord_join(coord);
+
+    for(int i = 0; i < coord->client_count; i++){
+        q2pc_trans_conn* conn = coord->cons->off(coord->cons,i);
+        if(conn->priv){
+            conn->delete(conn);
+        }
+    }
+    coord->trans->delete(coord->trans);
+
+    for(int i = 0; i < coord->real_thread_count; i++){
+        free(coord->stats_mem[i]);
+    }
+    free(coord->stats_mem);
+    free(coord->stats_used);
+    free(coord->threads);
+    free((void*)coord->votes_count);
+    free(coord->table.fd);
+    free(coord->table.pending);
+    free(coord->table.rtos);
+    free((void*)coord->table.votes);
+    free((void*)coord->sends_done);
+    free(coord->cycles);
+    free(coord->submit_ring);
+    free(coord->complete_ring);
+    free(coord);
+}
@@ -0,0 +1,100 @@
+/*
+ * q2pc_coord.h
+ */
+
+#ifndef Q2PC_COORD_H_
+#define Q2PC_COORD_H_
+
+#include <sys/uio.h>
+
+#include "../../deps/chaste/chaste.h"
+#include "../transport/q2pc_transport.h"
+
+//A Q2PC coordinator. Transactions run one at a time on a thread of its own, in the order they were submitted. Any
+//thread may submit, submitting never blocks. Results come back on a completion queue, or through a callback on the
+//coordinator's thread.
+typedef struct q2pc_coord_s q2pc_coord;
+
+typedef enum {
+    q2pc_txn_commit = 0,
+    q2pc_txn_abort,     //At least one participant voted no
+    q2pc_txn_failed,    //A participant was lost, the coordinator stops
+    q2pc_txn_stopped    //The coordinator stopped before the transaction could finish
+} q2pc_txn_status_t;
+
+typedef struct {
+    u64 txn;
+    q2pc_txn_status_t status;
+    void* user;         //As submitted
+    i64 latency_us;     //From submission to completion
+} q2pc_completion;
+
+typedef void (*q2pc_complete_cb)(const q2pc_completion* completion, void* arg);
+
+#define Q2PC_PAYLOAD_IOV_MAX 8
+
+typedef struct {
+    i64 client_count;
+    i64 thread_count;               //Worker threads collecting votes
+    i64 wait_time_us;               //How long to wait for votes before the cluster has failed, <0 forever
+    i64 stats_len;                  //Votes to keep statistics on, the coordinator stops when they run out. 0 for none.
+    i64 queue_len;                  //Transactions that can wait to run, and completions to be polled. A power of 2.
+    q2pc_complete_cb on_complete;   //Optional. Called instead of queuing completions.
+    void* on_complete_arg;
+
+    //Coordinators in the same cluster number transactions coord_id + coord_count * n, so they never share an id.
+    //0 and 0 for just the one.
+    i64 coord_id;
+    i64 coord_count;
+
+    //Optional. Pin the coordinator thread to first_core and worker i to first_core + 1 + i, wrapping around the cores
+    //there are. They all busy poll, so coordinators sharing a host want disjoint sets of thread_count + 1 cores.
+    bool pin;
+    i64 first_core;
+} q2pc_coord_config;
+
+
+//Returns once every participant has connected. In process (mem-lo) participants are started beforehand with
+//q2pc_participants_start(), and stopped before the coordinator is deleted.
+q2pc_coord* q2pc_coord_new(const transport_s* transport, const q2pc_coord_config* config);
+
+//Queue a transaction. The payload goes to every participant with the request, from where it is, so it must stay put
+//until the transaction completes. Returns Q2PC_ENONE and the transaction number in txn_o, which may be NULL,
+//Q2PC_EAGAIN if the queue is full, Q2PC_ETOOBIG if the payload is bigger than the transport's payload size, or
+//Q2PC_EFIN if the coordinator has stopped.
+int q2pc_coord_submit(q2pc_coord* coord, const struct iovec* payload, int payload_count, void* user, u64* txn_o);
+
+//Take up to max completions. Never blocks, returns how many there were.
+i64 q2pc_coord_poll(q2pc_coord* coord, q2pc_completion* completions_o, i64 max);
+
+//Sleep until there is something to poll, for up to timeout_us. Returns true if there is.
+bool q2pc_coord_wait(q2pc_coord* coord, i64 timeout_us);
+
+//Stop taking transactions, anything still queued completes as stopped. Safe to call from a signal handler.
+void q2pc_coord_stop(q2pc_coord* coord);
+
+//Stop, and wait for the coordinator and its workers to finish. The RTO count and statistics are final after this.
+void q2pc_coord_join(q2pc_coord* coord);
+
+i64 q2pc_coord_rtos(const q2pc_coord* coord);
+
+//Time stamp counter cycles the workers spent taking replies in and sending messages out, and how many messages that
+//was. Sending on a reliable transport includes waiting for its acks. Added on to the totals given, so coordinators
+//can be summed. Join first.
+void q2pc_coord_cycles(const q2pc_coord* coord, u64* rx_cycles_o, u64* rx_msgs_o, u64* tx_cycles_o, u64* tx_msgs_o);
+
+//Datagrams the kernel has dropped on the coordinator's connections for want of receive buffer, so far. Only a
+//snapshot while the coordinator is running.
+i64 q2pc_coord_drops(const q2pc_coord* coord);
+
+//How long each reply kept in the statistics took to come back (us), up to max of them. With wire_to_user, how long
+//the timestamped ones took from the kernel receiving them to the worker taking them instead. Returns how many there
+//are, so it can be called with max=0 to size lat_o. Join first.
+i64 q2pc_coord_latencies(const q2pc_coord* coord, bool wire_to_user, i64* lat_o, i64 max);
+
+//One line per vote seen, as many as were kept. Join first.
+void q2pc_coord_write_stats(const q2pc_coord* coord, int fd);
+
+void q2pc_coord_delete(q2pc_coord* coord);
+
+#endif /* Q2PC_COORD_H_ */
@@ -11,5 +11,8 @@
 #include "../../deps/chaste/chaste.h"
 #include "../transport/q2pc_transport.h"
 
-void run_server(const i64 thread_count, const i64 client_count,  const transport_s* transport, i64 wait_time, i64 report_int, i64 stats, i64 msize);
+//Runs coord_count coordinators side by side, each with thread_count worker threads and its own connection to every
+//client, on ports coord_stride apart
+void run_server(const i64 thread_count, const i64 client_count, i64 coord_count, i64 coord_stride,
+        const transport_s* transport, i64 wait_time, i64 report_int, i64 stats);
 #endif /* Q2PC_SERVER_H_ */
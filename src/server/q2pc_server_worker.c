@@ -11,143 +11,284 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <signal.h>
+#include <errno.h>
+#include <unistd.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
 
-#include "q2pc_server.h"
 #include "../transport/q2pc_transport.h"
 #include "../errors/errors.h"
 #include "../protocol/q2pc_protocol.h"
+#include "../transport/q2pc_trans_udp_conn.h"
+#include "../transport/tsc.h"
 #include "q2pc_server_worker.h"
 
-//Globals that matter
-extern CH_ARRAY(TRANS_CONN)* cons;
-extern CH_ARRAY(i64)* seqs;
-extern volatile bool stop_signal;
-extern volatile bool pause_signal;
-//static pthread_t* threads               = NULL;
-//static i64 real_thread_count            = 0;
-extern volatile i64* votes_scoreboard ;
-extern volatile i64* votes_count;
-extern stat_t** stats_mem;
-//static q2pc_trans* trans                = NULL;
-//static volatile i64 seq_no              = 0;
-
 
 #define BARRIER()  __asm__ volatile("" ::: "memory")
+#define MAX_RTOS (200L * 1000L)
+#define WORKER_EVENTS_MAX 256
 
-void* run_thread( void* p)
+
+static i64 time_now_us()
 {
-    thread_params_t* params = (thread_params_t*)p;
-    i64 lo          = params->lo;
-    i64 hi          = params->hi;
-    i64 count       = params->count;
-    i64 thread_id   = params->thread_id;
-    i64 stats_len   = params->stats_len;
-    free(params);
+    struct timeval ts_now = {0};
+    gettimeofday(&ts_now, NULL);
+    return ts_now.tv_sec * 1000 * 1000 + ts_now.tv_usec;
+}
 
-    i64 stats_idx = 0;
 
-    //ch_log_debug1("Allocating ")
-    stats_mem[thread_id] = calloc(stats_len, sizeof(stat_t));
-    if(!stats_mem[thread_id]){
-        ch_log_fatal("Could not allocate %liB of memory for statistics counter\n", sizeof(stat_t) * stats_len);
+//Q-Jump transports broadcast on the write and are reliable. Multicast writes once to the group and the clients
+//recover losses themselves with NACKs. Either way we only need to send once, and don't have to wait.
+static bool trans_is_bcast(const q2pc_coord* coord)
+{
+    switch(coord->trans_type){
+        case udp_qj:
+        case xdp_qj:
+        case pkt_qj:
+        case mcast_ln:
+            return true;
+        default:
+            return false;
     }
+}
 
 
-    ch_log_debug3("Running worker thread\n");
-    while(!stop_signal){
+//Reliable transports may still be waiting on acks, or have had to retransmit, only a closed stream is a failure
+static bool flush_ok(q2pc_coord* coord, int result)
+{
+    switch(result){
+        case Q2PC_RTOFIRED:
+            __sync_fetch_and_add(&coord->total_rtos, 1);
+            return true;
+        case Q2PC_ENONE:
+        case Q2PC_EAGAIN:
+            return true;
+        default:
+            return false;
+    }
+}
 
-        //Busy loop if we're told to stop processing for a moment
-        if(pause_signal){
-            votes_count[thread_id] = 0;
-            __asm__("pause");
-            continue;
-        }
 
-        //Otherwise, busy loop looking for data
-        for(int i = lo; i < hi; i++){
-            q2pc_trans_conn* con = cons->off(cons,i);
-            char* data = NULL;
-            i64 len = 0;
-            i64 result = con->beg_read(con,&data, &len);
-            if(result){
-                if(result == Q2PC_EAGAIN){
-                    continue;
-                }
-
-                if(result == Q2PC_EFIN){
-                    stop_signal = 1;
-                    BARRIER();
-                    ch_log_warn("Cannot read any more data from connection %li on thread %li. Stream has finished\n", i, thread_id);
-                    usleep(1000); //A a bit for the signal to propagate
-                    break;
-
-                }
-
-            }
-
-            q2pc_msg* msg = (q2pc_msg*)data;
-            //Bounds check the answer
-
-            if(msg->src_hostid < 1 || msg->src_hostid > count){
-                ch_log_warn("Client ID (%li) is out of the expected range [%i,%i]. Ignoring vote\n", msg->src_hostid, 1, count);
-                //con->end_read(con);
-                continue;
-            }
-
-            votes_scoreboard[msg->src_hostid - 1] = msg->type;
-            switch(msg->type){
-                case q2pc_vote_yes_msg: ch_log_debug2("Q2PC Server: [%i]<-- vote yes from (%li)\n", thread_id, msg->src_hostid); break;
-                case q2pc_vote_no_msg:  ch_log_debug2("Q2PC Server: [%i]<-- vote no  from (%li)\n", thread_id, msg->src_hostid); break;
-                case q2pc_ack_msg:      ch_log_debug2("Q2PC Server: [%i]<-- ack      from (%li)\n", thread_id, msg->src_hostid); break;
-                default:
-                    ch_log_warn("Q2PC Server: [%i] <-- Unknown message (%i)   from (%li)\n",thread_id, msg->type, msg->src_hostid );
-            }
-            con->end_read(con);
-            BARRIER(); //Make sure there is no memory reordering here
-
-            votes_count[thread_id]++;
-            BARRIER();
-
-            struct timeval ts_end   = {0};
-            gettimeofday(&ts_end, NULL);
-            const i64 ts_end_us = ts_end.tv_sec * 1000 * 1000 + ts_end.tv_usec;
-
-            ch_log_debug3("Got ts with %li\n", msg->ts) ;
-
-            stats_mem[thread_id][stats_idx].time_end   = ts_end_us;
-            stats_mem[thread_id][stats_idx].thread_id  = thread_id;
-            stats_mem[thread_id][stats_idx].time_start = msg->ts;
-            stats_mem[thread_id][stats_idx].client_id  = msg->src_hostid;
-            stats_mem[thread_id][stats_idx].c_rtos     = msg->c_rto;
-            stats_mem[thread_id][stats_idx].s_rtos     = msg->s_rto;
-            stats_mem[thread_id][stats_idx].type       = msg->type;
-
-
-            stats_idx++;
-            if(stats_idx >= stats_len){
-                stop_signal = 1;
-                BARRIER();
-                ch_log_warn("Run out of stats memory in thread %li Exiting\n", thread_id);
-                usleep(1000); //A a bit for the signal to propagate
-                break;
-            }
-
-            ch_log_debug2("Q2PC Server: [%li] Vote count=%li\n", thread_id,votes_count[thread_id]);
+//Votes answer requests, acks answer commits and cancels, and only for the transaction they were sent in
+static bool answers_round(u64 round_txn, q2pc_msg_type_t round_sent, const q2pc_hdr* hdr)
+{
+    if(hdr->txn != round_txn){
+        return false;
+    }
+
+    switch(hdr->type){
+        case q2pc_vote_yes_msg:
+        case q2pc_vote_no_msg:
+            return round_sent == q2pc_request_msg;
+        case q2pc_ack_msg:
+            return round_sent == q2pc_commit_msg || round_sent == q2pc_cancel_msg;
+        default:
+            return true; //Counted, so the coordinator sees the protocol has been broken
+    }
+}
+
+
+//Everything a worker thread keeps to itself
+typedef struct {
+    q2pc_coord* coord;
+    i64 lo;
+    i64 hi;
+    i64 thread_id;
+    stat_t* stats;
+    i64 stats_idx;
+
+    //What the current round is waiting for
+    u64 round;
+    u64 sent_round;     //The last round this worker has sent out on its connections
+    u64 round_txn;
+    q2pc_msg_type_t round_sent;
+
+    int epoll_fd;       //Connections with a descriptor, edge triggered
+    i64* polled;        //Connections without one, looked at every time round
+    i64 polled_count;
+
+    i64 flush_next;     //Connection to flush next time round
+
+    worker_cycles_t cycles;
+} worker_t;
+
+
+//Move on to the round the coordinator has announced. Sending for it is left to the loop.
+static void enter_round(worker_t* w)
+{
+    q2pc_coord* coord = w->coord;
+
+    w->round      = coord->send_round;
+    __sync_synchronize(); //See the announcement after the round
+    w->round_txn  = coord->txn_id;
+    w->round_sent = coord->send_type;
+    coord->votes_count[w->thread_id] = 0;
+}
+
+
+//Count a reply against the round it answers. drops is what the kernel has dropped on its connection so far, rx_ts_ns
+//when the kernel received it, or 0. Returns Q2PC_ENONE, or Q2PC_EFIN if the worker has to stop.
+static int take_vote(worker_t* w, const q2pc_hdr hdr, i64 drops, i64 rx_ts_ns)
+{
+    q2pc_coord* coord = w->coord;
+    const i64 thread_id = w->thread_id;
+
+    //Bounds check the answer
+    if(hdr.version != Q2PC_VERSION){
+        ch_log_warn("Message with protocol version %li, expected %i. Ignoring vote\n", hdr.version, Q2PC_VERSION);
+        return Q2PC_ENONE;
+    }
+
+    if(hdr.src_hostid < 1 || hdr.src_hostid > coord->client_count){
+        ch_log_warn("Client ID (%li) is out of the expected range [%i,%i]. Ignoring vote\n", hdr.src_hostid, 1, coord->client_count);
+        return Q2PC_ENONE;
+    }
+
+    //On a broadcast transport, someone else's send can get replies back to us before we've seen the round move on
+    if(!answers_round(w->round_txn, w->round_sent, &hdr) && coord->send_round != w->round){
+        enter_round(w);
+    }
+
+    if(!answers_round(w->round_txn, w->round_sent, &hdr)){
+        ch_log_debug1("Q2PC Server: [%li] Stale response %li for txn %lu from (%li) in txn %lu\n", thread_id, hdr.type, hdr.txn, hdr.src_hostid, w->round_txn);
+        return Q2PC_ENONE;
+    }
+
+    coord->table.votes[hdr.src_hostid - 1] = q2pc_vote_tag(w->round, hdr.type);
+    switch(hdr.type){
+        case q2pc_vote_yes_msg: ch_log_debug2("Q2PC Server: [%i]<-- vote yes from (%li)\n", thread_id, hdr.src_hostid); break;
+        case q2pc_vote_no_msg:  ch_log_debug2("Q2PC Server: [%i]<-- vote no  from (%li)\n", thread_id, hdr.src_hostid); break;
+        case q2pc_ack_msg:      ch_log_debug2("Q2PC Server: [%i]<-- ack      from (%li)\n", thread_id, hdr.src_hostid); break;
+        default:
+            ch_log_warn("Q2PC Server: [%i] <-- Unknown message (%li)   from (%li)\n",thread_id, hdr.type, hdr.src_hostid );
+    }
+    BARRIER(); //Make sure there is no memory reordering here
+
+    coord->votes_count[thread_id]++;
+    BARRIER();
+
+    ch_log_debug2("Q2PC Server: [%li] Vote count=%li\n", thread_id,coord->votes_count[thread_id]);
+    if(!coord->stats_len){
+        return Q2PC_ENONE;
+    }
+
+    const i64 ts_end_us = time_now_us();
+    ch_log_debug3("Got ts with %u\n", hdr.ts) ;
+
+    stat_t* stat = &w->stats[w->stats_idx];
+    stat->time_end   = ts_end_us;
+    stat->thread_id  = thread_id;
+    stat->time_start = q2pc_ts_expand(hdr.ts, ts_end_us);
+    stat->client_id  = hdr.src_hostid;
+    stat->c_rtos     = hdr.c_rto;
+    stat->s_rtos     = hdr.s_rto;
+    stat->type       = hdr.type;
+    stat->drops      = drops;
+    stat->time_rx    = rx_ts_ns / 1000;
+
+    w->stats_idx++;
+    coord->stats_used[thread_id] = w->stats_idx;
+    if(w->stats_idx >= coord->stats_len){
+        coord->stop_signal = 1;
+        BARRIER();
+        ch_log_warn("Run out of stats memory in thread %li Exiting\n", thread_id);
+        usleep(1000); //A a bit for the signal to propagate
+        return Q2PC_EFIN;
+    }
+
+    return Q2PC_ENONE;
+}
+
 
+//UDP connections are called directly, so the compiler can inline them into the loop
+#define WORKER(name)                        udp_##name
+#define WORKER_BEG_READ(c,data,len)         udp_conn_beg_read(c,data,len)
+#define WORKER_END_READ(c)                  udp_conn_end_read(c)
+#define WORKER_BEG_WRITE(c,data,len)        udp_conn_beg_write(c,data,len)
+#define WORKER_END_WRITE(c,len)             udp_conn_end_write(c,len)
+#define WORKER_END_WRITEV(c,len,iov,count)  udp_conn_end_writev(c,len,iov,count)
+#define WORKER_HAS_WRITEV(c)                ((void)(c), true)
+#define WORKER_SET_CLASS(c,cls)             ((void)(c), (void)(cls))
+#define WORKER_DROPS(c)                     ((i64)((q2pc_udp_conn_priv*)(c)->priv)->rx_meta.drops)
+#define WORKER_RX_TS(c)                     (((q2pc_udp_conn_priv*)(c)->priv)->rx_meta.rx_ts_ns)
+#define WORKER_FLUSH(c)                     ((void)(c), Q2PC_ENONE)
+#define WORKER_BCAST(coord)                 ((void)(coord), false)
+#include "q2pc_server_worker_loop.h"
+
+//Everything else goes through the connection
+#define WORKER(name)                        generic_##name
+#define WORKER_BEG_READ(c,data,len)         (c)->beg_read(c,data,len)
+#define WORKER_END_READ(c)                  (c)->end_read(c)
+#define WORKER_BEG_WRITE(c,data,len)        (c)->beg_write(c,data,len)
+#define WORKER_END_WRITE(c,len)             (c)->end_write(c,len)
+#define WORKER_END_WRITEV(c,len,iov,count)  (c)->end_writev(c,len,iov,count)
+#define WORKER_HAS_WRITEV(c)                ((c)->end_writev != NULL)
+#define WORKER_SET_CLASS(c,cls)             trans_conn_set_class(c,cls)
+#define WORKER_DROPS(c)                     trans_conn_drops(c)
+#define WORKER_RX_TS(c)                     trans_conn_rx_ts(c)
+#define WORKER_FLUSH(c)                     trans_conn_flush(c)
+#define WORKER_BCAST(coord)                 trans_is_bcast(coord)
+#include "q2pc_server_worker_loop.h"
+
+
+static void watch_range(worker_t* w)
+{
+    q2pc_coord* coord = w->coord;
+
+    w->epoll_fd = epoll_create1(0);
+    if(w->epoll_fd < 0){
+        ch_log_fatal("Could not create worker epoll set: %s\n", strerror(errno));
+    }
+
+    w->polled = calloc(MAX(w->hi - w->lo, 1), sizeof(i64));
+    if(!w->polled){
+        ch_log_fatal("Could not allocate worker poll list\n");
+    }
+
+    for(i64 i = w->lo; i < w->hi; i++){
+        const int fd = coord->table.fd[i];
+        struct epoll_event event = { .events = EPOLLIN | EPOLLET, .data.u64 = i };
+        if(fd < 0 || epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &event)){
+            w->polled[w->polled_count++] = i;
         }
     }
 
+    ch_log_debug1("Worker %li watching %li connections, polling %li\n", w->thread_id, w->hi - w->lo - w->polled_count, w->polled_count);
+}
+
 
+void* run_thread( void* p)
+{
+    thread_params_t* params = (thread_params_t*)p;
+    worker_t w = {
+        .coord      = params->coord,
+        .lo         = params->lo,
+        .hi         = params->hi,
+        .thread_id  = params->thread_id,
+        .stats      = params->coord->stats_mem[params->thread_id],
+        .round_sent = q2pc_lost_msg,
+        .flush_next = params->lo,
+    };
+    q2pc_coord* coord = w.coord;
+    free(params);
 
-    ch_log_debug3("Cleaning up connections...\n");
-    //We're done with the connections now, clean them up
-    for(int i = lo; i < hi; i++){
-        q2pc_trans_conn* con = cons->off(cons,i);
-        con->delete(con);
+    watch_range(&w);
+
+    ch_log_debug3("Running worker thread\n");
+#ifdef Q2PC_WORKER_GENERIC
+    generic_loop(&w); //For comparison
+#else
+    switch(coord->trans_type){
+        case udp_ln:    udp_loop(&w);       break;
+        default:        generic_loop(&w);   break;
     }
+#endif
 
+    coord->cycles[w.thread_id] = w.cycles;
+    close(w.epoll_fd);
+    free(w.polled);
+
+    //The connections go with the coordinator, it may still be writing to them
     ch_log_debug3("Exiting worker thread\n");
     return NULL;
 }
-
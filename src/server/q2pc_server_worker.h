@@ -8,14 +8,14 @@
 #ifndef Q2PC_SERVER_WORKER_H_
 #define Q2PC_SERVER_WORKER_H_
 
+#include <pthread.h>
+
+#include "../../deps/chaste/chaste.h"
+#include "../transport/q2pc_transport.h"
+#include "../transport/spsc_ring.h"
+#include "../protocol/q2pc_protocol.h"
+#include "q2pc_coord.h"
 
-typedef struct{
-    i64 lo;
-    i64 hi;
-    i64 count;
-    i64 thread_id;
-    i64 stats_len;
-} thread_params_t;
 
 typedef struct{
     i64 thread_id;
@@ -25,9 +25,109 @@ typedef struct{
     i64 time_start;
     i64 time_end;
     i64 type;
+    i64 drops;  //Kernel drops on the connection so far
+    i64 time_rx; //When the kernel received it, 0 without timestamping
 } stat_t;
 
 
+//Time stamp counter cycles the worker loop spent per message
+typedef struct{
+    u64 rx_cycles;
+    u64 rx_msgs;
+    u64 tx_cycles;
+    u64 tx_msgs;
+} worker_cycles_t;
+
+
+//Per connection state the hot loops scan. Each field is a dense array of its own, so a scan only pulls in the cache
+//lines of the field it looks at, rather than a line or two of every connection's state.
+typedef struct{
+    int* fd;                //Taken at connect, -1 if the connection doesn't have one
+    i64* pending;           //Connections still to be written this round. Each worker keeps its own in [lo,hi).
+    i64* rtos;              //Retransmits fired this round
+    volatile i64* votes;    //By client, tagged with the round they were cast in
+} q2pc_conn_table;
+
+
+//Everything a coordinator and its worker threads share
+struct q2pc_coord_s {
+    CH_ARRAY(TRANS_CONN)* cons;
+    q2pc_trans* trans;
+    transport_e trans_type;
+    i64 client_count;
+    i64 msg_size;
+    i64 payload_size;
+    i64 wait_time_us;
+
+    volatile bool stop_signal;
+    q2pc_conn_table table;
+    volatile i64* votes_count;          //Per thread, for the current round
+    volatile u64 txn_id;
+    volatile i64 total_rtos;
+
+    //Phase announcement. Each worker sends the message to its own connections when the round moves on, and marks the
+    //round done once they all have it.
+    volatile u64 send_round;
+    q2pc_msg_type_t send_type;
+    const struct iovec* send_payload;
+    int send_payload_count;
+    i64 send_payload_len;
+    volatile u64* sends_done;   //Per thread
+    volatile bool send_failed;
+
+    //Worker threads
+    pthread_t* threads;
+    i64 real_thread_count;
+    stat_t** stats_mem;
+    i64* stats_used;
+    i64 stats_len;  //Per thread
+    worker_cycles_t* cycles; //Per thread, filled in as the worker exits
+
+    //The coordinator thread runs transactions off the submission ring, one at a time, and posts the results to the
+    //completion ring. Many threads may submit and poll, so each end of the rings the application has is locked.
+    pthread_t coord_thread;
+    spsc_ring* submit_ring;
+    spsc_ring* complete_ring;
+    pthread_mutex_t submit_lock;
+    pthread_mutex_t complete_lock;
+    volatile bool closed;   //No more submissions are taken
+    u64 txn_next;           //Transactions handed out so far
+    u64 txn_first;          //Numbered txn_first + txn_stride * n
+    u64 txn_stride;
+    bool joined;
+    q2pc_complete_cb on_complete;
+    void* on_complete_arg;
+};
+
+
+//Each message sent out starts a new round. Replies are only counted against the round they answer, so the scoreboard
+//never has to be cleared, and workers never have to stop while the coordinator looks at it.
+#define Q2PC_ROUND_SHIFT 8
+
+static inline i64 q2pc_vote_tag(u64 round, q2pc_msg_type_t type)
+{
+    return (i64)(round << Q2PC_ROUND_SHIFT) | type;
+}
+
+//What was cast in the round, or lost if nothing was
+static inline i64 q2pc_vote_in_round(i64 vote, u64 round)
+{
+    if((u64)vote >> Q2PC_ROUND_SHIFT != round){
+        return q2pc_lost_msg;
+    }
+
+    return vote & ((1 << Q2PC_ROUND_SHIFT) - 1);
+}
+
+
+typedef struct{
+    q2pc_coord* coord;
+    i64 lo;
+    i64 hi;
+    i64 thread_id;
+} thread_params_t;
+
+
 void* run_thread( void* p);
 
 
@@ -0,0 +1,304 @@
+/*
+ * q2pc_server_worker_loop.h
+ */
+
+//The worker's hot loop, written once for every transport. q2pc_server_worker.c includes this once per specialisation,
+//so that the transport calls can be inlined where it knows what the transport is. Before including it, define:
+//
+//  WORKER(name)                    - Name of a function in this specialisation
+//  WORKER_BEG_READ(c,data,len)     - The connection calls
+//  WORKER_END_READ(c)
+//  WORKER_BEG_WRITE(c,data,len)
+//  WORKER_END_WRITE(c,len)
+//  WORKER_END_WRITEV(c,len,iov,count)
+//  WORKER_HAS_WRITEV(c)            - True if the connection can send the payload from where it is
+//  WORKER_SET_CLASS(c,cls)         - The traffic class the next write goes out in
+//  WORKER_DROPS(c)                 - What the kernel has dropped on the connection so far
+//  WORKER_RX_TS(c)                 - When the kernel received the last message read, 0 if it wasn't stamped
+//  WORKER_FLUSH(c)                 - Push out anything the connection has queued
+//  WORKER_BCAST(coord)             - True if a single write reaches every participant
+//
+//They are all undefined again at the end.
+
+
+//Transports that can't send the payload from where it is get a copy of it behind the message
+static void WORKER(stage_payload)(const q2pc_coord* coord, q2pc_trans_conn* conn, char* data, i64 len)
+{
+    if(WORKER_HAS_WRITEV(conn) || !coord->send_payload_len){
+        return;
+    }
+
+    if(len < coord->msg_size + coord->send_payload_len){
+        ch_log_fatal("Not enough space to send a Q2PC message with its payload. Needed %li, but found %li\n", coord->msg_size + coord->send_payload_len, len);
+    }
+
+    data += coord->msg_size;
+    for(int i = 0; i < coord->send_payload_count; i++){
+        memcpy(data, coord->send_payload[i].iov_base, coord->send_payload[i].iov_len);
+        data += coord->send_payload[i].iov_len;
+    }
+}
+
+
+static int WORKER(commit_write)(const q2pc_coord* coord, q2pc_trans_conn* conn)
+{
+    WORKER_SET_CLASS(conn, trans_msg_class(coord->send_type, coord->send_payload_len));
+    if(WORKER_HAS_WRITEV(conn)){
+        return WORKER_END_WRITEV(conn, coord->msg_size, coord->send_payload, coord->send_payload_count);
+    }
+
+    return WORKER_END_WRITE(conn, coord->msg_size + coord->send_payload_len);
+}
+
+
+static void WORKER(write_header)(const q2pc_coord* coord, q2pc_trans_conn* conn)
+{
+    char* data;
+    i64 len;
+    if(WORKER_BEG_WRITE(conn,&data,&len)){
+        ch_log_fatal("Could not complete broadcast message request\n");
+    }
+
+    if(len < coord->msg_size){
+        ch_log_fatal("Not enough space to send a Q2PC message. Needed %li, but found %li\n", coord->msg_size, len);
+    }
+
+    const i64 ts_start_us = time_now_us();
+    const q2pc_hdr hdr = {
+        .type        = coord->send_type,
+        .src_hostid  = Q2PC_HOSTID_COORD,
+        .txn         = coord->txn_id,
+        .ts          = ts_start_us,
+        .payload_len = coord->send_payload_len,
+    };
+    q2pc_msg_encode((q2pc_msg*)data, &hdr);
+    WORKER(stage_payload)(coord, conn, data, len);
+    ch_log_debug3("Set ts to %li\n", ts_start_us) ;
+}
+
+
+//Send the announced message on connections [lo,hi). Returns false if the cluster has failed.
+static bool WORKER(send_range)(q2pc_coord* coord, i64 lo, i64 hi)
+{
+    if(WORKER_BCAST(coord)){
+        if(lo){
+            return true; //Whoever has the first connection does the lot
+        }
+
+        q2pc_trans_conn* conn = coord->cons->first;
+        WORKER(write_header)(coord, conn);
+
+        int result = WORKER(commit_write)(coord, conn);
+        //One write reaches everyone, so it has to go. Keep trying while the transport says later
+        while((result == Q2PC_EAGAIN || result == Q2PC_RTOFIRED) && !coord->stop_signal){
+            result = WORKER(commit_write)(coord, conn);
+        }
+
+        switch (result) {
+            case Q2PC_ENONE:
+            case Q2PC_EAGAIN:   //Only if we are stopping
+            case Q2PC_RTOFIRED:
+                break;
+            case Q2PC_EFIN:
+                ch_log_error("Cannot complete broadcast write request, cluster failed\n");
+                return false;
+            default:
+                ch_log_error("Unexpected value (%i) from broadcast connection\n", result);
+                return false;
+        }
+
+        if(!flush_ok(coord, WORKER_FLUSH(conn))){
+            ch_log_error("Cannot complete write request, cluster failed\n");
+            return false;
+        }
+        return true;
+    }
+
+
+    //First, collect all the buffers
+    i64* rtos          = coord->table.rtos;
+    i64* pending       = coord->table.pending + lo;
+    i64 pending_count  = 0;
+    for(i64 i = lo; i < hi && !coord->stop_signal; i++){
+        WORKER(write_header)(coord, coord->cons->first + i);
+        rtos[i] = 0;
+        pending[pending_count++] = i;
+    }
+
+    //Now send them all, and do the RTO timeouts. Whatever hasn't gone yet is kept at the front of the pending list, so
+    //each pass only looks at the connections still to go.
+    while(pending_count && !coord->stop_signal){
+        i64 left = 0;
+        for(i64 j = 0; j < pending_count && !coord->stop_signal; j++){
+            const i64 i = pending[j];
+            q2pc_trans_conn* conn = coord->cons->first + i;
+
+            int result = WORKER(commit_write)(coord, conn);
+            switch (result) {
+                case Q2PC_RTOFIRED:
+                    if(rtos[i] >= MAX_RTOS){ //HACK MAGIC NUMBER!
+                        ch_log_error("Connection failed to client %li. Cluster failed after %li RTOS\n", i, MAX_RTOS);
+                        return false;
+                    }
+                    rtos[i]++;
+                    __sync_fetch_and_add(&coord->total_rtos, 1);
+                    break;
+                case Q2PC_EAGAIN:
+                    break;
+                case Q2PC_ENONE:
+                    ch_log_debug3("Ack'd on client %li\n", i);
+                    continue;
+                case Q2PC_EFIN:
+                    ch_log_error("Cannot complete write request, cluster failed\n");
+                    return false;
+                default:
+                    ch_log_error("Unexpected value (%li) from connection=%li\n", result, i);
+                    return false;
+            }
+
+            pending[left++] = i;
+        }
+        pending_count = left;
+    }
+
+    //Anything the transport has queued goes out now
+    for(i64 i = lo; i < hi && !coord->stop_signal; i++){
+        if(!flush_ok(coord, WORKER_FLUSH(coord->cons->first + i))){
+            ch_log_error("Cannot complete write request, cluster failed\n");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+//Take one reply off connection i. Returns Q2PC_ENONE if there was one, Q2PC_EAGAIN if not, or Q2PC_EFIN if the worker
+//has to stop.
+static int WORKER(take_reply)(worker_t* w, i64 i)
+{
+    q2pc_coord* coord = w->coord;
+    const i64 thread_id = w->thread_id;
+
+    q2pc_trans_conn* con = coord->cons->first + i;
+    char* data = NULL;
+    i64 len = 0;
+    i64 result = WORKER_BEG_READ(con,&data, &len);
+    if(result){
+        if(result == Q2PC_EFIN){
+            coord->stop_signal = 1;
+            BARRIER();
+            ch_log_warn("Cannot read any more data from connection %li on thread %li. Stream has finished\n", i, thread_id);
+            usleep(1000); //A a bit for the signal to propagate
+            return Q2PC_EFIN;
+        }
+
+        return Q2PC_EAGAIN;
+    }
+
+    //The buffer goes back to the transport at end_read, so take what we need out of it first
+    q2pc_hdr hdr;
+    q2pc_msg_decode((q2pc_msg*)data, &hdr);
+    WORKER_END_READ(con);
+
+    return take_vote(w, hdr, WORKER_DROPS(con), WORKER_RX_TS(con));
+}
+
+
+//Edge triggered, so everything waiting has to come out. Returns false if the worker has to stop.
+static bool WORKER(drain)(worker_t* w, i64 i)
+{
+    const u64 tsc_start = tsc_read();
+    u64 taken = 0;
+
+    int result;
+    while( (result = WORKER(take_reply)(w, i)) == Q2PC_ENONE ){
+        taken++; //Keep going, there may be more than one reply waiting
+    }
+
+    if(taken){
+        w->cycles.rx_cycles += tsc_read() - tsc_start;
+        w->cycles.rx_msgs   += taken;
+    }
+
+    return result != Q2PC_EFIN;
+}
+
+
+static void WORKER(loop)(worker_t* w)
+{
+    q2pc_coord* coord = w->coord;
+    struct epoll_event events[WORKER_EVENTS_MAX];
+
+    while(!coord->stop_signal){
+
+        //A new message to send out. Replies that come in meanwhile wait in the connections. Taking a reply may already
+        //have moved us on to the round, but not sent it.
+        if(coord->send_round != w->round){
+            enter_round(w);
+        }
+
+        if(w->sent_round != w->round){
+            w->sent_round = w->round;
+
+            const u64 tsc_start = tsc_read();
+            if(!WORKER(send_range)(coord, w->lo, w->hi)){
+                coord->send_failed = true;
+            }
+            const i64 sent = WORKER_BCAST(coord) ? !w->lo : w->hi - w->lo;
+            if(sent){
+                w->cycles.tx_cycles += tsc_read() - tsc_start;
+                w->cycles.tx_msgs   += sent;
+            }
+            coord->sends_done[w->thread_id] = w->round;
+
+            //Sending can pull replies in and hold them without an edge to show for it, so have a look everywhere once
+            for(i64 i = w->lo; i < w->hi && !coord->stop_signal; i++){
+                if(!WORKER(drain)(w, i)){
+                    break;
+                }
+            }
+        }
+
+        for(i64 i = 0; i < w->polled_count && !coord->stop_signal; i++){
+            if(!WORKER(drain)(w, w->polled[i])){
+                break;
+            }
+        }
+
+        //Busy loop looking for data, but only on the connections that have some
+        const int ready = epoll_wait(w->epoll_fd, events, WORKER_EVENTS_MAX, 0);
+        if(ready < 0 && errno != EINTR){
+            ch_log_fatal("Worker epoll wait failed: %s\n", strerror(errno));
+        }
+
+        for(int i = 0; i < ready && !coord->stop_signal; i++){
+            if(!WORKER(drain)(w, events[i].data.u64)){
+                break;
+            }
+        }
+
+        //Reliable transports retransmit from flush, so give a connection its turn each time round
+        if(w->hi > w->lo){
+            if(!flush_ok(coord, WORKER_FLUSH(coord->cons->first + w->flush_next))){
+                ch_log_warn("Cannot write any more to connection %li on thread %li. Stream has finished\n", w->flush_next, w->thread_id);
+                coord->stop_signal = 1;
+            }
+            w->flush_next = w->flush_next + 1 < w->hi ? w->flush_next + 1 : w->lo;
+        }
+    }
+}
+
+
+#undef WORKER
+#undef WORKER_BEG_READ
+#undef WORKER_END_READ
+#undef WORKER_BEG_WRITE
+#undef WORKER_END_WRITE
+#undef WORKER_END_WRITEV
+#undef WORKER_HAS_WRITEV
+#undef WORKER_SET_CLASS
+#undef WORKER_DROPS
+#undef WORKER_RX_TS
+#undef WORKER_FLUSH
+#undef WORKER_BCAST
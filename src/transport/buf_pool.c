@@ -0,0 +1,276 @@
+/*
+ * buf_pool.c
+ */
+
+ //#LINKFLAGS=-lpthread
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <time.h>
+#include <linux/errqueue.h>
+
+#include "buf_pool.h"
+
+#define BUF_POOL_CACHELINE 64
+#define BUF_POOL_SLAB (2 * 1024 * 1024) //One huge page
+
+typedef struct buf_slab_s {
+    struct buf_slab_s* next;
+    i64 size;
+} buf_slab;
+
+struct buf_pool_s {
+    i64 buff_size;
+    bool huge;
+
+    pthread_mutex_t lock;
+    char* free_list;    //Free buffers hold the next pointer in their first bytes
+    buf_slab* slabs;
+    i64 slab_used;      //Bytes handed out of the newest slab
+
+    struct buf_pool_s* next;
+};
+
+static buf_pool* all_pools          = NULL;
+static pthread_mutex_t all_lock     = PTHREAD_MUTEX_INITIALIZER;
+static buf_pool* overflow_pool      = NULL;
+static _Thread_local char* spare    = NULL;
+
+
+buf_pool* buf_pool_new(i64 buff_size, bool huge)
+{
+    buf_pool* pool = calloc(1, sizeof(buf_pool));
+    if(!pool){
+        ch_log_fatal("Could not allocate buffer pool\n");
+    }
+
+    pool->buff_size = (MAX(buff_size, BUF_POOL_CACHELINE) + BUF_POOL_CACHELINE - 1) & ~(BUF_POOL_CACHELINE - 1);
+    pool->huge      = huge;
+    pthread_mutex_init(&pool->lock, NULL);
+
+    pthread_mutex_lock(&all_lock);
+    pool->next = all_pools;
+    all_pools  = pool;
+    pthread_mutex_unlock(&all_lock);
+
+    ch_log_debug1("New buffer pool with %liB buffers%s\n", pool->buff_size, huge ? " on huge pages" : "");
+    return pool;
+}
+
+
+void buf_pool_delete(buf_pool* pool)
+{
+    if(!pool){
+        return;
+    }
+
+    pthread_mutex_lock(&all_lock);
+    for(buf_pool** p = &all_pools; *p; p = &(*p)->next){
+        if(*p == pool){
+            *p = pool->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&all_lock);
+
+    for(buf_slab* slab = pool->slabs; slab; ){
+        buf_slab* next = slab->next;
+        munmap(slab, slab->size);
+        slab = next;
+    }
+
+    free(pool);
+}
+
+
+static void new_slab(buf_pool* pool)
+{
+    //The slab header takes the first cache line
+    i64 size = MAX(BUF_POOL_SLAB, pool->buff_size + BUF_POOL_CACHELINE);
+    size     = (size + BUF_POOL_SLAB - 1) & ~(i64)(BUF_POOL_SLAB - 1);
+
+    buf_slab* slab = MAP_FAILED;
+    if(pool->huge){
+        slab = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(slab == MAP_FAILED){
+            ch_log_warn("Could not get huge pages for buffers, falling back to normal pages: %s\n", strerror(errno));
+            pool->huge = false;
+        }
+    }
+
+    if(slab == MAP_FAILED){
+        slab = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(slab == MAP_FAILED){
+            ch_log_fatal("Could not map %liB for buffers: %s\n", size, strerror(errno));
+        }
+    }
+
+    slab->size      = size;
+    slab->next      = pool->slabs;
+    pool->slabs     = slab;
+    pool->slab_used = BUF_POOL_CACHELINE;
+}
+
+
+char* buf_pool_get(buf_pool* pool)
+{
+    char* buff = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if(pool->free_list){
+        buff = pool->free_list;
+        pool->free_list = *(char**)buff;
+    }
+    else{
+        if(!pool->slabs || pool->slab_used + pool->buff_size > pool->slabs->size){
+            new_slab(pool);
+        }
+
+        buff = (char*)pool->slabs + pool->slab_used;
+        pool->slab_used += pool->buff_size;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return buff;
+}
+
+
+void buf_pool_put(buf_pool* pool, char* buff)
+{
+    if(!buff){
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    *(char**)buff = pool->free_list;
+    pool->free_list = buff;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+i64 buf_pool_buff_size(const buf_pool* pool)
+{
+    return pool->buff_size;
+}
+
+
+i64 buf_pool_resident_all()
+{
+    const i64 page = sysconf(_SC_PAGESIZE);
+    i64 result = 0;
+
+    pthread_mutex_lock(&all_lock);
+    for(buf_pool* pool = all_pools; pool; pool = pool->next){
+        pthread_mutex_lock(&pool->lock);
+        for(buf_slab* slab = pool->slabs; slab; slab = slab->next){
+            const i64 pages = slab->size / page;
+            unsigned char* vec = malloc(pages);
+            if(vec && !mincore(slab, slab->size, vec)){
+                for(i64 i = 0; i < pages; i++){
+                    result += (vec[i] & 1) ? page : 0;
+                }
+            }
+            free(vec);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    pthread_mutex_unlock(&all_lock);
+
+    return result;
+}
+
+
+
+/***************************************************************************************************************************/
+
+static char* overflow_spare()
+{
+    if(!spare){
+        pthread_mutex_lock(&all_lock);
+        if(!overflow_pool){
+            pthread_mutex_unlock(&all_lock);
+            buf_pool* pool = buf_pool_new(BUF_POOL_OVERFLOW_SIZE, false);
+            pthread_mutex_lock(&all_lock);
+            if(!overflow_pool){
+                overflow_pool = pool;
+                pool = NULL;
+            }
+            pthread_mutex_unlock(&all_lock);
+            buf_pool_delete(pool); //Lost the race to make it
+        }
+        else{
+            pthread_mutex_unlock(&all_lock);
+        }
+
+        spare = buf_pool_get(overflow_pool);
+    }
+
+    return spare;
+}
+
+
+void buf_pool_overflow_put(char* buff)
+{
+    buf_pool_put(overflow_pool, buff);
+}
+
+
+i64 buf_pool_recv(int fd, char* buff, i64 size, struct sockaddr_in* src_o, char** overflow_o, buf_pool_rx_meta* meta_o)
+{
+    *overflow_o = NULL;
+
+    //Anything past the end of buff lands in the spare, leaving room at the front to make it one contiguous message
+    char* over = overflow_spare();
+    struct iovec iov[2] = {
+        { .iov_base = buff,        .iov_len = size },
+        { .iov_base = over + size, .iov_len = MAX(BUF_POOL_OVERFLOW_SIZE - size, 0) },
+    };
+
+    struct msghdr msg = {
+        .msg_name    = src_o,
+        .msg_namelen = src_o ? sizeof(*src_o) : 0,
+        .msg_iov     = iov,
+        .msg_iovlen  = size < BUF_POOL_OVERFLOW_SIZE ? 2 : 1,
+    };
+
+    char control[CMSG_SPACE(sizeof(u32)) + CMSG_SPACE(sizeof(struct scm_timestamping))];
+    if(meta_o){
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+    }
+
+    const i64 result = recvmsg(fd, &msg, 0);
+    if(meta_o && result >= 0){
+        meta_o->rx_ts_ns = 0;
+        for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+            if(cmsg->cmsg_level != SOL_SOCKET){
+                continue;
+            }
+
+            if(cmsg->cmsg_type == SO_RXQ_OVFL){
+                memcpy(&meta_o->drops, CMSG_DATA(cmsg), sizeof(u32));
+            }
+            else if(cmsg->cmsg_type == SCM_TIMESTAMPING){
+                //Software stamp first, the raw hardware one last. Take hardware if the NIC gave us one, it's only there
+                //if trans_sock_options() asked for it.
+                struct scm_timestamping stamps;
+                memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+                const struct timespec* ts = stamps.ts[2].tv_sec ? &stamps.ts[2] : &stamps.ts[0];
+                meta_o->rx_ts_ns = ts->tv_sec * 1000 * 1000 * 1000 + ts->tv_nsec;
+            }
+        }
+    }
+
+    if(result > size){
+        memcpy(over, buff, size);
+        *overflow_o = over;
+        spare = NULL; //It's the reader's now, we'll get another one next time
+        ch_log_debug2("Large message of %liB read into overflow buffer\n", result);
+    }
+
+    return result;
+}
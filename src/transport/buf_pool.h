@@ -0,0 +1,45 @@
+/*
+ * buf_pool.h
+ */
+
+#ifndef BUF_POOL_H_
+#define BUF_POOL_H_
+
+#include <netinet/in.h>
+
+#include "../../deps/chaste/chaste.h"
+
+//Fixed size connection buffers, carved out of large slabs. Slabs are mapped, not touched, so a buffer only costs
+//memory once it is used. Buffers are cache line aligned and sized.
+typedef struct buf_pool_s buf_pool;
+
+buf_pool* buf_pool_new(i64 buff_size, bool huge);
+void buf_pool_delete(buf_pool* pool);
+
+char* buf_pool_get(buf_pool* pool);
+void buf_pool_put(buf_pool* pool, char* buff);
+i64 buf_pool_buff_size(const buf_pool* pool);
+
+//Bytes of every pool that are actually in memory
+i64 buf_pool_resident_all();
+
+
+
+//Messages bigger than a connection's buffer borrow from one shared pool of large buffers. Each thread keeps a spare
+//one to read into, and only hands it over, and takes the lock to get another, when a large message actually arrives.
+#define BUF_POOL_OVERFLOW_SIZE (64 * 1024)
+
+void buf_pool_overflow_put(char* buff);
+
+//What the kernel says about the datagrams a socket receives, see trans_sock_options()
+typedef struct {
+    u32 drops;      //Running count of datagrams dropped for want of buffer space (SO_RXQ_OVFL)
+    i64 rx_ts_ns;   //When the last datagram was received (SO_TIMESTAMPING), 0 if it wasn't stamped
+} buf_pool_rx_meta;
+
+//Receive one datagram into buff. If it doesn't fit, *overflow_o is set to a buffer holding the whole datagram, which
+//must be given back with buf_pool_overflow_put(). If meta_o isn't NULL it's kept up to date with what the kernel has
+//attached to the datagram. Returns the same as recvmsg().
+i64 buf_pool_recv(int fd, char* buff, i64 size, struct sockaddr_in* src_o, char** overflow_o, buf_pool_rx_meta* meta_o);
+
+#endif /* BUF_POOL_H_ */
@@ -0,0 +1,55 @@
+/*
+ * mirror_buff.c
+ */
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+
+#include "mirror_buff.h"
+
+
+void mirror_buff_init(mirror_buff* mb, i64 min_size)
+{
+    i64 size = sysconf(_SC_PAGESIZE);
+    while(size < min_size){
+        size *= 2;
+    }
+
+    int fd = syscall(SYS_memfd_create, "q2pc_mirror", 0);
+    if(fd < 0){
+        ch_log_fatal("Could not create mirror buffer memory: %s\n", strerror(errno));
+    }
+
+    if(ftruncate(fd, size)){
+        ch_log_fatal("Could not size mirror buffer to %liB: %s\n", size, strerror(errno));
+    }
+
+    //Reserve twice the space, then map the same memory into both halves
+    char* base = mmap(NULL, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED){
+        ch_log_fatal("Could not reserve %liB for mirror buffer: %s\n", size * 2, strerror(errno));
+    }
+
+    if(mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+       mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED){
+        ch_log_fatal("Could not map mirror buffer: %s\n", strerror(errno));
+    }
+
+    close(fd); //The mappings keep the memory alive
+
+    mb->base = base;
+    mb->size = size;
+    mb->head = 0;
+    mb->tail = 0;
+}
+
+
+void mirror_buff_free(mirror_buff* mb)
+{
+    if(mb->base){
+        munmap(mb->base, mb->size * 2);
+        mb->base = NULL;
+    }
+}
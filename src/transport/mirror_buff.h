@@ -0,0 +1,58 @@
+/*
+ * mirror_buff.h
+ */
+
+#ifndef MIRROR_BUFF_H_
+#define MIRROR_BUFF_H_
+
+#include "../../deps/chaste/chaste.h"
+
+//A byte ring that is mapped twice, back to back, in virtual memory. Any run of up to size bytes starting anywhere
+//in the ring is contiguous, so readers get views of data that wraps without copying it, and nothing ever has to be
+//moved back to the front.
+typedef struct {
+    char* base;
+    i64   size; //Bytes in the ring, a power of 2 multiple of the page size
+    u64   head; //Consumer, free running
+    u64   tail; //Producer, free running
+} mirror_buff;
+
+
+//Make a ring of at least min_size bytes
+void mirror_buff_init(mirror_buff* mb, i64 min_size);
+void mirror_buff_free(mirror_buff* mb);
+
+
+static inline i64 mirror_buff_used(const mirror_buff* mb)
+{
+    return mb->tail - mb->head;
+}
+
+static inline i64 mirror_buff_space(const mirror_buff* mb)
+{
+    return mb->size - mirror_buff_used(mb);
+}
+
+//Where the next mirror_buff_used() bytes can be read from
+static inline char* mirror_buff_rd(const mirror_buff* mb)
+{
+    return mb->base + (mb->head & (mb->size - 1));
+}
+
+//Where the next mirror_buff_space() bytes can be written to
+static inline char* mirror_buff_wr(const mirror_buff* mb)
+{
+    return mb->base + (mb->tail & (mb->size - 1));
+}
+
+static inline void mirror_buff_produce(mirror_buff* mb, i64 len)
+{
+    mb->tail += len;
+}
+
+static inline void mirror_buff_consume(mirror_buff* mb, i64 len)
+{
+    mb->head += len;
+}
+
+#endif /* MIRROR_BUFF_H_ */
@@ -0,0 +1,615 @@
+/*
+ * q2pc_trans_mcast.c
+ */
+
+ //#LINKFLAGS=-lpthread
+
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "q2pc_trans_mcast.h"
+#include "udp_frame.h"
+#include "buf_pool.h"
+#include "conn_vector.h"
+#include "../errors/errors.h"
+#include "../protocol/q2pc_protocol.h"
+
+//Every datagram carries this in front of the Q2PC message.
+//  Server -> group   : data,  seq is the stream sequence number
+//  Client -> server  : reply, seq is the last stream message the client has delivered
+//  Client -> server  : nack,  seq is the last stream message the client has delivered, send me everything after it
+typedef enum { mcast_data = 0, mcast_reply, mcast_nack } mcast_kind_e;
+
+typedef struct __attribute__((__packed__)) {
+    u8  kind;
+    u8  pad[3];
+    u32 seq;
+} q2pc_mcast_hdr;
+
+#define MCAST_HISTORY 64            //Must be a power of 2
+
+
+typedef struct {
+    u32 seq;
+    i64 len;
+    char* data;
+} mcast_hist_ent;
+
+
+struct q2pc_mcast_priv_s;
+
+typedef struct {
+    struct q2pc_mcast_priv_s* trans;
+
+    int fd;     //Unicast socket, replies and nacks on the client, one per client on the server
+    int mc_fd;  //Group socket, clients only
+
+    buf_pool* pool;
+
+    //For the reader
+    char* read_buffer;
+    i64   read_buffer_used;
+    i64   read_buffer_size;
+    char* overflow;     //Set if the last datagram was too big for the read buffer
+    char* read_data;    //Whichever of the two it's in
+    buf_pool_rx_meta rx_meta;       //Kernel drops and timestamps on fd and mc_fd
+    buf_pool_rx_meta mc_rx_meta;
+    const buf_pool_rx_meta* read_meta; //Whichever the last datagram came in on
+
+    //For the writer (client side, the server writes through the shared group buffer)
+    char* write_buffer;
+    i64   write_buffer_used;
+    i64   write_buffer_size;
+
+    struct sockaddr_in peer_addr;
+    bool has_peer;
+
+    u32 delivered;      //Client: last in order stream message handed up. Server: last message this client replied to.
+    i64 last_rx_us;     //Client: when we last heard from the server, drives the tail loss probe
+
+} q2pc_mcast_conn_priv;
+
+
+typedef struct q2pc_mcast_priv_s {
+    transport_s transport;
+
+    i64 connections;
+
+    buf_pool* pool;
+
+    //Server side dissemination state
+    int mc_fd;
+    struct sockaddr_in group_addr;
+    char* stage;
+    u32 latest;
+    mcast_hist_ent history[MCAST_HISTORY];
+    pthread_mutex_t history_lock;
+
+} q2pc_mcast_priv;
+
+
+static inline i64 now_us()
+{
+    struct timeval now = {0};
+    gettimeofday(&now, NULL);
+    return now.tv_sec * 1000 * 1000 + now.tv_usec;
+}
+
+
+static void send_dgram(int fd, const struct sockaddr_in* addr, const char* data, i64 len)
+{
+    while(sendto(fd, data, len, 0, (const struct sockaddr*)addr, sizeof(*addr)) < 0){
+        if(errno == EAGAIN || errno == EWOULDBLOCK){
+            continue; //Keep trying until we succeed
+        }
+
+        ch_log_warn("MCAST send failed with errorno=%i: %s\n", errno, strerror(errno));
+        return;
+    }
+}
+
+
+static void send_ctrl(q2pc_mcast_conn_priv* priv, mcast_kind_e kind)
+{
+    q2pc_mcast_hdr hdr = { .kind = kind, .seq = priv->delivered };
+    send_dgram(priv->fd, &priv->peer_addr, (char*)&hdr, sizeof(hdr));
+}
+
+
+//Server: a client is missing stream messages, send them again to just that client. Must hold the history lock.
+static void repair(q2pc_mcast_conn_priv* priv, u32 have)
+{
+    q2pc_mcast_priv* trans = priv->trans;
+
+    if((i32)(trans->latest - have) > MCAST_HISTORY){
+        ch_log_warn("MCAST client asked for seq=%u, but history only goes back to %u\n", have + 1, trans->latest - MCAST_HISTORY + 1);
+        have = trans->latest - MCAST_HISTORY;
+    }
+
+    for(u32 seq = have + 1; (i32)(trans->latest - seq) >= 0; seq++){
+        mcast_hist_ent* ent = &trans->history[seq & (MCAST_HISTORY - 1)];
+        ch_log_debug2("MCAST repairing seq=%u\n", seq);
+        send_dgram(priv->fd, &priv->peer_addr, ent->data, ent->len);
+    }
+
+    //The client already has everything, but we never saw its reply, so it's the reply that was lost. Resend the latest
+    //message, the client will treat it as a duplicate and reply again.
+    if(have == trans->latest && priv->delivered != trans->latest && trans->latest){
+        mcast_hist_ent* ent = &trans->history[trans->latest & (MCAST_HISTORY - 1)];
+        ch_log_debug2("MCAST resending seq=%u to recover a lost reply\n", trans->latest);
+        send_dgram(priv->fd, &priv->peer_addr, ent->data, ent->len);
+    }
+}
+
+
+static int read_dgram(q2pc_mcast_conn_priv* priv, int fd, bool set_peer)
+{
+    //Whatever we read last time has been used or dropped
+    if(priv->overflow){
+        buf_pool_overflow_put(priv->overflow);
+        priv->overflow = NULL;
+    }
+
+    struct sockaddr_in src_addr;
+    buf_pool_rx_meta* meta = fd == priv->mc_fd ? &priv->mc_rx_meta : &priv->rx_meta;
+    int result = buf_pool_recv(fd, priv->read_buffer, priv->read_buffer_size, &src_addr, &priv->overflow, meta);
+    priv->read_meta = meta;
+    if(result < 0){
+        if(errno == EAGAIN || errno == EWOULDBLOCK){
+            return Q2PC_EAGAIN; //Reading would have blocked, we don't want this
+        }
+
+        if(errno == ECONNREFUSED){
+            ch_log_warn("MCAST beg read EFIN (%s)\n", strerror(errno));
+            return Q2PC_EFIN;
+        }
+
+        ch_log_fatal("MCAST read failed on fd=%i with errno=%i (%s)\n", fd, errno, strerror(errno));
+    }
+
+    if(result < (int)sizeof(q2pc_mcast_hdr)){
+        ch_log_debug1("MCAST dropping runt datagram of %i bytes\n", result);
+        return Q2PC_EAGAIN;
+    }
+
+    if(set_peer && !priv->has_peer){
+        priv->peer_addr = src_addr;
+        priv->has_peer  = true;
+    }
+
+    priv->read_buffer_used = result;
+    priv->read_data        = priv->overflow ? priv->overflow : priv->read_buffer;
+    return Q2PC_ENONE;
+}
+
+
+static int serv_beg_read(q2pc_mcast_conn_priv* priv)
+{
+    for(;;){
+        int result = read_dgram(priv, priv->fd, true);
+        if(result){
+            return result;
+        }
+
+        q2pc_mcast_hdr* hdr = (q2pc_mcast_hdr*)priv->read_data;
+        if(hdr->kind == mcast_nack){
+            pthread_mutex_lock(&priv->trans->history_lock);
+            repair(priv, hdr->seq);
+            pthread_mutex_unlock(&priv->trans->history_lock);
+            continue;
+        }
+
+        //Replies to anything but the latest message, or a second reply to it, are left over from recovery
+        pthread_mutex_lock(&priv->trans->history_lock);
+        const bool stale = hdr->seq != priv->trans->latest || hdr->seq == priv->delivered;
+        pthread_mutex_unlock(&priv->trans->history_lock);
+        if(stale){
+            ch_log_debug2("MCAST dropping stale reply to seq=%u\n", hdr->seq);
+            continue;
+        }
+
+        priv->delivered = hdr->seq;
+        return Q2PC_ENONE;
+    }
+}
+
+
+static int client_beg_read(q2pc_mcast_conn_priv* priv)
+{
+    for(;;){
+        //Group first, then repairs on the unicast socket
+        int result = read_dgram(priv, priv->mc_fd, false);
+        if(result == Q2PC_EAGAIN){
+            result = read_dgram(priv, priv->fd, false);
+        }
+
+        if(result == Q2PC_EAGAIN){
+            //Nothing for a while, we may have lost the tail of the stream. Ask for anything newer than we have.
+            const i64 now = now_us();
+            if(now > priv->last_rx_us + priv->trans->transport.rto_us){
+                ch_log_debug2("MCAST probing for messages after seq=%u\n", priv->delivered);
+                send_ctrl(priv, mcast_nack);
+                priv->last_rx_us = now;
+            }
+            return Q2PC_EAGAIN;
+        }
+
+        if(result){
+            return result;
+        }
+
+        priv->last_rx_us = now_us();
+        q2pc_mcast_hdr* hdr = (q2pc_mcast_hdr*)priv->read_data;
+        const i32 diff = (i32)(hdr->seq - priv->delivered);
+
+        if(diff == 1){
+            priv->delivered = hdr->seq;
+            return Q2PC_ENONE;
+        }
+
+        if(diff > 1){
+            ch_log_debug1("MCAST gap, got seq=%u expected %u\n", hdr->seq, priv->delivered + 1);
+            send_ctrl(priv, mcast_nack);
+            continue;
+        }
+
+        //A duplicate of the last thing we delivered means the server never got our reply
+        if(diff == 0 && priv->write_buffer_used){
+            ch_log_debug2("MCAST duplicate seq=%u, resending reply\n", hdr->seq);
+            send_dgram(priv->fd, &priv->peer_addr, priv->write_buffer, priv->write_buffer_used);
+        }
+    }
+}
+
+
+static int conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_mcast_conn_priv* priv = (q2pc_mcast_conn_priv*)this->priv;
+    if(!priv->read_buffer_used){
+        int result = priv->trans->transport.server ? serv_beg_read(priv) : client_beg_read(priv);
+        if(result){
+            priv->read_buffer_used = 0; //Whatever we read last was dropped
+            return result;
+        }
+    }
+
+    *data_o = priv->read_data + sizeof(q2pc_mcast_hdr);
+    *len_o  = priv->read_buffer_used - sizeof(q2pc_mcast_hdr);
+    ch_log_debug3("Got %li bytes\n", *len_o);
+
+    return Q2PC_ENONE;
+}
+
+
+static int conn_end_read(struct q2pc_trans_conn_s* this)
+{
+    q2pc_mcast_conn_priv* priv = (q2pc_mcast_conn_priv*)this->priv;
+    priv->read_buffer_used = 0;
+    if(priv->overflow){
+        buf_pool_overflow_put(priv->overflow);
+        priv->overflow = NULL;
+    }
+    return Q2PC_ENONE;
+}
+
+
+//On the server every connection shares the group buffer, a write on any of them goes to everyone
+static int conn_beg_write(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_mcast_conn_priv* priv = (q2pc_mcast_conn_priv*)this->priv;
+    char* buff = priv->trans->transport.server ? priv->trans->stage : priv->write_buffer;
+    *data_o = buff + sizeof(q2pc_mcast_hdr);
+    *len_o  = buf_pool_buff_size(priv->pool) - sizeof(q2pc_mcast_hdr);
+    return Q2PC_ENONE;
+}
+
+
+static int conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
+{
+    q2pc_mcast_conn_priv* priv = (q2pc_mcast_conn_priv*)this->priv;
+    q2pc_mcast_priv* trans     = priv->trans;
+
+    if(len > buf_pool_buff_size(priv->pool) - (i64)sizeof(q2pc_mcast_hdr)){
+        ch_log_fatal("Error: Wrote more data than the buffer could handle. Memory corruption is likely\n ");
+    }
+    len += sizeof(q2pc_mcast_hdr);
+
+    if(!trans->transport.server){
+        q2pc_mcast_hdr* hdr = (q2pc_mcast_hdr*)priv->write_buffer;
+        hdr->kind = mcast_reply;
+        hdr->seq  = priv->delivered;
+        priv->write_buffer_used = len;
+        send_dgram(priv->fd, &priv->peer_addr, priv->write_buffer, len);
+        return Q2PC_ENONE;
+    }
+
+    pthread_mutex_lock(&trans->history_lock);
+    trans->latest++;
+    q2pc_mcast_hdr* hdr = (q2pc_mcast_hdr*)trans->stage;
+    hdr->kind = mcast_data;
+    hdr->seq  = trans->latest;
+
+    mcast_hist_ent* ent = &trans->history[trans->latest & (MCAST_HISTORY - 1)];
+    memcpy(ent->data, trans->stage, len);
+    ent->len = len;
+    ent->seq = trans->latest;
+
+    ch_log_debug3("MCAST sending seq=%u\n", trans->latest);
+    send_dgram(trans->mc_fd, &trans->group_addr, trans->stage, len);
+    pthread_mutex_unlock(&trans->history_lock);
+
+    return Q2PC_ENONE;
+}
+
+
+static void conn_delete(struct q2pc_trans_conn_s* this)
+{
+    if(this){
+        if(this->priv){
+            q2pc_mcast_conn_priv* priv = (q2pc_mcast_conn_priv*)this->priv;
+            buf_pool_put(priv->pool, priv->read_buffer);
+            buf_pool_put(priv->pool, priv->write_buffer);
+            buf_pool_overflow_put(priv->overflow);
+            close(priv->fd);
+            if(priv->mc_fd > 0){ close(priv->mc_fd); }
+            free(this->priv);
+        }
+
+        //XXX HACK!
+        //free(this);
+    }
+}
+
+
+
+/***************************************************************************************************************************/
+
+static q2pc_mcast_conn_priv* new_conn_priv(buf_pool* pool)
+{
+    q2pc_mcast_conn_priv* new_priv = calloc(1,sizeof(q2pc_mcast_conn_priv));
+    if(!new_priv){
+        ch_log_fatal("Malloc failed!\n");
+    }
+
+    new_priv->pool              = pool;
+    new_priv->read_buffer       = buf_pool_get(pool);
+    new_priv->read_buffer_size  = buf_pool_buff_size(pool);
+    new_priv->write_buffer      = buf_pool_get(pool);
+    new_priv->write_buffer_size = buf_pool_buff_size(pool);
+
+    return new_priv;
+}
+
+
+static i64 conn_get_drops(struct q2pc_trans_conn_s* this)
+{
+    q2pc_mcast_conn_priv* priv = (q2pc_mcast_conn_priv*)this->priv;
+    return (i64)priv->rx_meta.drops + priv->mc_rx_meta.drops;
+}
+
+
+static i64 conn_get_rx_ts(struct q2pc_trans_conn_s* this)
+{
+    q2pc_mcast_conn_priv* priv = (q2pc_mcast_conn_priv*)this->priv;
+    return priv->read_meta ? priv->read_meta->rx_ts_ns : 0;
+}
+
+
+static q2pc_mcast_conn_priv* init_new_conn(q2pc_trans_conn* conn, buf_pool* pool)
+{
+    q2pc_mcast_conn_priv* new_priv = new_conn_priv(pool);
+
+    conn->priv      = new_priv;
+    conn->beg_read  = conn_beg_read;
+    conn->end_read  = conn_end_read;
+    conn->beg_write = conn_beg_write;
+    conn->end_write = conn_end_write;
+    conn->get_drops = conn_get_drops;
+    conn->get_rx_ts = conn_get_rx_ts;
+    conn->delete    = conn_delete;
+
+    return new_priv;
+}
+
+
+static void safe_wait_bind(int fd, struct sockaddr_in* addr)
+{
+
+    ch_log_debug3("Binding on %i port=%i\n", fd, ntohs(addr->sin_port));
+
+    if(bind(fd, (struct sockaddr *)addr, sizeof(struct sockaddr_in)) ){
+        i64 i = 0;
+
+        //Will wait up to two minutes trying if the address is in use.
+        //Helpful for quick restarts of apps as Linux keeps some state
+        //around for a while.
+        const int64_t seconds_per_try = 5;
+        const int64_t seconds_total = 120;
+        for(i = 0; i < seconds_total / seconds_per_try && errno == EADDRINUSE; i++){
+            ch_log_debug1("%i] %s --> sleeping for %i seconds...\n",i, strerror(errno), seconds_per_try);
+            sleep(seconds_per_try);
+            bind(fd, (struct sockaddr *)addr, sizeof(struct sockaddr_in));
+        }
+
+        if(errno){
+            ch_log_fatal("MCAST bind failed: %s\n",strerror(errno));
+        }
+        else{
+            ch_log_debug1("Successfully bound after delay.\n");
+        }
+    }
+
+}
+
+
+static int new_socket(const transport_s* transport)
+{
+    int sock_fd = socket(AF_INET,SOCK_DGRAM,0);
+    if (sock_fd < 0 ){
+        ch_log_fatal("Could not create MCAST socket (%s)\n", strerror(errno));
+    }
+
+    int reuse_opt = 1;
+    if(setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &reuse_opt, sizeof(int)) < 0) {
+        ch_log_fatal("MCAST set reuse address failed: %s\n",strerror(errno));
+    }
+    trans_sock_options(sock_fd, transport);
+
+    int flags = 0;
+    flags |= O_NONBLOCK;
+    if( fcntl(sock_fd, F_SETFL, flags) == -1){
+        ch_log_fatal("Could not set non-blocking on fd=%i: %s\n",sock_fd,strerror(errno));
+    }
+
+    return sock_fd;
+}
+
+
+static struct in_addr iface_addr(const char* iface)
+{
+    int ifindex;
+    udp_frame_addr addr;
+    udp_frame_iface(iface, &ifindex, &addr);
+
+    struct in_addr result = { .s_addr = addr.ip };
+    return result;
+}
+
+
+static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
+{
+    q2pc_mcast_priv* trans_priv = (q2pc_mcast_priv*)this->priv;
+
+    if(!conn->priv){
+        q2pc_mcast_conn_priv* new_priv = init_new_conn(conn, trans_priv->pool);
+        new_priv->trans = trans_priv;
+        new_priv->fd    = new_socket(&trans_priv->transport);
+        new_priv->mc_fd = -1;
+
+        struct sockaddr_in addr;
+        memset(&addr,0,sizeof(addr));
+        addr.sin_family = AF_INET;
+
+        if(trans_priv->transport.server){
+            //Listen to any address, on the client port. We learn where the client is from its first message.
+            addr.sin_addr.s_addr = INADDR_ANY;
+            addr.sin_port        = htons(trans_priv->transport.port + trans_priv->connections);
+            safe_wait_bind(new_priv->fd,&addr);
+            trans_priv->connections++;
+            new_priv->delivered = ~0U; //Nothing replied to yet, not even the connect message
+        }
+        else{
+            //Replies and nacks go to the server on the client port
+            new_priv->peer_addr.sin_family      = AF_INET;
+            new_priv->peer_addr.sin_addr.s_addr = inet_addr(trans_priv->transport.ip);
+            new_priv->peer_addr.sin_port        = htons(trans_priv->transport.port + trans_priv->transport.client_id);
+            new_priv->has_peer                  = true;
+
+            //Join the group on the broadcast port
+            new_priv->mc_fd = new_socket(&trans_priv->transport);
+            addr.sin_addr.s_addr = INADDR_ANY;
+            addr.sin_port        = htons(trans_priv->transport.port);
+            safe_wait_bind(new_priv->mc_fd,&addr);
+
+            struct ip_mreq mreq;
+            mreq.imr_multiaddr.s_addr = inet_addr(trans_priv->transport.mcast_group);
+            mreq.imr_interface        = iface_addr(trans_priv->transport.iface);
+            if(setsockopt(new_priv->mc_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq))){
+                ch_log_fatal("Could not join multicast group %s: %s\n", trans_priv->transport.mcast_group, strerror(errno));
+            }
+
+            new_priv->last_rx_us = now_us();
+        }
+    }
+
+    return Q2PC_ENONE;
+}
+
+
+static void serv_delete(struct q2pc_trans_s* this)
+{
+    if(this){
+
+        if(this->priv){
+            q2pc_mcast_priv* priv = (q2pc_mcast_priv*)this->priv;
+            if(priv->mc_fd > 0){ close(priv->mc_fd); }
+            buf_pool_delete(priv->pool); //Takes the stage and history with it
+            free(this->priv);
+        }
+
+        free(this);
+    }
+
+}
+
+
+static void init(q2pc_mcast_priv* priv)
+{
+
+    ch_log_debug1("Constructing MCAST transport\n");
+
+    //Keep track of port numbers
+    priv->connections = 1;
+    priv->mc_fd       = -1;
+    priv->pool        = buf_pool_new(priv->transport.msize + priv->transport.payload_size + sizeof(q2pc_mcast_hdr), priv->transport.hugepages);
+
+    if(priv->transport.server){
+        pthread_mutex_init(&priv->history_lock, NULL);
+
+        priv->stage = buf_pool_get(priv->pool);
+        for(int i = 0; i < MCAST_HISTORY; i++){
+            priv->history[i].data = buf_pool_get(priv->pool);
+        }
+
+        priv->mc_fd = new_socket(&priv->transport);
+
+        struct in_addr ifaddr = iface_addr(priv->transport.iface);
+        if(setsockopt(priv->mc_fd, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr, sizeof(ifaddr))){
+            ch_log_fatal("Could not set multicast interface to %s: %s\n", priv->transport.iface, strerror(errno));
+        }
+
+        u8 ttl = 1;
+        if(setsockopt(priv->mc_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl))){
+            ch_log_fatal("Could not set multicast TTL: %s\n", strerror(errno));
+        }
+
+        priv->group_addr.sin_family      = AF_INET;
+        priv->group_addr.sin_addr.s_addr = inet_addr(priv->transport.mcast_group);
+        priv->group_addr.sin_port        = htons(priv->transport.port);
+    }
+
+    ch_log_debug1("Done constructing MCAST transport\n");
+
+}
+
+
+q2pc_trans* q2pc_mcast_construct(const transport_s* transport)
+{
+    q2pc_trans* result = (q2pc_trans*)calloc(1,sizeof(q2pc_trans));
+    if(!result){
+        ch_log_fatal("Could not allocate MCAST server structure\n");
+    }
+
+    q2pc_mcast_priv* priv = (q2pc_mcast_priv*)calloc(1,sizeof(q2pc_mcast_priv));
+    if(!priv){
+        ch_log_fatal("Could not allocate MCAST server private structure\n");
+    }
+
+    result->priv          = priv;
+    result->connect       = doconnect;
+    result->delete        = serv_delete;
+    memcpy(&priv->transport,transport, sizeof(transport_s));
+    init(priv);
+
+
+    return result;
+}
@@ -0,0 +1,12 @@
+/*
+ * q2pc_trans_mcast.h
+ */
+
+#ifndef Q2PC_TRANS_MCAST_H_
+#define Q2PC_TRANS_MCAST_H_
+
+#include "q2pc_transport.h"
+
+q2pc_trans* q2pc_mcast_construct(const transport_s* transport);
+
+#endif /* Q2PC_TRANS_MCAST_H_ */
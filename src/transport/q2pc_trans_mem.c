@@ -0,0 +1,276 @@
+/*
+ * q2pc_trans_mem.c
+ */
+
+ //#LINKFLAGS=-lpthread
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include "q2pc_trans_mem.h"
+#include "spsc_ring.h"
+#include "conn_vector.h"
+#include "../errors/errors.h"
+
+//Server and clients live in the same process. The server registers a pair of rings for each client under its port
+//number, clients find them there. Client n uses pair n - 1.
+#define MEM_RING_SLOTS 64
+#define MEM_REGISTRY_MAX 16
+
+typedef struct {
+    u16 port;
+    i64 client_count;
+    i64 ring_bytes;
+    char* mem;
+} mem_registry_ent;
+
+static mem_registry_ent registry[MEM_REGISTRY_MAX];
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+typedef struct {
+    spsc_ring* rx;
+    spsc_ring* tx;
+} q2pc_mem_conn_priv;
+
+
+typedef struct {
+    transport_s transport;
+
+    mem_registry_ent* ent;
+    i64 connections;
+
+} q2pc_mem_priv;
+
+
+static inline spsc_ring* get_ring(mem_registry_ent* ent, i64 idx)
+{
+    return (spsc_ring*)(ent->mem + idx * ent->ring_bytes);
+}
+
+
+static int conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_mem_conn_priv* priv = (q2pc_mem_conn_priv*)this->priv;
+
+    if(!spsc_ring_beg_read(priv->rx, data_o, len_o)){
+        return Q2PC_EAGAIN;
+    }
+
+    ch_log_debug3("Got %li bytes\n", *len_o);
+    return Q2PC_ENONE;
+}
+
+
+static int conn_end_read(struct q2pc_trans_conn_s* this)
+{
+    q2pc_mem_conn_priv* priv = (q2pc_mem_conn_priv*)this->priv;
+    spsc_ring_end_read(priv->rx);
+    return Q2PC_ENONE;
+}
+
+
+static int conn_beg_write(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_mem_conn_priv* priv = (q2pc_mem_conn_priv*)this->priv;
+
+    if(!spsc_ring_beg_write(priv->tx, data_o, len_o)){
+        return Q2PC_EAGAIN;
+    }
+
+    return Q2PC_ENONE;
+}
+
+
+static int conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
+{
+    q2pc_mem_conn_priv* priv = (q2pc_mem_conn_priv*)this->priv;
+
+    if(len > priv->tx->slot_size){
+        ch_log_fatal("Error: Wrote more data than the buffer could handle. Memory corruption is likely\n ");
+    }
+
+    spsc_ring_end_write(priv->tx, len);
+    return Q2PC_ENONE;
+}
+
+
+static void conn_delete(struct q2pc_trans_conn_s* this)
+{
+    if(this){
+        if(this->priv){
+            free(this->priv);
+        }
+
+        //XXX HACK!
+        //free(this);
+    }
+}
+
+
+
+/***************************************************************************************************************************/
+
+static q2pc_mem_conn_priv* init_new_conn(q2pc_trans_conn* conn)
+{
+    q2pc_mem_conn_priv* new_priv = calloc(1,sizeof(q2pc_mem_conn_priv));
+    if(!new_priv){
+        ch_log_fatal("Malloc failed!\n");
+    }
+
+    conn->priv      = new_priv;
+    conn->beg_read  = conn_beg_read;
+    conn->end_read  = conn_end_read;
+    conn->beg_write = conn_beg_write;
+    conn->end_write = conn_end_write;
+    conn->delete    = conn_delete;
+
+    return new_priv;
+}
+
+
+static mem_registry_ent* lookup(u16 port)
+{
+    mem_registry_ent* result = NULL;
+
+    pthread_mutex_lock(&registry_lock);
+    for(int i = 0; i < MEM_REGISTRY_MAX; i++){
+        if(registry[i].mem && registry[i].port == port){
+            result = &registry[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    return result;
+}
+
+
+static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
+{
+    q2pc_mem_priv* trans_priv = (q2pc_mem_priv*)this->priv;
+
+    if(conn->priv){
+        return Q2PC_ENONE;
+    }
+
+    i64 pair = 0;
+    if(trans_priv->transport.server){
+        pair = trans_priv->connections++;
+    }
+    else{
+        if(!trans_priv->ent){
+            trans_priv->ent = lookup(trans_priv->transport.port);
+            if(!trans_priv->ent){
+                return Q2PC_EAGAIN; //No server yet
+            }
+        }
+
+        pair = trans_priv->transport.client_id - 1;
+        if(pair < 0 || pair >= trans_priv->ent->client_count){
+            ch_log_fatal("Client ID (%li) is out of the range the server expects [1,%li]\n",
+                    trans_priv->transport.client_id, trans_priv->ent->client_count);
+        }
+    }
+
+    q2pc_mem_conn_priv* new_priv = init_new_conn(conn);
+    spsc_ring* to_server = get_ring(trans_priv->ent, pair * 2 + 0);
+    spsc_ring* to_client = get_ring(trans_priv->ent, pair * 2 + 1);
+    new_priv->rx = trans_priv->transport.server ? to_server : to_client;
+    new_priv->tx = trans_priv->transport.server ? to_client : to_server;
+
+    return Q2PC_ENONE;
+}
+
+
+static void serv_delete(struct q2pc_trans_s* this)
+{
+    if(this){
+
+        if(this->priv){
+            q2pc_mem_priv* priv = (q2pc_mem_priv*)this->priv;
+            if(priv->transport.server && priv->ent){
+                pthread_mutex_lock(&registry_lock);
+                free(priv->ent->mem);
+                priv->ent->mem = NULL;
+                pthread_mutex_unlock(&registry_lock);
+            }
+            free(this->priv);
+        }
+
+        free(this);
+    }
+
+}
+
+
+static void init(q2pc_mem_priv* priv)
+{
+
+    ch_log_debug1("Constructing MEM transport\n");
+
+    if(!priv->transport.server){
+        ch_log_debug1("Done constructing MEM transport\n");
+        return;
+    }
+
+    if(lookup(priv->transport.port)){
+        ch_log_fatal("There is already an in process server on port %u\n", priv->transport.port);
+    }
+
+    const i64 slot_size  = MAX(priv->transport.msize + priv->transport.payload_size, SPSC_RING_CACHELINE);
+    const i64 ring_bytes = spsc_ring_bytes(MEM_RING_SLOTS, slot_size);
+
+    char* mem = NULL;
+    if(posix_memalign((void**)&mem, SPSC_RING_CACHELINE, priv->transport.client_count * 2 * ring_bytes)){
+        ch_log_fatal("Could not allocate %li in process rings\n", priv->transport.client_count * 2);
+    }
+
+    pthread_mutex_lock(&registry_lock);
+    for(int i = 0; i < MEM_REGISTRY_MAX; i++){
+        if(!registry[i].mem){
+            priv->ent = &registry[i];
+            break;
+        }
+    }
+    if(!priv->ent){
+        ch_log_fatal("Too many in process servers, at most %i are supported\n", MEM_REGISTRY_MAX);
+    }
+
+    priv->ent->port         = priv->transport.port;
+    priv->ent->client_count = priv->transport.client_count;
+    priv->ent->ring_bytes   = ring_bytes;
+    for(i64 i = 0; i < priv->transport.client_count * 2; i++){
+        spsc_ring_init((spsc_ring*)(mem + i * ring_bytes), MEM_RING_SLOTS, slot_size);
+    }
+    priv->ent->mem          = mem; //Visible to lookup() from here on
+    pthread_mutex_unlock(&registry_lock);
+
+    ch_log_debug1("Done constructing MEM transport\n");
+
+}
+
+
+q2pc_trans* q2pc_mem_construct(const transport_s* transport)
+{
+    q2pc_trans* result = (q2pc_trans*)calloc(1,sizeof(q2pc_trans));
+    if(!result){
+        ch_log_fatal("Could not allocate MEM server structure\n");
+    }
+
+    q2pc_mem_priv* priv = (q2pc_mem_priv*)calloc(1,sizeof(q2pc_mem_priv));
+    if(!priv){
+        ch_log_fatal("Could not allocate MEM server private structure\n");
+    }
+
+    result->priv          = priv;
+    result->connect       = doconnect;
+    result->delete        = serv_delete;
+    memcpy(&priv->transport,transport, sizeof(transport_s));
+    init(priv);
+
+
+    return result;
+}
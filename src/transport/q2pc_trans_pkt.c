@@ -0,0 +1,503 @@
+/*
+ * q2pc_trans_pkt.c
+ */
+
+ //#LINKFLAGS=-lpthread
+
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+
+#include "q2pc_trans_pkt.h"
+#include "udp_frame.h"
+#include "conn_vector.h"
+#include "../errors/errors.h"
+#include "../protocol/q2pc_protocol.h"
+
+//Small blocks so that a block fills (and is handed to us) quickly. A partly filled block is only retired after
+//the retire timeout, which is the floor on receive latency with TPACKET_V3.
+#define PKT_BLOCK_SIZE  (64 * 1024)
+#define PKT_BLOCK_COUNT 64
+#define PKT_FRAME_SIZE  2048
+#define PKT_RETIRE_MS   1
+#define PKT_TX_FRAMES   1024
+
+
+struct q2pc_pkt_priv_s;
+
+typedef struct {
+    struct q2pc_pkt_priv_s* trans;
+
+    //For the reader
+    udp_inbox inbox;
+    udp_inbox_ent* read_ent;
+
+    //For the writer
+    i64 tx_frame;
+    bool tx_reserved;
+    udp_frame_addr dst;
+
+} q2pc_pkt_conn_priv;
+
+
+typedef struct q2pc_pkt_priv_s {
+    transport_s transport;
+
+    int fd;
+    int ifindex;
+    udp_frame_addr src;
+
+    char* ring;
+    i64 ring_len;
+    char* rx_ring;
+    char* tx_ring;
+
+    i64 rx_block;   //Next block the kernel will hand us
+    i64* rx_refs;   //Frames still sitting in inboxes, per block
+    bool* rx_walked; //Blocks sorted into the inboxes but not yet handed back, they mustn't be sorted again
+    i64 tx_next;    //Next frame in the tx ring
+
+    pthread_spinlock_t rx_lock;
+    pthread_spinlock_t tx_lock;
+
+    q2pc_pkt_conn_priv** conns;
+    i64 connections;
+
+} q2pc_pkt_priv;
+
+
+/***************************************************************************************************************************/
+
+static inline struct tpacket_block_desc* rx_block(q2pc_pkt_priv* priv, i64 idx)
+{
+    return (struct tpacket_block_desc*)(priv->rx_ring + idx * PKT_BLOCK_SIZE);
+}
+
+static inline void rx_block_release(q2pc_pkt_priv* priv, i64 idx)
+{
+    priv->rx_walked[idx] = false;
+    __atomic_store_n(&rx_block(priv, idx)->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+}
+
+
+//Walk every block the kernel has retired and sort the frames into the connection inboxes. Blocks can only be handed
+//back once every frame in them has been consumed, so we count references per block. The kernel fills blocks in order,
+//so if the next one is still held by the inboxes, nothing past it is ours yet either.
+static void rx_drain(q2pc_pkt_priv* priv)
+{
+    if(pthread_spin_trylock(&priv->rx_lock)){
+        return; //Someone else is draining for us
+    }
+
+    for(;;){
+        struct tpacket_block_desc* block = rx_block(priv, priv->rx_block);
+        if(priv->rx_walked[priv->rx_block]){
+            break;
+        }
+
+        if(!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)){
+            break;
+        }
+
+        const u32 pkts = block->hdr.bh1.num_pkts;
+        struct tpacket3_hdr* hdr = (struct tpacket3_hdr*)((char*)block + block->hdr.bh1.offset_to_first_pkt);
+        for(u32 i = 0; i < pkts; i++){
+            char* payload = NULL;
+            u16 dport     = 0;
+            i64 len       = udp_frame_parse((char*)hdr + hdr->tp_mac, hdr->tp_snaplen, NULL, &dport, &payload);
+
+            //Servers listen on port + client id, clients on the broadcast port
+            i64 idx = priv->transport.server ? (i64)dport - priv->transport.port - 1 : (i64)dport - priv->transport.port;
+            if(len >= 0 && idx >= 0 && idx < priv->connections && priv->conns[idx]){
+                if(udp_inbox_push(&priv->conns[idx]->inbox, payload, len, priv->rx_block)){
+                    priv->rx_refs[priv->rx_block]++;
+                }
+                else{
+                    ch_log_debug1("Inbox full on connection %li, dropping frame\n", idx);
+                }
+            }
+
+            hdr = (struct tpacket3_hdr*)((char*)hdr + hdr->tp_next_offset);
+        }
+
+        if(!priv->rx_refs[priv->rx_block]){
+            rx_block_release(priv, priv->rx_block);
+        }
+        else{
+            priv->rx_walked[priv->rx_block] = true;
+        }
+
+        priv->rx_block = (priv->rx_block + 1) % PKT_BLOCK_COUNT;
+    }
+
+    pthread_spin_unlock(&priv->rx_lock);
+}
+
+
+static int conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_pkt_conn_priv* priv = (q2pc_pkt_conn_priv*)this->priv;
+    if(priv->read_ent){
+        *data_o = priv->read_ent->data;
+        *len_o  = priv->read_ent->len;
+        return Q2PC_ENONE;
+    }
+
+    udp_inbox_ent* ent = udp_inbox_peek(&priv->inbox);
+    if(!ent){
+        rx_drain(priv->trans);
+        ent = udp_inbox_peek(&priv->inbox);
+        if(!ent){
+            return Q2PC_EAGAIN;
+        }
+    }
+
+    priv->read_ent = ent;
+    *data_o = ent->data;
+    *len_o  = ent->len;
+    ch_log_debug3("Got %li bytes\n", ent->len);
+
+    return Q2PC_ENONE;
+}
+
+
+static int conn_end_read(struct q2pc_trans_conn_s* this)
+{
+    q2pc_pkt_conn_priv* priv = (q2pc_pkt_conn_priv*)this->priv;
+    if(!priv->read_ent){
+        return Q2PC_ENONE;
+    }
+
+    q2pc_pkt_priv* trans = priv->trans;
+    pthread_spin_lock(&trans->rx_lock);
+    const i64 block = priv->read_ent->tag;
+    trans->rx_refs[block]--;
+    if(!trans->rx_refs[block]){
+        rx_block_release(trans, block);
+    }
+    pthread_spin_unlock(&trans->rx_lock);
+
+    priv->read_ent = NULL;
+    udp_inbox_pop(&priv->inbox);
+    return Q2PC_ENONE;
+}
+
+
+static inline struct tpacket3_hdr* tx_frame(q2pc_pkt_priv* priv, i64 idx)
+{
+    return (struct tpacket3_hdr*)(priv->tx_ring + idx * PKT_FRAME_SIZE);
+}
+
+#define PKT_TX_DATA_OFF TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+
+
+static void tx_kick(q2pc_pkt_priv* priv)
+{
+    if(send(priv->fd, NULL, 0, MSG_DONTWAIT) < 0){
+        if(errno != EAGAIN && errno != ENOBUFS){
+            ch_log_fatal("Packet ring transmit failed: %s\n", strerror(errno));
+        }
+    }
+}
+
+
+//Hand out the next free tx ring frame, the caller writes the message straight into the ring
+static int conn_beg_write(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_pkt_conn_priv* priv = (q2pc_pkt_conn_priv*)this->priv;
+    q2pc_pkt_priv* trans     = priv->trans;
+
+    if(!priv->tx_reserved){
+        pthread_spin_lock(&trans->tx_lock);
+        struct tpacket3_hdr* hdr = tx_frame(trans, trans->tx_next);
+        while(__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE){
+            tx_kick(trans); //Ring is full, wait for the kernel to catch up
+        }
+        priv->tx_frame = trans->tx_next;
+        trans->tx_next = (trans->tx_next + 1) % PKT_TX_FRAMES;
+        pthread_spin_unlock(&trans->tx_lock);
+        priv->tx_reserved = true;
+    }
+
+    *data_o = (char*)tx_frame(trans, priv->tx_frame) + PKT_TX_DATA_OFF + UDP_FRAME_HDR_LEN;
+    *len_o  = PKT_FRAME_SIZE - PKT_TX_DATA_OFF - UDP_FRAME_HDR_LEN;
+    return Q2PC_ENONE;
+}
+
+
+static int conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
+{
+    q2pc_pkt_conn_priv* priv = (q2pc_pkt_conn_priv*)this->priv;
+    q2pc_pkt_priv* trans     = priv->trans;
+
+    if(!priv->tx_reserved){
+        ch_log_fatal("Error: packet ring end write without a frame from begin write\n");
+    }
+
+    if(len > PKT_FRAME_SIZE - (i64)PKT_TX_DATA_OFF - UDP_FRAME_HDR_LEN){
+        ch_log_fatal("Error: Wrote more data than the buffer could handle. Memory corruption is likely\n ");
+    }
+
+    struct tpacket3_hdr* hdr = tx_frame(trans, priv->tx_frame);
+    udp_frame_build((char*)hdr + PKT_TX_DATA_OFF, &trans->src, &priv->dst, len);
+    hdr->tp_len     = UDP_FRAME_HDR_LEN + len;
+    hdr->tp_snaplen = UDP_FRAME_HDR_LEN + len;
+    hdr->tp_next_offset = 0;
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+    priv->tx_reserved = false;
+
+    tx_kick(trans);
+    return Q2PC_ENONE;
+}
+
+
+static void conn_delete(struct q2pc_trans_conn_s* this)
+{
+    if(this){
+        if(this->priv){
+            free(this->priv);
+        }
+
+        //XXX HACK!
+        //free(this);
+    }
+}
+
+
+
+/***************************************************************************************************************************/
+
+//Only let UDP frames for our port range into the ring, everything else on the interface is none of our business
+static void attach_filter(q2pc_pkt_priv* priv)
+{
+    const u32 port_lo = priv->transport.server ? priv->transport.port + 1 : priv->transport.port;
+    const u32 port_hi = priv->transport.server ? priv->transport.port + priv->transport.client_count : priv->transport.port;
+
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD  | BPF_H   | BPF_ABS, 12),                  // ethertype
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   ETHERTYPE_IP, 0, 8),
+        BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS, 14),                  // version/ihl
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   0x45, 0, 6),
+        BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS, 23),                  // protocol
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   IPPROTO_UDP, 0, 4),
+        BPF_STMT(BPF_LD  | BPF_H   | BPF_ABS, 36),                  // udp dest port
+        BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K,   port_lo, 0, 2),
+        BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K,   port_hi, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K,             0xFFFF),
+        BPF_STMT(BPF_RET | BPF_K,             0),
+    };
+
+    struct sock_fprog prog = { .len = sizeof(code) / sizeof(code[0]), .filter = code };
+    if(setsockopt(priv->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog))){
+        ch_log_fatal("Could not attach packet filter: %s\n", strerror(errno));
+    }
+}
+
+
+static void init_ring(q2pc_pkt_priv* priv)
+{
+    priv->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_IP));
+    if(priv->fd < 0){
+        ch_log_fatal("Could not create packet socket (%s)\n", strerror(errno));
+    }
+
+    //Keep the Q-Jump priority marking, the packet socket's priority is carried on every frame we transmit
+    int priority = 7;
+    if(setsockopt(priv->fd, SOL_SOCKET, SO_PRIORITY, &priority, sizeof(int)) < 0) {
+        ch_log_fatal("Packet ring set priority failed: %s\n",strerror(errno));
+    }
+
+    attach_filter(priv);
+
+    int version = TPACKET_V3;
+    if(setsockopt(priv->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version))){
+        ch_log_fatal("Could not set TPACKET_V3: %s\n", strerror(errno));
+    }
+
+    //We never want to see our own transmissions, the filter catches them on older kernels anyway
+    #ifdef PACKET_IGNORE_OUTGOING
+    int ignore = 1;
+    if(setsockopt(priv->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &ignore, sizeof(ignore))){
+        ch_log_debug1("Could not ignore outgoing frames: %s\n", strerror(errno));
+    }
+    #endif
+
+    struct tpacket_req3 rx_req;
+    memset(&rx_req, 0, sizeof(rx_req));
+    rx_req.tp_block_size       = PKT_BLOCK_SIZE;
+    rx_req.tp_block_nr         = PKT_BLOCK_COUNT;
+    rx_req.tp_frame_size       = PKT_FRAME_SIZE;
+    rx_req.tp_frame_nr         = (PKT_BLOCK_SIZE / PKT_FRAME_SIZE) * PKT_BLOCK_COUNT;
+    rx_req.tp_retire_blk_tov   = PKT_RETIRE_MS;
+    if(setsockopt(priv->fd, SOL_PACKET, PACKET_RX_RING, &rx_req, sizeof(rx_req))){
+        ch_log_fatal("Could not set up packet rx ring: %s\n", strerror(errno));
+    }
+
+    struct tpacket_req3 tx_req;
+    memset(&tx_req, 0, sizeof(tx_req));
+    tx_req.tp_block_size       = PKT_BLOCK_SIZE;
+    tx_req.tp_block_nr         = (PKT_TX_FRAMES * PKT_FRAME_SIZE) / PKT_BLOCK_SIZE;
+    tx_req.tp_frame_size       = PKT_FRAME_SIZE;
+    tx_req.tp_frame_nr         = PKT_TX_FRAMES;
+    if(setsockopt(priv->fd, SOL_PACKET, PACKET_TX_RING, &tx_req, sizeof(tx_req))){
+        ch_log_fatal("Could not set up packet tx ring: %s\n", strerror(errno));
+    }
+
+    const i64 rx_len = (i64)PKT_BLOCK_SIZE * PKT_BLOCK_COUNT;
+    const i64 tx_len = (i64)PKT_TX_FRAMES * PKT_FRAME_SIZE;
+    priv->ring_len = rx_len + tx_len;
+    priv->ring = mmap(NULL, priv->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, priv->fd, 0);
+    if(priv->ring == MAP_FAILED){
+        //MAP_LOCKED needs the memlock limit, try again without it
+        priv->ring = mmap(NULL, priv->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED, priv->fd, 0);
+        if(priv->ring == MAP_FAILED){
+            ch_log_fatal("Could not map packet rings: %s\n", strerror(errno));
+        }
+    }
+    priv->rx_ring = priv->ring;
+    priv->tx_ring = priv->ring + rx_len;
+
+    priv->rx_refs = calloc(PKT_BLOCK_COUNT, sizeof(i64));
+    priv->rx_walked = calloc(PKT_BLOCK_COUNT, sizeof(bool));
+    if(!priv->rx_refs || !priv->rx_walked){
+        ch_log_fatal("Malloc failed!\n");
+    }
+
+    struct sockaddr_ll ll;
+    memset(&ll, 0, sizeof(ll));
+    ll.sll_family   = AF_PACKET;
+    ll.sll_protocol = htons(ETH_P_IP);
+    ll.sll_ifindex  = priv->ifindex;
+    if(bind(priv->fd, (struct sockaddr*)&ll, sizeof(ll))){
+        ch_log_fatal("Could not bind packet socket to %s: %s\n", priv->transport.iface, strerror(errno));
+    }
+}
+
+
+static q2pc_pkt_conn_priv* init_new_conn(q2pc_trans_conn* conn)
+{
+    q2pc_pkt_conn_priv* new_priv = calloc(1,sizeof(q2pc_pkt_conn_priv));
+    if(!new_priv){
+        ch_log_fatal("Malloc failed!\n");
+    }
+
+    conn->priv      = new_priv;
+    conn->beg_read  = conn_beg_read;
+    conn->end_read  = conn_end_read;
+    conn->beg_write = conn_beg_write;
+    conn->end_write = conn_end_write;
+    conn->delete    = conn_delete;
+
+    return new_priv;
+}
+
+
+//Connections are just a slot in the inbox table, there is only one socket underneath
+static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
+{
+    q2pc_pkt_priv* trans_priv = (q2pc_pkt_priv*)this->priv;
+
+    if(!conn->priv){
+        const i64 max_conns = trans_priv->transport.server ? trans_priv->transport.client_count : 1;
+        if(trans_priv->connections >= max_conns){
+            ch_log_fatal("Too many packet ring connections, expected at most %li\n", max_conns);
+        }
+
+        q2pc_pkt_conn_priv* new_priv = init_new_conn(conn);
+        new_priv->trans = trans_priv;
+
+        //No ARP here either, everything goes to the broadcast MAC and is picked up by port
+        memset(new_priv->dst.mac, 0xFF, sizeof(new_priv->dst.mac));
+        if(trans_priv->transport.server){
+            //Send to the client(s) on the broadcast port
+            new_priv->dst.ip   = inet_addr(trans_priv->transport.bcast);
+            new_priv->dst.port = trans_priv->transport.port;
+        }
+        else{
+            //Send to the server on the server port
+            new_priv->dst.ip   = inet_addr(trans_priv->transport.ip);
+            new_priv->dst.port = trans_priv->transport.port + trans_priv->transport.client_id;
+        }
+
+        __sync_synchronize(); //Make sure the connection is fully set up before the receive path can see it
+        trans_priv->conns[trans_priv->connections] = new_priv;
+        trans_priv->connections++;
+    }
+
+    return Q2PC_ENONE;
+}
+
+
+static void serv_delete(struct q2pc_trans_s* this)
+{
+    if(this){
+
+        if(this->priv){
+            q2pc_pkt_priv* priv = (q2pc_pkt_priv*)this->priv;
+            munmap(priv->ring, priv->ring_len);
+            close(priv->fd);
+            free(priv->rx_refs);
+            free(priv->rx_walked);
+            free(priv->conns);
+            free(this->priv);
+        }
+
+        free(this);
+    }
+
+}
+
+
+static void init(q2pc_pkt_priv* priv)
+{
+    ch_log_debug1("Constructing packet ring transport\n");
+
+    pthread_spin_init(&priv->rx_lock, PTHREAD_PROCESS_PRIVATE);
+    pthread_spin_init(&priv->tx_lock, PTHREAD_PROCESS_PRIVATE);
+
+    const i64 max_conns = priv->transport.server ? priv->transport.client_count : 1;
+    priv->conns = calloc(max_conns, sizeof(q2pc_pkt_conn_priv*));
+    if(!priv->conns){
+        ch_log_fatal("Malloc failed!\n");
+    }
+
+    udp_frame_iface(priv->transport.iface, &priv->ifindex, &priv->src);
+    priv->src.port = priv->transport.server ? priv->transport.port : priv->transport.port + priv->transport.client_id;
+
+    init_ring(priv);
+
+    ch_log_debug1("Done constructing packet ring transport\n");
+}
+
+
+q2pc_trans* q2pc_pkt_construct(const transport_s* transport)
+{
+    q2pc_trans* result = (q2pc_trans*)calloc(1,sizeof(q2pc_trans));
+    if(!result){
+        ch_log_fatal("Could not allocate packet ring server structure\n");
+    }
+
+    q2pc_pkt_priv* priv = (q2pc_pkt_priv*)calloc(1,sizeof(q2pc_pkt_priv));
+    if(!priv){
+        ch_log_fatal("Could not allocate packet ring server private structure\n");
+    }
+
+    result->priv          = priv;
+    result->connect       = doconnect;
+    result->delete        = serv_delete;
+    memcpy(&priv->transport,transport, sizeof(transport_s));
+    init(priv);
+
+
+    return result;
+}
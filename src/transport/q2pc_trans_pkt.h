@@ -0,0 +1,12 @@
+/*
+ * q2pc_trans_pkt.h
+ */
+
+#ifndef Q2PC_TRANS_PKT_H_
+#define Q2PC_TRANS_PKT_H_
+
+#include "q2pc_transport.h"
+
+q2pc_trans* q2pc_pkt_construct(const transport_s* transport);
+
+#endif /* Q2PC_TRANS_PKT_H_ */
@@ -17,51 +17,139 @@
 #include <stdio.h>
 
 #include "q2pc_trans_qj.h"
+#include "buf_pool.h"
+#include "udp_frag.h"
+#include "tsc.h"
 #include "conn_vector.h"
 #include "../errors/errors.h"
 #include "../protocol/q2pc_protocol.h"
 
 typedef struct {
-    int wr_fd; //Writing file descriptor
+    int wr_fds[Q2PC_CLASS_COUNT]; //Writing file descriptors, one for each traffic class. Shared on the server
+    q2pc_class_e cls; //The class writes go out in
     int rd_fd; //Reading file descriptor
+    buf_pool_rx_meta rx_meta; //Kernel drops and timestamps on rd_fd
+
+    buf_pool* pool;
 
     //For the reader
     void* read_buffer;
     i64   read_buffer_used;
     i64   read_buffer_size;
+    char* overflow; //Set if the last message was too big for the read buffer
+    char* read_data; //Where the message we handed out is
+    udp_frag_reasm reasm;
 
     //For the writer
     void* write_buffer;
     i64   write_buffer_used;
     i64   write_buffer_size;
+    u16   frag_id;
 
 } q2pc_qj_conn_priv;
 
 
+//Each traffic class has a writer of its own, marked for the switches (DSCP) and for the host's queues (priority)
+static const struct {
+    int priority;
+    int tos;
+    bool paced;
+} qj_classes[Q2PC_CLASS_COUNT] = {
+    [q2pc_class_decision] = { .priority = 7, .tos = 0xB8, .paced = true },     //EF
+    [q2pc_class_control]  = { .priority = 6, .tos = 0x88, .paced = true },     //AF41
+    [q2pc_class_bulk]     = { .priority = 0, .tos = 0x28, .paced = false },    //AF11
+};
+
+
+//Q-Jump pacing, in user space for hosts without the Q-Jump qdisc. The host may send qjump_limit bytes each qjump_epoch
+//in the paced classes, anything over that goes out in the bulk class instead. The bucket is shared by every
+//connection in the process. It's kept as the TSC time it will next be full (GCRA), so it can be taken without a lock.
+
+static struct {
+    volatile u64 full_tsc;
+    u64 epoch_tsc;
+    u64 limit;          //Bytes, 0 for no pacing
+    volatile i64 sent_hi;
+    volatile i64 sent_lo;
+} pacer;
+
+
+//Returns true if the bytes can go out at high priority
+static bool pace(u64 bytes)
+{
+    if(!pacer.limit){
+        return true;
+    }
+
+    const u64 now  = tsc_read();
+    const u64 cost = bytes * pacer.epoch_tsc / pacer.limit;
+    for(;;){
+        const u64 full  = pacer.full_tsc;
+        const u64 start = MAX(full, now);
+        if(start + cost > now + pacer.epoch_tsc){
+            __sync_fetch_and_add(&pacer.sent_lo, 1);
+            return false;
+        }
+
+        if(__sync_bool_compare_and_swap(&pacer.full_tsc, full, start + cost)){
+            __sync_fetch_and_add(&pacer.sent_hi, 1);
+            return true;
+        }
+    }
+}
+
+
 
 static int conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
 {
     q2pc_qj_conn_priv* priv = (q2pc_qj_conn_priv*)this->priv;
     if( priv->read_buffer && priv->read_buffer_used){
+        *data_o = priv->read_data;
+        *len_o  = priv->read_buffer_used;
         return Q2PC_ENONE;
     }
 
-    int result = read(priv->rd_fd, priv->read_buffer, priv->read_buffer_size);
-    if(result < 0){
-        if(errno == EAGAIN || errno == EWOULDBLOCK){
-            return Q2PC_EAGAIN; //Reading would have blocked, we don't want this
+    //Keep reading until there is a whole message, or nothing left
+    for(;;){
+        int result = buf_pool_recv(priv->rd_fd, priv->read_buffer, priv->read_buffer_size, NULL, &priv->overflow, &priv->rx_meta);
+        if(result < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                return Q2PC_EAGAIN; //Reading would have blocked, we don't want this
+            }
+
+            ch_log_fatal("qj read failed on fd=%i - %s\n",priv->rd_fd,strerror(errno));
         }
 
-        ch_log_fatal("qj read failed on fd=%i - %s\n",priv->rd_fd,strerror(errno));
-    }
+        if(result == 0){
+            return Q2PC_EFIN;
+        }
 
-    if(result == 0){
-        return Q2PC_EFIN;
-    }
+        priv->read_buffer_used = result;
+        priv->read_data        = priv->overflow ? priv->overflow : priv->read_buffer;
+
+        //Pieces of a bigger message are held back until it's all here
+        if(udp_frag_is_frag(priv->read_data, result)){
+            char* msg = NULL;
+            const i64 msg_len = udp_frag_add(&priv->reasm, priv->read_data, result, &msg);
+
+            priv->read_buffer_used = 0;
+            if(priv->overflow){
+                buf_pool_overflow_put(priv->overflow);
+                priv->overflow = NULL;
+            }
+
+            if(!msg_len){
+                continue; //Edge triggered, so the rest of it may already be waiting without an edge to show for it
+            }
+
+            priv->read_buffer_used = msg_len;
+            priv->read_data        = msg;
+        }
 
-    priv->read_buffer_used = result;
+        break;
+    }
 
-    *data_o = priv->read_buffer;
+    *data_o = priv->read_data;
     *len_o  = priv->read_buffer_used;
     ch_log_debug3("Got %li bytes\n", priv->read_buffer_used);
 
@@ -73,6 +161,10 @@ static int conn_end_read(struct q2pc_trans_conn_s* this)
 {
     q2pc_qj_conn_priv* priv = (q2pc_qj_conn_priv*)this->priv;
     priv->read_buffer_used = 0;
+    if(priv->overflow){
+        buf_pool_overflow_put(priv->overflow);
+        priv->overflow = NULL;
+    }
     return 0;
 }
 
@@ -87,22 +179,30 @@ static int conn_beg_write(struct q2pc_trans_conn_s* this, char** data_o, i64* le
 }
 
 
-static int conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
+//The payload goes out straight from where it is, behind the first len bytes of the write buffer
+static int conn_end_writev(struct q2pc_trans_conn_s* this, i64 len, const struct iovec* payload, int payload_count)
 {
     q2pc_qj_conn_priv* priv = (q2pc_qj_conn_priv*)this->priv;
-    char* data = priv->write_buffer;
 
     if(len > priv->write_buffer_size){
         ch_log_fatal("Error: Wrote more data than the buffer could handle. Memory corruption is likely\n ");
     }
 
-    while(len > 0){
-        i64 written =  write(priv->wr_fd, data ,len);
-        if(written < 0){
-            ch_log_fatal("QJ write failed: %s\n",strerror(errno));
-        }
-        data += written;
-        len -= written;
+    if(payload_count >= UDP_FRAG_IOV_MAX){
+        ch_log_fatal("Payload is in %i pieces, QJ can only send %i\n", payload_count, UDP_FRAG_IOV_MAX - 1);
+    }
+
+    struct iovec iov[UDP_FRAG_IOV_MAX] = { { .iov_base = priv->write_buffer, .iov_len = len } };
+    u64 bytes = len;
+    for(int i = 0; i < payload_count; i++){
+        iov[i + 1] = payload[i];
+        bytes     += payload[i].iov_len;
+    }
+
+    const q2pc_class_e cls = !qj_classes[priv->cls].paced || pace(bytes) ? priv->cls : q2pc_class_bulk;
+    const int fd = priv->wr_fds[cls];
+    if(udp_frag_send(fd, iov, payload_count + 1, &priv->frag_id) < 0){
+        ch_log_fatal("QJ write failed: %s\n",strerror(errno));
     }
 
     return 0;
@@ -110,13 +210,49 @@ static int conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
 }
 
 
+static int conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
+{
+    return conn_end_writev(this, len, NULL, 0);
+}
+
+
+static void conn_set_class(struct q2pc_trans_conn_s* this, q2pc_class_e cls)
+{
+    q2pc_qj_conn_priv* priv = (q2pc_qj_conn_priv*)this->priv;
+    priv->cls = cls;
+}
+
+
+static i64 conn_get_drops(struct q2pc_trans_conn_s* this)
+{
+    q2pc_qj_conn_priv* priv = (q2pc_qj_conn_priv*)this->priv;
+    return priv->rx_meta.drops;
+}
+
+
+static i64 conn_get_rx_ts(struct q2pc_trans_conn_s* this)
+{
+    q2pc_qj_conn_priv* priv = (q2pc_qj_conn_priv*)this->priv;
+    return priv->rx_meta.rx_ts_ns;
+}
+
+
+static int conn_get_fd(struct q2pc_trans_conn_s* this)
+{
+    q2pc_qj_conn_priv* priv = (q2pc_qj_conn_priv*)this->priv;
+    return priv->rd_fd;
+}
+
+
 static void conn_delete(struct q2pc_trans_conn_s* this)
 {
     if(this){
         if(this->priv){
             q2pc_qj_conn_priv* priv = (q2pc_qj_conn_priv*)this->priv;
-            if(priv->read_buffer){ free(priv->read_buffer); }
-            //if(priv->write_buffer){ free(priv->write_buffer); } --Not necessary since r+w are allocated together
+            buf_pool_put(priv->pool, priv->read_buffer);
+            buf_pool_put(priv->pool, priv->write_buffer);
+            buf_pool_overflow_put(priv->overflow);
+            udp_frag_free(&priv->reasm);
             free(this->priv);
         }
 
@@ -134,37 +270,36 @@ typedef struct {
     transport_s transport;
 
     i64 connections;
+    buf_pool* pool;
+
+    //The server broadcasts, so one writer per class reaches every client and all connections share them
+    int bcast_fds[Q2PC_CLASS_COUNT];
 
 } q2pc_qj_priv;
 
 
-#define BUFF_SIZE (4096 * 1024) //A 4MB buffer. Just because it feels right
-static q2pc_qj_conn_priv* new_conn_priv()
+//Buffers are sized to the messages, anything bigger borrows from the overflow pool
+static q2pc_qj_conn_priv* new_conn_priv(buf_pool* pool)
 {
     q2pc_qj_conn_priv* new_priv = calloc(1,sizeof(q2pc_qj_conn_priv));
     if(!new_priv){
         ch_log_fatal("Malloc failed!\n");
     }
 
-    void* read_buff = calloc(2,BUFF_SIZE);
-    if(!read_buff){
-        ch_log_fatal("Malloc failed!\n");
-    }
-    new_priv->read_buffer = read_buff;
-    new_priv->read_buffer_size = BUFF_SIZE;
-
-    void* write_buff = (char*)read_buff + BUFF_SIZE;
-    new_priv->write_buffer = write_buff;
-    new_priv->write_buffer_size = BUFF_SIZE;
-
+    new_priv->pool              = pool;
+    new_priv->read_buffer       = buf_pool_get(pool);
+    new_priv->read_buffer_size  = buf_pool_buff_size(pool);
+    new_priv->write_buffer      = buf_pool_get(pool);
+    new_priv->write_buffer_size = buf_pool_buff_size(pool);
+    new_priv->cls               = q2pc_class_control;
 
     return new_priv;
 
 }
 
-static q2pc_qj_conn_priv* init_new_conn(q2pc_trans_conn* conn)
+static q2pc_qj_conn_priv* init_new_conn(q2pc_trans_conn* conn, buf_pool* pool)
 {
-    q2pc_qj_conn_priv* new_priv = new_conn_priv();
+    q2pc_qj_conn_priv* new_priv = new_conn_priv(pool);
 
 
     conn->priv      = new_priv;
@@ -172,6 +307,11 @@ static q2pc_qj_conn_priv* init_new_conn(q2pc_trans_conn* conn)
     conn->end_read  = conn_end_read;
     conn->beg_write = conn_beg_write;
     conn->end_write = conn_end_write;
+    conn->end_writev = conn_end_writev;
+    conn->set_class = conn_set_class;
+    conn->get_drops = conn_get_drops;
+    conn->get_rx_ts = conn_get_rx_ts;
+    conn->get_fd    = conn_get_fd;
     conn->delete    = conn_delete;
 
     return new_priv;
@@ -217,7 +357,7 @@ static void safe_wait_bind(int fd, struct sockaddr_in* addr)
 
 }
 
-static int new_socket()
+static int new_socket(const transport_s* transport, q2pc_class_e cls)
 {
     int sock_fd = socket(AF_INET,SOCK_DGRAM,0);
     if (sock_fd < 0 ){
@@ -229,11 +369,18 @@ static int new_socket()
         ch_log_fatal("QJ set reuse address failed: %s\n",strerror(errno));
     }
 
-    int priority = 7;
+    trans_sock_options(sock_fd, transport);
+
+    int priority = qj_classes[cls].priority;
     if(setsockopt(sock_fd, SOL_SOCKET, SO_PRIORITY, &priority, sizeof(int)) < 0) {
         ch_log_fatal("QJ set priority address failed: %s\n",strerror(errno));
     }
 
+    int tos = qj_classes[cls].tos;
+    if(setsockopt(sock_fd, IPPROTO_IP, IP_TOS, &tos, sizeof(int)) < 0) {
+        ch_log_fatal("QJ set type of service failed: %s\n",strerror(errno));
+    }
+
 
     int flags = 0;
     flags |= O_NONBLOCK;
@@ -247,6 +394,44 @@ static int new_socket()
 
 
 
+//Servers broadcast to every client, clients send to the server on a port of their own
+static int new_writer(q2pc_qj_priv* trans_priv, q2pc_class_e cls)
+{
+    int sock_wr_fd = new_socket(&trans_priv->transport, cls);
+
+    struct sockaddr_in addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sin_family      = AF_INET;
+
+    if(trans_priv->transport.server){
+        //Send to the client(s) on the broadcast port
+        addr.sin_addr.s_addr = inet_addr(trans_priv->transport.bcast);
+        addr.sin_port        = htons(trans_priv->transport.port);
+
+        int broadcastEnable=1;
+        if( setsockopt(sock_wr_fd, SOL_SOCKET, SO_BROADCAST, &broadcastEnable, sizeof(broadcastEnable)) ){
+            ch_log_fatal("Could not set broadcast on fd=%i: %s\n",sock_wr_fd,strerror(errno));
+        }
+
+        ch_log_debug2("Binding to interface name=%s\n", trans_priv->transport.iface);
+        struct ifreq ifr;
+        memset(&ifr, 0, sizeof(ifr));
+        snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", trans_priv->transport.iface );
+        if( setsockopt(sock_wr_fd, SOL_SOCKET, SO_BINDTODEVICE, (void *)&ifr, sizeof(ifr)) ){
+            ch_log_fatal("Could not set interface on fd=%i: %s\n",sock_wr_fd,strerror(errno));
+        }
+    }
+    else{
+        //Send to the server on the server port
+        addr.sin_addr.s_addr = inet_addr(trans_priv->transport.ip);
+        addr.sin_port        = htons(trans_priv->transport.port + trans_priv->transport.client_id);
+    }
+
+    safe_connect(sock_wr_fd,&addr);
+    return sock_wr_fd;
+}
+
+
 //Wait for all clients to connect
 static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
 {
@@ -255,59 +440,30 @@ static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
 
     if(!conn_priv){
 
-        q2pc_qj_conn_priv* new_priv = init_new_conn(conn);
+        q2pc_qj_conn_priv* new_priv = init_new_conn(conn, trans_priv->pool);
 
-        int sock_rd_fd = new_socket();
-        int sock_wr_fd = new_socket();
+        int sock_rd_fd = new_socket(&trans_priv->transport, q2pc_class_decision);
 
         struct sockaddr_in addr;
         memset(&addr,0,sizeof(addr));
         addr.sin_family      = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
 
         if(trans_priv->transport.server){
             //Listen to any address, on the client port number
             trans_priv->connections++;
-
-            addr.sin_addr.s_addr = INADDR_ANY;
             addr.sin_port        = htons(trans_priv->transport.port + trans_priv->connections);
-            safe_wait_bind(sock_rd_fd,&addr);
-            new_priv->rd_fd = sock_rd_fd;
-
-            //Send to the client(s) on the broadcast port
-            addr.sin_addr.s_addr = inet_addr(trans_priv->transport.bcast);
-            addr.sin_port        = htons(trans_priv->transport.port);
-
-            int broadcastEnable=1;
-            if( setsockopt(sock_wr_fd, SOL_SOCKET, SO_BROADCAST, &broadcastEnable, sizeof(broadcastEnable)) ){
-                ch_log_fatal("Could not set broadcast on fd=%i: %s\n",sock_wr_fd,strerror(errno));
-            }
-
-            ch_log_debug2("Binding to interface name=%s\n", trans_priv->transport.iface);
-            struct ifreq ifr;
-            memset(&ifr, 0, sizeof(ifr));
-            snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", trans_priv->transport.iface );
-            if( setsockopt(sock_wr_fd, SOL_SOCKET, SO_BINDTODEVICE, (void *)&ifr, sizeof(ifr)) ){
-                ch_log_fatal("Could not set interface on fd=%i: %s\n",sock_wr_fd,strerror(errno));
-            }
-
-            safe_connect(sock_wr_fd,&addr);
-
         }
         else{
-
             //Listen to any address, on the server broadcast port
-            addr.sin_addr.s_addr = INADDR_ANY;
             addr.sin_port        = htons(trans_priv->transport.port);
-            safe_wait_bind(sock_rd_fd,&addr);
-
-            //Send to the server on the server port
-            addr.sin_addr.s_addr = inet_addr(trans_priv->transport.ip);
-            addr.sin_port        = htons(trans_priv->transport.port + trans_priv->transport.client_id);
-            safe_connect(sock_wr_fd,&addr);
         }
+        safe_wait_bind(sock_rd_fd,&addr);
 
         new_priv->rd_fd = sock_rd_fd;
-        new_priv->wr_fd = sock_wr_fd;
+        for(int cls = 0; cls < Q2PC_CLASS_COUNT; cls++){
+            new_priv->wr_fds[cls] = trans_priv->transport.server ? trans_priv->bcast_fds[cls] : new_writer(trans_priv, cls);
+        }
 
         conn->priv = new_priv;
 
@@ -322,7 +478,12 @@ static void serv_delete(struct q2pc_trans_s* this)
     if(this){
 
         if(this->priv){
-            //q2pc_qj_priv* priv = (q2pc_qj_priv*)this->priv;
+            q2pc_qj_priv* priv = (q2pc_qj_priv*)this->priv;
+            if(pacer.limit && priv->transport.server){
+                ch_log_info("Q-Jump pacing sent %li messages in their class, %li over the limit in the bulk class\n",
+                        pacer.sent_hi, pacer.sent_lo);
+            }
+            buf_pool_delete(priv->pool);
             free(this->priv);
         }
 
@@ -332,12 +493,24 @@ static void serv_delete(struct q2pc_trans_s* this)
 }
 
 
-#define BUFF_SIZE (4096 * 1024) //A 4MB buffer. Just because
 static void init(q2pc_qj_priv* priv)
 {
 
-    (void)priv;
     ch_log_debug1("Constructing QJ transport\n");
+    priv->pool = buf_pool_new(priv->transport.msize, priv->transport.hugepages);
+
+    //Every transport in the process has the same settings, so whoever is first sets the pacer up
+    if(priv->transport.qjump_epoch > 0 && priv->transport.qjump_limit > 0){
+        pacer.epoch_tsc = priv->transport.qjump_epoch * tsc_hz() / (1000 * 1000);
+        pacer.limit     = priv->transport.qjump_limit;
+        ch_log_debug1("Q-Jump pacing to %liB every %lius\n", priv->transport.qjump_limit, priv->transport.qjump_epoch);
+    }
+
+    if(priv->transport.server){
+        for(int cls = 0; cls < Q2PC_CLASS_COUNT; cls++){
+            priv->bcast_fds[cls] = new_writer(priv, cls);
+        }
+    }
 
     ch_log_debug1("Done constructing QJ transport\n");
 
@@ -26,30 +26,57 @@
 
 #include "q2pc_trans_rudp.h"
 #include "q2pc_trans_udp.h"
+#include "q2pc_trans_udp_conn.h"  //The base connection is always UDP, so its calls are inlined
 #include "conn_vector.h"
 #include "../errors/errors.h"
 #include "../protocol/q2pc_protocol.h"
 
+//Each direction has sequence numbers of its own, compared modulo 2^16. Up to RUDP_WINDOW messages can be in flight
+//each way. Every message carries the last sequence number its sender has taken in order from the other end, so a reply
+//acknowledges what it answers without a message of its own. If nothing goes back within the ack delay, a standalone ack
+//(Q2PC_FLAG_ACK) does the job instead. Standalone acks also carry a selective ack of whatever has come in past a gap,
+//and go straight away when there is one, so only the missing message is sent again.
+#define RUDP_WINDOW 32          //Messages in flight each way, at most 32 so a window fits a SACK bitmap
+#define RUDP_ACK_DELAY_DIV 4    //Standalone acks go after this fraction of the retransmit timeout
+
+#define RUDP_ACK_LEN (Q2PC_MSG_MIN + sizeof(u32))   //Standalone ack, the SACK bitmap follows the message
+
+//A copy of a message, kept until the other end has it. Sent messages keep their payload where it was.
+typedef struct {
+    u16 seq;
+    bool sacked;
+    i64 sent_us;
+    char* msg;
+    i64 len;
+    i64 size;
+    struct iovec payload[UDP_FRAG_IOV_MAX - 1];
+    int payload_count;
+} rudp_slot;
+
 typedef struct {
     q2pc_trans_conn base;
     bool is_server;
-    volatile i64 seq_no;
+
+    //Sending. Everything up to tx_acked has been acknowledged, tx_acked + 1 to tx_seq is in flight.
+    u16 tx_seq;
+    u16 tx_acked;
+    rudp_slot tx[RUDP_WINDOW];
+    i64 rtos_fired;         //Since the last flush
+
+    //Receiving. rx_next is the next message for the reader. Bit i of rx_have is set if rx_next + i came early and is
+    //waiting in its slot.
+    u16 rx_next;
+    u32 rx_have;
+    rudp_slot rx[RUDP_WINDOW];
+    bool rx_from_slot;      //What the reader has came out of a slot, not the base
+    i64 ack_due_us;         //When a standalone ack has to go if nothing else carries one, 0 if none is owed
+    i64 ack_delay_us;
 
     char* read_data;
     i64 read_data_len;
 
     char* write_data;
 
-    pthread_mutex_t mutex;
-
-    struct timeval ts_start;
-    struct timeval ts_now;
-    i64 ts_start_us;
-    i64 ts_now_us;
-
-    bool ack_outstanding;
-    i64 current_seq;
-
     i64 rto_timeout_us;
 
 } q2pc_rudp_conn_priv;
@@ -59,87 +86,290 @@ typedef struct {
 #define PAUSE()    __asm__ volatile("pause")
 
 
+static i64 time_now_us()
+{
+    struct timeval ts_now = {0};
+    gettimeofday(&ts_now, NULL);
+    return ts_now.tv_sec * 1000 * 1000 + ts_now.tv_usec;
+}
+
+
+static void slot_copy(rudp_slot* slot, const char* msg, i64 len)
+{
+    if(slot->size < len){
+        slot->msg  = realloc(slot->msg, len);
+        slot->size = len;
+        if(!slot->msg){
+            ch_log_fatal("Could not allocate %liB for an RUDP message\n", len);
+        }
+    }
+
+    memcpy(slot->msg, msg, len);
+    slot->len = len;
+}
+
+
+//How many of the messages from rx_next on have come in without a gap
+static int rx_run(const q2pc_rudp_conn_priv* priv)
+{
+    return __builtin_ctzll(~(u64)priv->rx_have);
+}
+
+
+//Everything up to here has come in, ready for the reader or not
+static u16 rx_acked(const q2pc_rudp_conn_priv* priv)
+{
+    return priv->rx_next - 1 + rx_run(priv);
+}
+
+
+//Acknowledge everything taken so far, and what has come in past the first gap. This goes straight out, the write
+//buffer may have a message half written in it.
+static int send_ack(q2pc_rudp_conn_priv* priv)
+{
+    const u16 acked = rx_acked(priv);
+    const u32 sack  = htole32((u32)((u64)priv->rx_have >> (rx_run(priv) + 1)));
+
+    char ack_msg[RUDP_ACK_LEN] = {0};
+    const q2pc_hdr hdr = { .flags = Q2PC_FLAG_ACK, .type = q2pc_ack_msg };
+    q2pc_msg_encode((q2pc_msg*)ack_msg, &hdr);
+    q2pc_msg_set_seq((q2pc_msg*)ack_msg, priv->tx_seq);
+    q2pc_msg_set_ack((q2pc_msg*)ack_msg, acked);
+    memcpy(ack_msg + Q2PC_MSG_MIN, &sack, sizeof(sack));
+
+    ch_log_debug3("Sending standalone ack=%u sack=%x\n", acked, le32toh(sack));
+    priv->ack_due_us = 0;
+
+    const struct iovec iov = { .iov_base = ack_msg, .iov_len = sizeof(ack_msg) };
+    return udp_conn_sendv(&priv->base, &iov, 1);
+}
+
+
+static int send_slot(q2pc_rudp_conn_priv* priv, rudp_slot* slot, i64 now_us)
+{
+    //Whatever goes out acknowledges what has come in by now
+    q2pc_msg_set_ack((q2pc_msg*)slot->msg, rx_acked(priv));
+    priv->ack_due_us = 0;
+    slot->sent_us    = now_us;
+
+    struct iovec iov[UDP_FRAG_IOV_MAX] = { { .iov_base = slot->msg, .iov_len = slot->len } };
+    memcpy(iov + 1, slot->payload, sizeof(struct iovec) * slot->payload_count);
+    return udp_conn_sendv(&priv->base, iov, slot->payload_count + 1);
+}
+
+
+static int resend_slot(q2pc_rudp_conn_priv* priv, rudp_slot* slot, i64 now_us)
+{
+    ch_log_debug3("Retransmitting seq=%u after %lius\n", slot->seq, now_us - slot->sent_us);
+
+    //XXX HACK!
+    if(priv->is_server){
+        q2pc_msg_rto_inc(&((q2pc_msg*)slot->msg)->c_rto);
+    }
+    else{
+        q2pc_msg_rto_inc(&((q2pc_msg*)slot->msg)->s_rto);
+    }
+
+    priv->rtos_fired++;
+    return send_slot(priv, slot, now_us);
+}
+
+
+//Retransmit whatever has timed out, and acknowledge if it's due
+static int service(q2pc_rudp_conn_priv* priv)
+{
+    if(priv->tx_seq == priv->tx_acked && !priv->ack_due_us){
+        return Q2PC_ENONE;
+    }
+
+    const i64 now_us = time_now_us();
+    for(u16 seq = priv->tx_acked + 1; (i16)(priv->tx_seq - seq) >= 0; seq++){
+        rudp_slot* slot = &priv->tx[seq % RUDP_WINDOW];
+        if(slot->sacked || now_us < slot->sent_us + priv->rto_timeout_us){
+            continue;
+        }
+
+        const int result = resend_slot(priv, slot, now_us);
+        if(result){
+            return result;
+        }
+    }
+
+    if(priv->ack_due_us && now_us >= priv->ack_due_us){
+        return send_ack(priv);
+    }
+
+    return Q2PC_ENONE;
+}
+
+
+//The acknowledgement part of anything that comes in
+static int take_ack(q2pc_rudp_conn_priv* priv, const char* data, i64 len)
+{
+    const q2pc_msg* msg = (const q2pc_msg*)data;
+    const u16 ack = q2pc_msg_ack(msg);
+    if((i16)(ack - priv->tx_acked) > 0 && (i16)(priv->tx_seq - ack) >= 0){
+        ch_log_debug3("Got ack for seq=%u\n", ack);
+        priv->tx_acked = ack;
+    }
+
+    if(!(msg->ver_flags & Q2PC_FLAG_ACK) || len < (i64)RUDP_ACK_LEN){
+        return Q2PC_ENONE;
+    }
+
+    u32 sack;
+    memcpy(&sack, data + Q2PC_MSG_MIN, sizeof(sack));
+    sack = le32toh(sack);
+    if(!sack){
+        return Q2PC_ENONE;
+    }
+
+    //Bit i says ack + 2 + i is there, so ack + 1 is missing. Mark what they have, and send the gap again now, unless
+    //it has only just gone.
+    for(int i = 0; i < 32; i++){
+        const u16 seq = ack + 2 + i;
+        if((sack >> i & 1) && (i16)(seq - priv->tx_acked) > 0 && (i16)(priv->tx_seq - seq) >= 0){
+            priv->tx[seq % RUDP_WINDOW].sacked = true;
+        }
+    }
+
+    const u16 gap   = ack + 1;
+    rudp_slot* slot = &priv->tx[gap % RUDP_WINDOW];
+    const i64 now_us = time_now_us();
+    if(ack == priv->tx_acked && (i16)(priv->tx_seq - gap) >= 0 && now_us >= slot->sent_us + priv->ack_delay_us){
+        return resend_slot(priv, slot, now_us);
+    }
+
+    return Q2PC_ENONE;
+}
+
+
+//Returns true if the message is for the reader now. Anything else has been dealt with, or kept for later.
+static bool take_msg(q2pc_rudp_conn_priv* priv, const char* data, i64 len)
+{
+    const q2pc_msg* msg = (const q2pc_msg*)data;
+    if(msg->ver_flags & Q2PC_FLAG_ACK){
+        return false;
+    }
+
+    const u16 seq  = q2pc_msg_seq(msg);
+    const i16 ahead = (i16)(seq - priv->rx_next);
+    if(ahead < 0 || (ahead < RUDP_WINDOW && (priv->rx_have >> ahead & 1))){
+        //Seen it already, so the other end missed our ack. Don't make it wait for another.
+        ch_log_debug1("Dropping duplicate message with seq_no=%u\n", seq);
+        send_ack(priv);
+        return false;
+    }
+
+    if(ahead >= RUDP_WINDOW){
+        ch_log_debug1("Dropping message with seq_no=%u, past the window at %u\n", seq, priv->rx_next);
+        return false;
+    }
+
+    if(!priv->ack_due_us){
+        priv->ack_due_us = time_now_us() + priv->ack_delay_us;
+    }
+
+    if(ahead == 0){
+        ch_log_debug3("Seq no is now %u --> %u\n", priv->rx_next, (u16)(seq + 1));
+        priv->rx_next++;
+        priv->rx_have >>= 1;
+        return true;
+    }
+
+    //Something in front of it went missing. Keep it until that turns up, and say so straight away.
+    ch_log_debug1("Keeping message with seq_no=%u until %u comes in\n", seq, priv->rx_next);
+    slot_copy(&priv->rx[seq % RUDP_WINDOW], data, len);
+    priv->rx_have |= 1U << ahead;
+    send_ack(priv);
+    return false;
+}
+
 
 static int conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
 {
     q2pc_rudp_conn_priv* priv = (q2pc_rudp_conn_priv*)this->priv;
-    //pthread_mutex_lock(&priv->mutex);
 
     //There is already data waiting, so exit early
     if(priv->read_data && priv->read_data_len){
-        (*data_o) = priv->read_data + sizeof(priv->seq_no);
-        (*len_o)  = priv->read_data_len - sizeof(priv->seq_no);
-        //pthread_mutex_unlock(&priv->mutex);
+        (*data_o) = priv->read_data;
+        (*len_o)  = priv->read_data_len;
         return Q2PC_ENONE;
     }
 
-    int result = priv->base.beg_read(&priv->base,data_o, len_o);
-    if(result){
+    //The next one came early
+    if(priv->rx_have & 1){
+        rudp_slot* slot     = &priv->rx[priv->rx_next % RUDP_WINDOW];
+        priv->read_data     = (*data_o) = slot->msg;
+        priv->read_data_len = (*len_o)  = slot->len;
+        priv->rx_from_slot  = true;
+        priv->rx_next++;
+        priv->rx_have     >>= 1;
+        return Q2PC_ENONE;
+    }
 
-        if(result == Q2PC_EFIN){
-            ch_log_debug3("RUDP beg read EFIN\n");
-        }
+    //Acks and duplicates are dealt with here, keep going until there's something for the caller or nothing left. Edge
+    //triggered readers won't come back for whatever is behind them otherwise.
+    for(;;){
+        int result = udp_conn_beg_read(&priv->base,data_o, len_o);
+        if(result){
 
-        if(result != Q2PC_EAGAIN && result != Q2PC_EFIN){
-            ch_log_warn("Base stream returned error %li\n", result);
-        }
+            if(result == Q2PC_EFIN){
+                ch_log_debug3("RUDP beg read EFIN\n");
+            }
 
-        //ch_log_warn("No data exit\n");
-        priv->base.end_read(&priv->base);
-        //pthread_mutex_unlock(&priv->mutex);
-        return result;
-    }
+            if(result != Q2PC_EAGAIN && result != Q2PC_EFIN){
+                ch_log_warn("Base stream returned error %li\n", result);
+            }
 
+            udp_conn_end_read(&priv->base);
 
-    i64 seq_no = *(i64*)(*data_o);
-    if(priv->is_server){
-        ch_log_debug3("Server got message with seq_no=%li\n", seq_no);
-        if(seq_no != priv->seq_no){
-            ch_log_debug1("Server dropping message with seq_no %li != %li\n", seq_no, priv->seq_no);
-            priv->base.end_read(&priv->base);
-            //pthread_mutex_unlock(&priv->mutex);
-            return Q2PC_EAGAIN;
+            //Nothing waiting, so catch up on the timers
+            if(result == Q2PC_EAGAIN){
+                const int timer_result = service(priv);
+                if(timer_result){
+                    return timer_result;
+                }
+            }
+
+            return result;
         }
 
-        ch_log_debug3("Seq no is now %li --> %li\n", priv->seq_no, priv->seq_no + 1);
-        priv->seq_no++;
-        BARRIER(); //Make this thread safe so that every one sees this update
-    }
-    else{
-        ch_log_debug3("Client got message with seq_no=%li\n", seq_no);
+        if(*len_o < (i64)sizeof(q2pc_msg)){
+            ch_log_debug1("Dropping runt message of %liB\n", *len_o);
+            udp_conn_end_read(&priv->base);
+            continue;
+        }
 
-        if(seq_no <= priv->seq_no){
-            ch_log_debug1("Client dropping message with seq_no=%li <= %li\n", seq_no, priv->seq_no);
-            priv->base.end_read(&priv->base);
-            //pthread_mutex_unlock(&priv->mutex);
-            return Q2PC_EAGAIN;
+        result = take_ack(priv, *data_o, *len_o);
+        if(result){
+            udp_conn_end_read(&priv->base);
+            return result;
         }
 
-        ch_log_debug3("Seq no is now %li --> %li\n", priv->seq_no, seq_no);
-        priv->seq_no = seq_no;
-        BARRIER(); //Make this thread safe so that every one sees this update
+        if(!take_msg(priv, *data_o, *len_o)){
+            udp_conn_end_read(&priv->base);
+            continue;
+        }
 
+        break;
     }
 
     priv->read_data     = (*data_o) ;
     priv->read_data_len = (*len_o)  ;
+    priv->rx_from_slot  = false;
 
-    (*data_o) = priv->read_data + sizeof(priv->seq_no);
-    (*len_o)  = priv->read_data_len - sizeof(priv->seq_no);
-
-    //pthread_mutex_unlock(&priv->mutex);
     return Q2PC_ENONE;
-
-
 }
 
 static int conn_end_read(struct q2pc_trans_conn_s* this)
 {
     q2pc_rudp_conn_priv* priv = (q2pc_rudp_conn_priv*)this->priv;
-    int result = priv->base.end_read(&priv->base);
+    int result = priv->rx_from_slot ? Q2PC_ENONE : udp_conn_end_read(&priv->base);
 
     priv->read_data     = NULL;
     priv->read_data_len = 0;
+    priv->rx_from_slot  = false;
 
     return result;
 }
@@ -148,26 +378,12 @@ static int conn_end_read(struct q2pc_trans_conn_s* this)
 static int conn_beg_write(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
 {
     q2pc_rudp_conn_priv* priv = (q2pc_rudp_conn_priv*)this->priv;
-    int result = priv->base.beg_write(&priv->base, data_o, len_o);
+    int result = udp_conn_beg_write(&priv->base, data_o, len_o);
     if(result){
         ch_log_warn("Base stream returned error %li\n", result);
         return result;
     }
 
-
-    i64* seq_no = (i64*)(*data_o);
-    *seq_no = priv->seq_no;
-
-    if(priv->is_server){
-        ch_log_debug3("Server made message with seq_no=%li\n", *seq_no);
-    }
-    else{
-        ch_log_debug3("Client made message with seq_no=%li\n", *seq_no);
-    }
-
-
-    (*data_o) += sizeof(priv->seq_no);
-    (*len_o)  -= sizeof(priv->seq_no);
     priv->write_data = (*data_o);
 
 
@@ -175,80 +391,108 @@ static int conn_beg_write(struct q2pc_trans_conn_s* this, char** data_o, i64* le
 }
 
 
-static int conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
+//Sends straight away if there is room in the window. The payload is sent again from where it is if the message has to
+//be retransmitted, so it has to stay put until the message is acknowledged.
+static int conn_end_writev(struct q2pc_trans_conn_s* this, i64 len, const struct iovec* payload, int payload_count)
 {
     q2pc_rudp_conn_priv* priv = (q2pc_rudp_conn_priv*)this->priv;
 
-    if(!priv->ack_outstanding){
-        ch_log_debug3("Committing write to base stream\n");
-        int result = priv->base.end_write(&priv->base, len + sizeof(priv->seq_no));
+    if(payload_count >= UDP_FRAG_IOV_MAX){
+        ch_log_fatal("Payload is in %i pieces, RUDP can only send %i\n", payload_count, UDP_FRAG_IOV_MAX - 1);
+    }
 
-        if(result){
-            ch_log_warn("Base stream returned error %li\n", result);
-            return result;
+    //No room, see if any acks have come in. Anything that comes with them stays put for whoever reads next, this
+    //connection is only used by one thread at a time, so that doesn't race with the reader.
+    if((u16)(priv->tx_seq - priv->tx_acked) >= RUDP_WINDOW){
+        const i64 rtos_fired = priv->rtos_fired;
+        if(!priv->read_data_len){
+            char* rd_data;
+            i64 rd_len;
+            int result = conn_beg_read(this,&rd_data,&rd_len);
+            if(result == Q2PC_EFIN){
+                return result;
+            }
+        }
+        else{
+            int result = service(priv);
+            if(result){
+                return result;
+            }
         }
 
-        gettimeofday(&priv->ts_start, NULL);
-        priv->ts_start_us = priv->ts_start.tv_sec * 1000 * 1000 + priv->ts_start.tv_usec;
-        ch_log_debug3("Time now = %li\n", priv->ts_start_us);
-        priv->current_seq = priv->seq_no;
+        if((u16)(priv->tx_seq - priv->tx_acked) >= RUDP_WINDOW){
+            return priv->rtos_fired != rtos_fired ? Q2PC_RTOFIRED : Q2PC_EAGAIN;
+        }
+    }
 
-        priv->ack_outstanding = true;
+    //The sequence number goes in last, the caller has filled in the rest of the header by now
+    priv->tx_seq++;
+    q2pc_msg_set_seq((q2pc_msg*)priv->write_data, priv->tx_seq);
+    ch_log_debug3("Made message with seq_no=%u\n", priv->tx_seq);
 
-    }
+    rudp_slot* slot = &priv->tx[priv->tx_seq % RUDP_WINDOW];
+    slot->seq           = priv->tx_seq;
+    slot->sacked        = false;
+    slot->payload_count = payload_count;
+    memcpy(slot->payload, payload, sizeof(struct iovec) * payload_count);
+    slot_copy(slot, priv->write_data, len);
 
-    //Try to stimulate a a seq_no change
-    if(priv->is_server) {
-        char* rd_data;
-        i64 rd_len;
-        int result = conn_beg_read(this,&rd_data,&rd_len);
-        if(result == Q2PC_EFIN){
-            return result;
-        }
+    ch_log_debug3("Committing write to base stream\n");
+    int result = send_slot(priv, slot, time_now_us());
+    if(result){
+        ch_log_warn("Base stream returned error %li\n", result);
+        return result;
     }
 
-    if(priv->current_seq != priv->seq_no){
-        ch_log_debug3("Got ack for seq=%li\n", priv->current_seq);
-        priv->ack_outstanding = false;
-        return Q2PC_ENONE; //Winner!
-    }
+    return Q2PC_ENONE;
+}
 
-    gettimeofday(&priv->ts_now, NULL);
-    priv->ts_now_us = priv->ts_now.tv_sec * 1000 * 1000 + priv->ts_now.tv_usec;
-    if(priv->ts_now_us < priv->ts_start_us + priv->rto_timeout_us){
-        return Q2PC_EAGAIN;
-    }
 
-    ch_log_debug3("Time now %li > %li (diff=%li > %li)\n", priv->ts_now_us, priv->ts_start_us, priv->ts_now_us - priv->ts_start_us, priv->rto_timeout_us);
+static int conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
+{
+    return conn_end_writev(this, len, NULL, 0);
+}
 
-    //ch_log_warn("Retransmit timeout fired on seq_no=%lu\n", priv->seq_no);
 
-    //XXX HACK!
-    if(priv->is_server){
-        ((q2pc_msg*)priv->write_data)->c_rto++;
-        ch_log_debug3("Set c_rto to %i\n", ((q2pc_msg*)priv->write_data)->c_rto) ;
+//Retransmits and acks that are due go out, nothing is read. Q2PC_EAGAIN while anything is still waiting on an ack, and
+//Q2PC_RTOFIRED if anything has had to be retransmitted since the last flush.
+static int conn_flush(struct q2pc_trans_conn_s* this)
+{
+    q2pc_rudp_conn_priv* priv = (q2pc_rudp_conn_priv*)this->priv;
+
+    const int result = service(priv);
+    if(result){
+        return result;
     }
-    else{
-        ((q2pc_msg*)priv->write_data)->s_rto++;
-        ch_log_debug3("Set s_rto to %i\n", ((q2pc_msg*)priv->write_data)->s_rto) ;
+
+    if(priv->rtos_fired){
+        priv->rtos_fired = 0;
+        return Q2PC_RTOFIRED;
     }
 
-    int result = priv->base.end_write(&priv->base, len + sizeof(priv->seq_no));
-    if(result){
+    return priv->tx_seq == priv->tx_acked ? Q2PC_ENONE : Q2PC_EAGAIN;
+}
 
-        if(result == Q2PC_EFIN){
-            ch_log_debug3("RUDP end write EFIN\n");
-            return Q2PC_EFIN;
-        }
 
-        ch_log_warn("Base stream returned error %i\n", result);
-    }
+//Everything arrives through the base connection
+static int conn_get_fd(struct q2pc_trans_conn_s* this)
+{
+    q2pc_rudp_conn_priv* priv = (q2pc_rudp_conn_priv*)this->priv;
+    return trans_conn_fd(&priv->base);
+}
+
+
+static i64 conn_get_drops(struct q2pc_trans_conn_s* this)
+{
+    q2pc_rudp_conn_priv* priv = (q2pc_rudp_conn_priv*)this->priv;
+    return trans_conn_drops(&priv->base);
+}
 
-    gettimeofday(&priv->ts_start, NULL);
-    priv->ts_start_us = priv->ts_start.tv_sec * 1000 * 1000 + priv->ts_start.tv_usec;
-    ch_log_debug3("Time now = %li\n", priv->ts_start_us);
 
-    return Q2PC_RTOFIRED;
+static i64 conn_get_rx_ts(struct q2pc_trans_conn_s* this)
+{
+    q2pc_rudp_conn_priv* priv = (q2pc_rudp_conn_priv*)this->priv;
+    return trans_conn_rx_ts(&priv->base);
 }
 
 
@@ -258,6 +502,10 @@ static void conn_delete(struct q2pc_trans_conn_s* this)
         if(this->priv){
             q2pc_rudp_conn_priv* priv = (q2pc_rudp_conn_priv*)this->priv;
             priv->base.delete(&priv->base);
+            for(int i = 0; i < RUDP_WINDOW; i++){
+                free(priv->tx[i].msg);
+                free(priv->rx[i].msg);
+            }
             free(this->priv);
         }
 
@@ -278,7 +526,6 @@ typedef struct {
 
 
 
-#define BUFF_SIZE (4096 * 1024) //A 4MB buffer. Just because it feels right
 static q2pc_rudp_conn_priv* init_new_conn(q2pc_trans_conn* conn)
 {
     q2pc_rudp_conn_priv* new_priv = calloc(1,sizeof(q2pc_rudp_conn_priv));
@@ -291,6 +538,11 @@ static q2pc_rudp_conn_priv* init_new_conn(q2pc_trans_conn* conn)
     conn->end_read  = conn_end_read;
     conn->beg_write = conn_beg_write;
     conn->end_write = conn_end_write;
+    conn->end_writev = conn_end_writev;
+    conn->flush     = conn_flush;
+    conn->get_drops = conn_get_drops;
+    conn->get_rx_ts = conn_get_rx_ts;
+    conn->get_fd    = conn_get_fd;
     conn->delete    = conn_delete;
 
     return new_priv;
@@ -307,11 +559,11 @@ static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
     if(!conn_priv){
         conn_priv                   = init_new_conn(conn);
         conn_priv->is_server        = !trans_priv->transport.server;
-        conn_priv->seq_no           = conn_priv->is_server ? 0 : -1; //Set to -1 for clients
+        conn_priv->rx_next          = 1;
+        conn_priv->ack_delay_us     = trans_priv->transport.rto_us / RUDP_ACK_DELAY_DIV;
         conn_priv->read_data        = NULL;
         conn_priv->read_data_len    = 0;
         conn_priv->rto_timeout_us   = trans_priv->transport.rto_us;
-        conn_priv->ack_outstanding  = false;
 
         conn->priv           = conn_priv;
 
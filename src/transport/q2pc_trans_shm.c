@@ -0,0 +1,330 @@
+/*
+ * q2pc_trans_shm.c
+ */
+
+ //#LINKFLAGS=-lrt
+
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#include "q2pc_trans_shm.h"
+#include "spsc_ring.h"
+#include "conn_vector.h"
+#include "../errors/errors.h"
+
+//The shared memory file holds a header followed by a pair of rings for each client. Client n uses pair n - 1.
+#define SHM_MAGIC 0x51325043534D4D31ULL //"Q2PCSMM1"
+#define SHM_RING_SLOTS 64
+
+typedef struct {
+    volatile u64 magic; //Written last by the server, clients wait for it
+    volatile u32 closed;
+    i64 client_count;
+    i64 ring_bytes;
+} __attribute__((aligned(SPSC_RING_CACHELINE))) q2pc_shm_hdr;
+
+
+typedef struct {
+    spsc_ring* rx;
+    spsc_ring* tx;
+    volatile u32* closed;
+    bool doorbell;
+    i64 rto_us;
+} q2pc_shm_conn_priv;
+
+
+typedef struct {
+    transport_s transport;
+
+    char name[64];
+    char* mem;
+    i64 mem_size;
+    i64 connections;
+
+} q2pc_shm_priv;
+
+
+static inline q2pc_shm_hdr* get_hdr(q2pc_shm_priv* priv)
+{
+    return (q2pc_shm_hdr*)priv->mem;
+}
+
+static inline spsc_ring* get_ring(q2pc_shm_priv* priv, i64 idx)
+{
+    return (spsc_ring*)(priv->mem + sizeof(q2pc_shm_hdr) + idx * get_hdr(priv)->ring_bytes);
+}
+
+
+static int conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_shm_conn_priv* priv = (q2pc_shm_conn_priv*)this->priv;
+
+    if(spsc_ring_beg_read(priv->rx, data_o, len_o)){
+        ch_log_debug3("Got %li bytes\n", *len_o);
+        return Q2PC_ENONE;
+    }
+
+    if(*priv->closed){
+        ch_log_warn("SHM beg read EFIN, peer has closed\n");
+        return Q2PC_EFIN;
+    }
+
+    //Only clients sleep, the server workers poll
+    if(priv->doorbell && spsc_ring_wait(priv->rx, priv->rto_us, true)){
+        spsc_ring_beg_read(priv->rx, data_o, len_o);
+        return Q2PC_ENONE;
+    }
+
+    return Q2PC_EAGAIN;
+}
+
+
+static int conn_end_read(struct q2pc_trans_conn_s* this)
+{
+    q2pc_shm_conn_priv* priv = (q2pc_shm_conn_priv*)this->priv;
+    spsc_ring_end_read(priv->rx);
+    return Q2PC_ENONE;
+}
+
+
+static int conn_beg_write(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_shm_conn_priv* priv = (q2pc_shm_conn_priv*)this->priv;
+
+    if(*priv->closed){
+        return Q2PC_EFIN;
+    }
+
+    if(!spsc_ring_beg_write(priv->tx, data_o, len_o)){
+        return Q2PC_EAGAIN;
+    }
+
+    return Q2PC_ENONE;
+}
+
+
+static int conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
+{
+    q2pc_shm_conn_priv* priv = (q2pc_shm_conn_priv*)this->priv;
+
+    if(len > priv->tx->slot_size){
+        ch_log_fatal("Error: Wrote more data than the buffer could handle. Memory corruption is likely\n ");
+    }
+
+    spsc_ring_end_write(priv->tx, len);
+    if(priv->doorbell){
+        spsc_ring_ring(priv->tx, true);
+    }
+
+    return Q2PC_ENONE;
+}
+
+
+static void conn_delete(struct q2pc_trans_conn_s* this)
+{
+    if(this){
+        if(this->priv){
+            free(this->priv);
+        }
+
+        //XXX HACK!
+        //free(this);
+    }
+}
+
+
+
+/***************************************************************************************************************************/
+
+static q2pc_shm_conn_priv* init_new_conn(q2pc_trans_conn* conn)
+{
+    q2pc_shm_conn_priv* new_priv = calloc(1,sizeof(q2pc_shm_conn_priv));
+    if(!new_priv){
+        ch_log_fatal("Malloc failed!\n");
+    }
+
+    conn->priv      = new_priv;
+    conn->beg_read  = conn_beg_read;
+    conn->end_read  = conn_end_read;
+    conn->beg_write = conn_beg_write;
+    conn->end_write = conn_end_write;
+    conn->delete    = conn_delete;
+
+    return new_priv;
+}
+
+
+//Clients attach to the file the server made. Until it exists, and is ready, the connection is not yet established.
+static int attach(q2pc_shm_priv* priv)
+{
+    int fd = shm_open(priv->name, O_RDWR, 0);
+    if(fd < 0){
+        ch_log_debug3("SHM %s not there yet (%s)\n", priv->name, strerror(errno));
+        return Q2PC_EAGAIN;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) || st.st_size < (i64)sizeof(q2pc_shm_hdr)){
+        close(fd);
+        return Q2PC_EAGAIN;
+    }
+
+    char* mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mem == MAP_FAILED){
+        ch_log_fatal("Could not map shared memory %s: %s\n", priv->name, strerror(errno));
+    }
+
+    q2pc_shm_hdr* hdr = (q2pc_shm_hdr*)mem;
+    if(hdr->magic != SHM_MAGIC){
+        munmap(mem, st.st_size);
+        return Q2PC_EAGAIN;
+    }
+    __sync_synchronize();
+
+    priv->mem      = mem;
+    priv->mem_size = st.st_size;
+    return Q2PC_ENONE;
+}
+
+
+static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
+{
+    q2pc_shm_priv* trans_priv = (q2pc_shm_priv*)this->priv;
+
+    if(conn->priv){
+        return Q2PC_ENONE;
+    }
+
+    i64 pair = 0;
+    if(trans_priv->transport.server){
+        pair = trans_priv->connections++;
+    }
+    else{
+        if(!trans_priv->mem){
+            int result = attach(trans_priv);
+            if(result){
+                return result;
+            }
+        }
+
+        pair = trans_priv->transport.client_id - 1;
+        if(pair < 0 || pair >= get_hdr(trans_priv)->client_count){
+            ch_log_fatal("Client ID (%li) is out of the range the server expects [1,%li]\n",
+                    trans_priv->transport.client_id, get_hdr(trans_priv)->client_count);
+        }
+    }
+
+    q2pc_shm_conn_priv* new_priv = init_new_conn(conn);
+    spsc_ring* to_server = get_ring(trans_priv, pair * 2 + 0);
+    spsc_ring* to_client = get_ring(trans_priv, pair * 2 + 1);
+    new_priv->rx       = trans_priv->transport.server ? to_server : to_client;
+    new_priv->tx       = trans_priv->transport.server ? to_client : to_server;
+    new_priv->closed   = &get_hdr(trans_priv)->closed;
+    new_priv->doorbell = trans_priv->transport.shm_doorbell;
+    new_priv->rto_us   = trans_priv->transport.rto_us;
+
+    return Q2PC_ENONE;
+}
+
+
+static void serv_delete(struct q2pc_trans_s* this)
+{
+    if(this){
+
+        if(this->priv){
+            q2pc_shm_priv* priv = (q2pc_shm_priv*)this->priv;
+            if(priv->mem){
+                if(priv->transport.server){
+                    get_hdr(priv)->closed = 1;
+                    for(i64 i = 0; i < get_hdr(priv)->client_count; i++){
+                        spsc_ring_ring(get_ring(priv, i * 2 + 1), true); //Wake anyone sleeping so they see we've gone
+                    }
+                    shm_unlink(priv->name);
+                }
+                munmap(priv->mem, priv->mem_size);
+            }
+            free(this->priv);
+        }
+
+        free(this);
+    }
+
+}
+
+
+static void init(q2pc_shm_priv* priv)
+{
+
+    ch_log_debug1("Constructing SHM transport\n");
+
+    snprintf(priv->name, sizeof(priv->name), "/q2pc-%u", priv->transport.port);
+
+    if(!priv->transport.server){
+        ch_log_debug1("Done constructing SHM transport\n");
+        return;
+    }
+
+    //Slots are sized to the messages we'll send, payload included, the ring header and slots are cache line aligned
+    const i64 slot_size  = MAX(priv->transport.msize + priv->transport.payload_size, SPSC_RING_CACHELINE);
+    const i64 ring_bytes = spsc_ring_bytes(SHM_RING_SLOTS, slot_size);
+    priv->mem_size       = sizeof(q2pc_shm_hdr) + priv->transport.client_count * 2 * ring_bytes;
+
+    //Start fresh, anyone still attached to an old file is left behind on it
+    shm_unlink(priv->name);
+    int fd = shm_open(priv->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(fd < 0){
+        ch_log_fatal("Could not create shared memory %s: %s\n", priv->name, strerror(errno));
+    }
+
+    if(ftruncate(fd, priv->mem_size)){
+        ch_log_fatal("Could not size shared memory %s to %liB: %s\n", priv->name, priv->mem_size, strerror(errno));
+    }
+
+    priv->mem = mmap(NULL, priv->mem_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(priv->mem == MAP_FAILED){
+        ch_log_fatal("Could not map shared memory %s: %s\n", priv->name, strerror(errno));
+    }
+
+    q2pc_shm_hdr* hdr = get_hdr(priv);
+    hdr->client_count = priv->transport.client_count;
+    hdr->ring_bytes   = ring_bytes;
+    for(i64 i = 0; i < priv->transport.client_count * 2; i++){
+        spsc_ring_init(get_ring(priv, i), SHM_RING_SLOTS, slot_size);
+    }
+
+    __sync_synchronize();
+    hdr->magic = SHM_MAGIC;
+
+    ch_log_debug1("Done constructing SHM transport\n");
+
+}
+
+
+q2pc_trans* q2pc_shm_construct(const transport_s* transport)
+{
+    q2pc_trans* result = (q2pc_trans*)calloc(1,sizeof(q2pc_trans));
+    if(!result){
+        ch_log_fatal("Could not allocate SHM server structure\n");
+    }
+
+    q2pc_shm_priv* priv = (q2pc_shm_priv*)calloc(1,sizeof(q2pc_shm_priv));
+    if(!priv){
+        ch_log_fatal("Could not allocate SHM server private structure\n");
+    }
+
+    result->priv          = priv;
+    result->connect       = doconnect;
+    result->delete        = serv_delete;
+    memcpy(&priv->transport,transport, sizeof(transport_s));
+    init(priv);
+
+
+    return result;
+}
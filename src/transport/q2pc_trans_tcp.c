@@ -12,52 +12,67 @@
 #include <errno.h>
 #include <fcntl.h>
 
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include <poll.h>
+
 #include "q2pc_trans_tcp.h"
+#include "mirror_buff.h"
+#include "buf_pool.h"
 #include "conn_vector.h"
 #include "../errors/errors.h"
 #include "../protocol/q2pc_protocol.h"
 
+#define TCP_BATCH_MAX 64                //Messages queued before we flush anyway
+#define TCP_BATCH_BYTES (64 * 1024)     //Bytes queued before we flush anyway
+#define TCP_ZEROCOPY_MIN (10 * 1024)    //Smaller sends are cheaper to copy than to pin
+#define TCP_READ_MSGS 32                //Messages the read ring can hold
+#define TCP_MSG_MIN 64                  //Plan for messages at least this big, whatever the message size says
+
 typedef struct {
     int fd;
 
-    //For the reader
-    void* read_buffer;
-    i64   read_buffer_used;
-    i64   read_buffer_size;
+    //For the reader, data is read straight into the ring and messages are handed out in place
+    mirror_buff read_ring;
+    i64 msg_size;   //Exactly what's on the wire, messages are delimited with it
+    i64 delim_result_len;
 
-    //For the writer
+    //For the writer, messages are queued and go out together on flush
+    buf_pool* pool;
+    i64   msize;
     void* write_buffer;
     i64   write_buffer_used;
     i64   write_buffer_size;
+    struct iovec write_iov[TCP_BATCH_MAX];
+    i64   write_iov_count;
+    i64   write_bytes; //Queued, payloads included
 
-    //For the delimiter
-    void* delim_buffer;
-    i64   delim_buffer_used;
-    i64   delim_buffer_size;
-    void* delim_result;
-    i64   delim_result_len;
-
+    //Zero copy sends can't reuse the write buffer until the kernel says it's done with it
+    bool zero_copy;
+    u64  zc_sent;
+    u64  zc_done;
 
 } q2pc_tcp_conn_priv;
 
 
-i64 delimit(char* buff, i64 len);
-
 
-static int conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+//Fill the ring with as much as the socket will give us
+static int conn_read(q2pc_tcp_conn_priv* priv)
 {
-    q2pc_tcp_conn_priv* priv = (q2pc_tcp_conn_priv*)this->priv;
-    if( priv->read_buffer && priv->read_buffer_used){
-        return Q2PC_ENONE;
+    const i64 space = mirror_buff_space(&priv->read_ring);
+    if(!space){
+        ch_log_fatal("TCP read ring is full (%liB) but no message was found in it\n", priv->read_ring.size);
     }
 
-    int result = read(priv->fd, priv->read_buffer, priv->read_buffer_size);
+    int result = read(priv->fd, mirror_buff_wr(&priv->read_ring), space);
     if(result < 0){
         if(errno == EAGAIN || errno == EWOULDBLOCK){
             return Q2PC_EAGAIN; //Reading would have blocked, we don't want this
         }
 
-        if(errno == ECONNREFUSED){
+        //A peer that closes with replies still unread resets the connection, it's gone all the same
+        if(errno == ECONNREFUSED || errno == ECONNRESET){
             return Q2PC_EFIN;
         }
 
@@ -68,206 +83,247 @@ static int conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len
         return Q2PC_EFIN;
     }
 
-    priv->read_buffer_used = result;
-
-    *data_o = priv->read_buffer;
-    *len_o  = priv->read_buffer_used;
-
+    ch_log_debug2("Read another %i bytes\n", result);
+    mirror_buff_produce(&priv->read_ring, result);
     return Q2PC_ENONE;
 }
 
-static int conn_end_read(struct q2pc_trans_conn_s* this)
+
+//Is there a whole message at the front of the ring? Thanks to the mirror mapping it's contiguous, even if it wraps.
+static bool conn_find(q2pc_tcp_conn_priv* priv)
 {
-    q2pc_tcp_conn_priv* priv = (q2pc_tcp_conn_priv*)this->priv;
-    priv->read_buffer_used = 0;
-    return Q2PC_ENONE;
+    const i64 used = mirror_buff_used(&priv->read_ring);
+    if(!used){
+        return false;
+    }
+
+    const i64 delimit_size = q2pc_msg_delimit(mirror_buff_rd(&priv->read_ring), used, priv->msg_size);
+    if(delimit_size > 0 && delimit_size <= used){
+        priv->delim_result_len = delimit_size;
+        ch_log_debug2("Found message size=%lu\n", delimit_size);
+        return true;
+    }
+
+    return false;
 }
 
+
 static int conn_beg_delimit(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
 {
     q2pc_tcp_conn_priv* priv = (q2pc_tcp_conn_priv*)this->priv;
 
-    if(priv->delim_result && priv->delim_result_len){
-        *data_o  = priv->delim_result;
-        *len_o   = priv->delim_result_len;
+    if(!priv->delim_result_len && !conn_find(priv)){
+        int result = conn_read(priv);
+        if(result != Q2PC_ENONE){
+            return result;
+        }
 
-        return Q2PC_ENONE;
+        if(!conn_find(priv)){
+            //This is naughty, it says there isn't any data here, try again later, which is kind of true.
+            return Q2PC_EAGAIN;
+        }
     }
 
-    if(priv->delim_buffer_used){
-        int64_t delimit_size = delimit(priv->delim_buffer, priv->delim_buffer_used);
-        if(delimit_size > 0 && delimit_size <= priv->delim_buffer_used){
+    *data_o = mirror_buff_rd(&priv->read_ring);
+    *len_o  = priv->delim_result_len;
+    return Q2PC_ENONE;
+}
 
-            priv->delim_result     = priv->delim_buffer;
-            priv->delim_result_len = delimit_size;
-            *data_o                = priv->delim_result;
-            *len_o                 = priv->delim_result_len;
 
+static int conn_end_delimit(struct q2pc_trans_conn_s* this)
+{
+    q2pc_tcp_conn_priv* priv = (q2pc_tcp_conn_priv*)this->priv;
+    mirror_buff_consume(&priv->read_ring, priv->delim_result_len);
+    priv->delim_result_len = 0;
+    return 0;
+}
 
-            return Q2PC_ENONE; //Success!!
-        }
-    }
 
-    char* data;
-    i64 len;
-    int result = conn_beg_read(this, &data,&len);
-    if(result != Q2PC_ENONE){
-        return result;
-    }
 
+//Wait until the socket has space, or an error to tell us about
+static void conn_wait(q2pc_tcp_conn_priv* priv, short events)
+{
+    struct pollfd pfd = { .fd = priv->fd, .events = events };
+    if(poll(&pfd, 1, -1) < 0 && errno != EINTR){
+        ch_log_fatal("TCP poll failed on fd=%i - %s\n",priv->fd,strerror(errno));
+    }
+}
 
-    ch_log_debug2("Read another %lu bytes to %p\n", len, data);
 
-    while(len > priv->delim_buffer_size - priv->delim_buffer_used){
-        ch_log_debug2("Growing working buffer from %lu to %lu\n", priv->delim_buffer_size, priv->delim_buffer_size * 2 );
-        priv->delim_buffer_size *= 2;
-        priv->delim_buffer = realloc(priv->delim_buffer, priv->delim_buffer_size);
-    }
+//Collect zero copy completions. Each one covers a range of sends, numbered in the order we made them.
+static void conn_reap(q2pc_tcp_conn_priv* priv)
+{
+    while(priv->zc_done < priv->zc_sent){
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
 
-    ch_log_debug2("Adding %lu bytes at %p (offset=%lu)\n",
-            len,
-            (char*)priv->delim_buffer + priv->delim_buffer_used,
-            priv->delim_buffer_used
-    );
+        if(recvmsg(priv->fd, &msg, MSG_ERRQUEUE) < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                conn_wait(priv, 0); //Errors are always reported
+                continue;
+            }
 
-    memcpy((char*)priv->delim_buffer + priv->delim_buffer_used, data, len);
-    priv->delim_buffer_used += len;
-    conn_end_read(this);
+            ch_log_fatal("TCP zero copy completion failed on fd=%i - %s\n",priv->fd,strerror(errno));
+        }
 
-    int64_t delimit_size = delimit(priv->delim_buffer, priv->delim_buffer_used);
-    if(delimit_size > 0 && delimit_size <= priv->delim_buffer_used){
-        priv->delim_result     = priv->delim_buffer;
-        *data_o                = priv->delim_buffer;
-        priv->delim_result_len = delimit_size;
-        *len_o                 = delimit_size;
+        for(struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)){
+            const struct sock_extended_err* serr = (struct sock_extended_err*)CMSG_DATA(cm);
+            if(cm->cmsg_level != IPPROTO_IP || cm->cmsg_type != IP_RECVERR || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY){
+                continue;
+            }
 
-        ch_log_debug2("Found message size=%lu\n", *len_o);
-        return Q2PC_ENONE;
+            priv->zc_done = (u64)serr->ee_data + 1;
+            if(serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED){
+                ch_log_debug2("TCP zero copy sends [%u,%u] were copied anyway\n", serr->ee_info, serr->ee_data);
+            }
+        }
     }
-
-    //This is naughty, it says there isn't any data here, try again later, which is kind of true.
-    return Q2PC_EAGAIN;
 }
 
 
-//** Warning: This is a complicated function with a lot of edge cases. It's vital to performance and
-//            correctness to get this one right!
-//
-// We enter this function as a result of a successful call to begin delimit. Begin delimit may have succeeded
-// for one of two reasons, 1) either new data was read and the delimiter was successful, or, 2) we have
-// optimistically found another delimited result in a previous call to end delimit(). In the first case,
-// priv->delimit_buffer_used is at least equal to the size of priv->delim_result_len, in the second case,
-// priv->delimit_buffer size is smaller.
-static int conn_end_delimit(struct q2pc_trans_conn_s* this)
+static int conn_flush(struct q2pc_trans_conn_s* this)
 {
-    q2pc_tcp_conn_priv* priv = this->priv;
-    if(!priv->delim_result){
-        return 0;
-    }
+    q2pc_tcp_conn_priv* priv = (q2pc_tcp_conn_priv*)this->priv;
 
+    const bool zero_copy = priv->zero_copy && priv->write_bytes >= TCP_ZEROCOPY_MIN;
+    struct iovec* iov    = priv->write_iov;
+    i64 iov_count        = priv->write_iov_count;
 
-    char* result_head_next = (char*)priv->delim_result + priv->delim_result_len;
+    while(iov_count){
+        i64 written;
+        if(zero_copy){
+            struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iov_count };
+            written = sendmsg(priv->fd, &msg, MSG_ZEROCOPY);
+        }
+        else{
+            written = writev(priv->fd, iov, iov_count);
+        }
 
-    //Handle case 1)
-    //New data was read and the delimiter was successful
-    if(priv->delim_result_len <= priv->delim_buffer_used){
+        if(written < 0){
 
-        //This is how much is now left over
-        priv->delim_buffer_used -= priv->delim_result_len;
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                conn_wait(priv, POLLOUT);
+                continue;
+            }
 
-        //If there is nothing left over, give up and bug out
-        if(!priv->delim_buffer_used){
-            priv->delim_result_len= 0;
-            priv->delim_result= NULL;
-            return 0;
+            if(errno == ECONNREFUSED){
+                return Q2PC_EFIN;
+            }
+
+            ch_log_warn("TCP write failed: %s\n",strerror(errno));
+            return Q2PC_EFIN;
         }
 
-        //Something is left over we can optimistically check if there happens to be another packet ready to go.
-        //The reduces the number of memmoves and significantly improves performance especially with TCP where the
-        //read size can be *huge*. (>4MB with TSO turned on)
-        i64 delimit_size = delimit(result_head_next, priv->delim_buffer_used);
-        if(delimit_size && delimit_size <= priv->delim_buffer_used){
-            //Ready for the next round with data available! No memmove required!
-            priv->delim_result = result_head_next;
-            priv->delim_result_len = delimit_size;
-            return 0;
+        if(zero_copy){
+            priv->zc_sent++;
         }
 
-        //Nope, ok, bite the bullet and move stuff around. We'll need to call read() and get some more data
-        //printf("Doing mem move of %lu from %p to %p (total=%lu)\n", priv->delim_buffer_used, result_head_next, priv->delim_buffer, result_head_next - priv->delim_buffer);
-        memmove(priv->delim_buffer, result_head_next, priv->delim_buffer_used);
+        //Step over whatever made it out
+        while(iov_count && written >= (i64)iov->iov_len){
+            written -= iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+        if(iov_count){
+            iov->iov_base  = (char*)iov->iov_base + written;
+            iov->iov_len  -= written;
+        }
     }
 
-    //XXX: I can't see a reason why this case would ever trigger. I know it took me a long time to write this, so something must trigger it, but I don't know what it is.
-    //Handle case 2)
-    //There is some data leftover, but less than the last result buffer size.
-    else{
+    priv->write_iov_count   = 0;
+    priv->write_buffer_used = 0;
+    priv->write_bytes       = 0;
+    return Q2PC_ENONE;
+}
 
-        //Optimistically check if there is a new packet in this left over. Remember, packets are not all the same
-        //size, so a samll packet could follow a big packet.
-        i64 delimit_size = delimit(result_head_next, priv->delim_buffer_used);
-        if(delimit_size && delimit_size <= priv->delim_buffer_used){
-            //Ready for the next round with data available! Yay! No memmove required!
-            priv->delim_result = result_head_next;
-            priv->delim_result_len = delimit_size;
-            return 0;
-        }
 
-        //Nope, ok, bite the bullet and move stuff around. We'll need to call read() and get some more data
-        //printf("Doing mem move of %lu from %p to %p (total=%lu)\n", priv->delim_buffer_used, result_head_next, priv->delim_buffer, result_head_next - priv->delim_buffer);
-        memmove(priv->delim_buffer, result_head_next, priv->delim_buffer_used);
+static int conn_beg_write(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_tcp_conn_priv* priv = (q2pc_tcp_conn_priv*)this->priv;
 
+    //The kernel may still be sending straight out of the buffer we're about to hand back
+    if(!priv->write_buffer_used){
+        conn_reap(priv);
     }
 
-    //Ready for the next round, there is no new delimited packet available, so reset everything and get ready for a call to read()
-    priv->delim_result_len= 0;
-    priv->delim_result= NULL;
+    *data_o = (char*)priv->write_buffer + priv->write_buffer_used;
+    *len_o  = priv->write_buffer_size - priv->write_buffer_used;
     return 0;
-
 }
 
 
-
-static int conn_beg_write(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+static void conn_queue(q2pc_tcp_conn_priv* priv, char* data, i64 len)
 {
-    q2pc_tcp_conn_priv* priv = (q2pc_tcp_conn_priv*)this->priv;
-    *data_o = priv->write_buffer;
-    *len_o  = priv->write_buffer_size;
-    return 0;
+    if(!len){
+        return;
+    }
+
+    //Messages are queued back to back, so usually this just grows the last entry
+    struct iovec* last = priv->write_iov_count ? &priv->write_iov[priv->write_iov_count - 1] : NULL;
+    if(last && (char*)last->iov_base + last->iov_len == data){
+        last->iov_len += len;
+    }
+    else{
+        priv->write_iov[priv->write_iov_count].iov_base = data;
+        priv->write_iov[priv->write_iov_count].iov_len  = len;
+        priv->write_iov_count++;
+    }
+    priv->write_bytes += len;
 }
 
 
-static int conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
+//Payloads are queued by reference, so one payload can go to every connection without being copied
+static int conn_end_writev(struct q2pc_trans_conn_s* this, i64 len, const struct iovec* payload, int payload_count)
 {
     q2pc_tcp_conn_priv* priv = (q2pc_tcp_conn_priv*)this->priv;
-    char* data = priv->write_buffer;
+    char* data = (char*)priv->write_buffer + priv->write_buffer_used;
 
-    if(len > priv->write_buffer_size){
+    if(len > priv->write_buffer_size - priv->write_buffer_used){
         ch_log_fatal("Error: Wrote more data than the buffer could handle. Memory corruption is likely\n ");
     }
 
-    while(len > 0){
-        i64 written =  write(priv->fd, data ,len);
-        if(written < 0){
+    //Not enough room in the batch for the whole message. Send what's queued and move this one to the front.
+    if(priv->write_iov_count + 1 + payload_count > TCP_BATCH_MAX){
+        if(1 + payload_count > TCP_BATCH_MAX){
+            ch_log_fatal("Payload is in %i pieces, TCP can only send %i\n", payload_count, TCP_BATCH_MAX - 1);
+        }
 
-            if(errno == EAGAIN || errno == EWOULDBLOCK){
-                continue; //Keep trying until we succeed
-            }
+        int result = conn_flush(this);
+        if(result){
+            return result;
+        }
 
-            if(errno == ECONNREFUSED){
-                return Q2PC_EFIN;
-            }
+        conn_reap(priv);
+        memmove(priv->write_buffer, data, len);
+        data = priv->write_buffer;
+    }
 
-            ch_log_warn("TCP write failed: %s\n",strerror(errno));
-            return Q2PC_EFIN;
-        }
+    conn_queue(priv, data, len);
+    priv->write_buffer_used += len;
+    for(int i = 0; i < payload_count; i++){
+        conn_queue(priv, payload[i].iov_base, payload[i].iov_len);
+    }
 
-        data += written;
-        len -= written;
+    //Batch is full, send it now
+    if(priv->write_iov_count >= TCP_BATCH_MAX || priv->write_buffer_size - priv->write_buffer_used < priv->msize ||
+       priv->write_bytes >= TCP_BATCH_BYTES){
+        return conn_flush(this);
     }
 
     return Q2PC_ENONE;
+}
 
+
+static int conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
+{
+    return conn_end_writev(this, len, NULL, 0);
+}
+
+
+static int conn_get_fd(struct q2pc_trans_conn_s* this)
+{
+    q2pc_tcp_conn_priv* priv = (q2pc_tcp_conn_priv*)this->priv;
+    return priv->fd;
 }
 
 
@@ -276,8 +332,8 @@ static void conn_delete(struct q2pc_trans_conn_s* this)
     if(this){
         if(this->priv){
             q2pc_tcp_conn_priv* priv = (q2pc_tcp_conn_priv*)this->priv;
-            if(priv->read_buffer){ free(priv->read_buffer); }
-            if(priv->delim_buffer){ free(priv->delim_buffer); }
+            mirror_buff_free(&priv->read_ring);
+            buf_pool_put(priv->pool, priv->write_buffer);
             close(priv->fd);
             free(this->priv);
         }
@@ -295,6 +351,7 @@ typedef struct {
     int fd;
 
     transport_s transport;
+    buf_pool* pool;
 
 } q2pc_tcp_priv;
 
@@ -302,32 +359,23 @@ typedef struct {
 
 
 
-static q2pc_tcp_conn_priv* new_conn_priv()
+//The write buffer holds one batch, the read ring a few messages. Both are sized from the message size.
+static q2pc_tcp_conn_priv* new_conn_priv(q2pc_tcp_priv* trans_priv)
 {
     q2pc_tcp_conn_priv* new_priv = calloc(1,sizeof(q2pc_tcp_conn_priv));
     if(!new_priv){
         ch_log_fatal("Malloc failed!\n");
     }
 
-    #define BUFF_SIZE (4096 * 1024) //A 4MB buffer. Just because
-    void* read_buff = calloc(2,BUFF_SIZE);
-    if(!read_buff){
-        ch_log_fatal("Malloc failed!\n");
-    }
-    new_priv->read_buffer = read_buff;
-    new_priv->read_buffer_size = BUFF_SIZE;
+    new_priv->msg_size = trans_priv->transport.msize;
 
-    void* write_buff = (char*)read_buff + BUFF_SIZE;
-    new_priv->write_buffer = write_buff;
-    new_priv->write_buffer_size = BUFF_SIZE;
+    //The ring has to hold at least one whole message, payload and all
+    new_priv->msize = MAX(trans_priv->transport.msize, TCP_MSG_MIN);
+    mirror_buff_init(&new_priv->read_ring, MAX(new_priv->msize * TCP_READ_MSGS, 2 * (new_priv->msize + trans_priv->transport.payload_size)));
 
-
-    void* working_buff = calloc(1,BUFF_SIZE);
-    if(!working_buff){
-        ch_log_fatal("Malloc failed!\n");
-    }
-    new_priv->delim_buffer = working_buff;
-    new_priv->delim_buffer_size = BUFF_SIZE;
+    new_priv->pool              = trans_priv->pool;
+    new_priv->write_buffer      = buf_pool_get(trans_priv->pool);
+    new_priv->write_buffer_size = buf_pool_buff_size(trans_priv->pool);
 
     return new_priv;
 
@@ -350,7 +398,7 @@ static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
         fd = priv->fd;
     }
 
-    q2pc_tcp_conn_priv* new_priv = new_conn_priv();
+    q2pc_tcp_conn_priv* new_priv = new_conn_priv(priv);
 
     new_priv->fd = fd;
     int flags = 0;
@@ -359,11 +407,30 @@ static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
         ch_log_fatal("Could not set non-blocking on fd=%i: %s\n",new_priv,strerror(errno));
     }
 
+    //We batch writes ourselves, so Nagle is off unless asked for
+    int nodelay_opt = !priv->transport.tcp_nagle;
+    if(setsockopt(new_priv->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay_opt, sizeof(int)) < 0) {
+        ch_log_fatal("TCP set no delay failed: %s\n",strerror(errno));
+    }
+
+    if(priv->transport.tcp_zero_copy){
+        int zc_opt = 1;
+        if(setsockopt(new_priv->fd, SOL_SOCKET, SO_ZEROCOPY, &zc_opt, sizeof(int)) < 0) {
+            ch_log_warn("TCP zero copy not available, falling back to copying: %s\n",strerror(errno));
+        }
+        else{
+            new_priv->zero_copy = true;
+        }
+    }
+
     conn->priv      = new_priv;
     conn->beg_read  = conn_beg_delimit;
     conn->end_read  = conn_end_delimit;
     conn->beg_write = conn_beg_write;
     conn->end_write = conn_end_write;
+    conn->end_writev = conn_end_writev;
+    conn->flush     = conn_flush;
+    conn->get_fd    = conn_get_fd;
     conn->delete    = conn_delete;
 
     return 0;
@@ -376,6 +443,7 @@ static void serv_delete(struct q2pc_trans_s* this)
         if(this->priv){
             q2pc_tcp_priv* priv = (q2pc_tcp_priv*)this->priv;
             close(priv->fd);
+            buf_pool_delete(priv->pool);
             free(this->priv);
         }
 
@@ -385,16 +453,13 @@ static void serv_delete(struct q2pc_trans_s* this)
 }
 
 
-#define BUFF_SIZE (4096 * 1024) //A 4MB buffer. Just because
 static void init(q2pc_tcp_priv* priv)
 {
 
     ch_log_debug1("Constructing TCP transport\n");
 
-    void* write_all_buff = calloc(1,BUFF_SIZE);
-    if(!write_all_buff){
-        ch_log_fatal("Malloc for new write all buffer failed!\n");
-    }
+    const i64 msize = MAX(priv->transport.msize, TCP_MSG_MIN);
+    priv->pool = buf_pool_new(MAX(msize, MIN(TCP_BATCH_BYTES, msize * TCP_BATCH_MAX)), priv->transport.hugepages);
 
     priv->fd = socket(AF_INET,SOCK_STREAM,0);
     if (priv->fd < 0 ){
@@ -444,7 +509,8 @@ static void init(q2pc_tcp_priv* priv)
             }
         }
 
-        int result = listen(priv->fd, 0);
+        //Room for every client, a client process running many participants connects them all at once
+        int result = listen(priv->fd, priv->transport.client_count);
         if(unlikely( result < 0 )){
             ch_log_fatal("TCP server listen failed: %s\n",strerror(errno));
         }
@@ -16,135 +16,49 @@
 #include <stdio.h>
 
 #include "q2pc_trans_udp.h"
+#include "q2pc_trans_udp_conn.h"
+#include "buf_pool.h"
+#include "udp_frag.h"
 #include "conn_vector.h"
 #include "../errors/errors.h"
 #include "../protocol/q2pc_protocol.h"
 
-typedef struct {
-    int fd; //Reading file descriptor
-
-    //For the reader
-    void* read_buffer;
-    i64   read_buffer_used;
-    i64   read_buffer_size;
-
-    //For the writer
-    void* write_buffer;
-    i64   write_buffer_used;
-    i64   write_buffer_size;
-
-    bool is_connected;
-    struct sockaddr_in src_addr;
-
-} q2pc_udp_conn_priv;
-
 //Forward declaration
 static void safe_connect(int fd, struct sockaddr_in* addr);
 
 
-static int conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+//First read on a server connection, we find out where the client is and only listen to it from then on
+i64 udp_conn_recv_first(q2pc_udp_conn_priv* priv)
 {
-    q2pc_udp_conn_priv* priv = (q2pc_udp_conn_priv*)this->priv;
-    if( priv->read_buffer && priv->read_buffer_used){
-        return Q2PC_ENONE;
-    }
-
-    int result = -1 ;
-    if(unlikely(!priv->is_connected)){
-        //ch_log_debug3("Connecting with rcv from\n");
-        socklen_t addr_len = sizeof(priv->src_addr);
-        result = recvfrom(priv->fd,priv->read_buffer, priv->read_buffer_size, 0, (struct sockaddr*)&priv->src_addr, &addr_len);
-
-        if(result > 0){
-            safe_connect(priv->fd,&priv->src_addr);
-            ch_log_debug3("Connected to %li\n", ntohs(priv->src_addr.sin_port));
-            priv->is_connected = true;
-        }
-
+    const i64 result = buf_pool_recv(priv->fd, priv->read_buffer, priv->read_buffer_size, &priv->src_addr, &priv->overflow, &priv->rx_meta);
+    if(result > 0){
+        safe_connect(priv->fd,&priv->src_addr);
+        ch_log_debug3("Connected to %li\n", ntohs(priv->src_addr.sin_port));
+        priv->is_connected = true;
     }
-    else{
-        result = read(priv->fd, priv->read_buffer, priv->read_buffer_size);
-        //ch_log_debug3("Read to %i bytes\n",result);
-    }
-
-    if(result < 0){
-        if(errno == EAGAIN || errno == EWOULDBLOCK){
-            return Q2PC_EAGAIN; //Reading would have blocked, we don't want this
-        }
-
-        if(errno == ECONNREFUSED){
-            ch_log_warn("UDP beg read EFIN (%s)\n", strerror(errno));
-            return Q2PC_EFIN;
-        }
-
-        ch_log_fatal("udp read failed on fd=%i with errno=%i (%s)\n",priv->fd, errno, strerror(errno));
-    }
-
-
-
-    if(result == 0){
-        return Q2PC_EFIN;
-    }
-
-    priv->read_buffer_used = result;
 
-    *data_o = priv->read_buffer;
-    *len_o  = priv->read_buffer_used;
-    ch_log_debug3("Got %li bytes\n", priv->read_buffer_used);
-
-
-    return Q2PC_ENONE;
+    return result;
 }
 
-static int conn_end_read(struct q2pc_trans_conn_s* this)
+
+static int conn_get_fd(struct q2pc_trans_conn_s* this)
 {
     q2pc_udp_conn_priv* priv = (q2pc_udp_conn_priv*)this->priv;
-    priv->read_buffer_used = 0;
-    return 0;
+    return priv->fd;
 }
 
 
-
-static int conn_beg_write(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+static i64 conn_get_drops(struct q2pc_trans_conn_s* this)
 {
     q2pc_udp_conn_priv* priv = (q2pc_udp_conn_priv*)this->priv;
-    *data_o = priv->write_buffer;
-    *len_o  = priv->write_buffer_size;
-    return 0;
+    return priv->rx_meta.drops;
 }
 
 
-static int conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
+static i64 conn_get_rx_ts(struct q2pc_trans_conn_s* this)
 {
     q2pc_udp_conn_priv* priv = (q2pc_udp_conn_priv*)this->priv;
-    char* data = priv->write_buffer;
-
-    if(len > priv->write_buffer_size){
-        ch_log_fatal("Error: Wrote more data than the buffer could handle. Memory corruption is likely\n ");
-    }
-
-    while(len > 0){
-        i64 written =  write(priv->fd, data ,len);
-        if(written < 0){
-
-            if(errno == EAGAIN || errno == EWOULDBLOCK){
-                continue; //Keep trying until we succeed
-            }
-
-            if(errno == ECONNREFUSED){
-                ch_log_debug3("UDP end write EFIN\n");
-                return Q2PC_EFIN;
-            }
-
-            ch_log_warn("UDP write failed with errorno=%i: %s\n", errno, strerror(errno));
-            return Q2PC_EFIN;
-        }
-        data += written;
-        len -= written;
-    }
-
-    return Q2PC_ENONE;
-
+    return priv->rx_meta.rx_ts_ns;
 }
 
 
@@ -153,10 +67,12 @@ static void conn_delete(struct q2pc_trans_conn_s* this)
     if(this){
         if(this->priv){
             q2pc_udp_conn_priv* priv = (q2pc_udp_conn_priv*)this->priv;
-            if(priv->read_buffer){ free(priv->read_buffer); }
-            //if(priv->write_buffer){ free(priv->write_buffer); } --Not necessary since r+w are allocated together
-            free(this->priv);
+            buf_pool_put(priv->pool, priv->read_buffer);
+            buf_pool_put(priv->pool, priv->write_buffer);
+            buf_pool_overflow_put(priv->overflow);
+            udp_frag_free(&priv->reasm);
             close(priv->fd);
+            free(this->priv);
         }
 
         //XXX HACK!
@@ -171,46 +87,45 @@ static void conn_delete(struct q2pc_trans_conn_s* this)
 typedef struct {
     transport_s transport;
     i64 connections;
+    buf_pool* pool;
 
 } q2pc_udp_priv;
 
 
 
 
-#define BUFF_SIZE (4096 * 1024) //A 4MB buffer. Just because it feels right
-static q2pc_udp_conn_priv* new_conn_priv()
+//Buffers are sized to the messages, anything bigger borrows from the overflow pool
+static q2pc_udp_conn_priv* new_conn_priv(buf_pool* pool)
 {
     q2pc_udp_conn_priv* new_priv = calloc(1,sizeof(q2pc_udp_conn_priv));
     if(!new_priv){
         ch_log_fatal("Malloc failed!\n");
     }
 
-    void* read_buff = calloc(2,BUFF_SIZE);
-    if(!read_buff){
-        ch_log_fatal("Malloc failed!\n");
-    }
-    new_priv->read_buffer = read_buff;
-    new_priv->read_buffer_size = BUFF_SIZE;
-
-    void* write_buff = (char*)read_buff + BUFF_SIZE;
-    new_priv->write_buffer = write_buff;
-    new_priv->write_buffer_size = BUFF_SIZE;
-
+    new_priv->pool              = pool;
+    new_priv->read_buffer       = buf_pool_get(pool);
+    new_priv->read_buffer_size  = buf_pool_buff_size(pool);
+    new_priv->write_buffer      = buf_pool_get(pool);
+    new_priv->write_buffer_size = buf_pool_buff_size(pool);
 
     return new_priv;
 
 }
 
-static q2pc_udp_conn_priv* init_new_conn(q2pc_trans_conn* conn)
+static q2pc_udp_conn_priv* init_new_conn(q2pc_trans_conn* conn, buf_pool* pool)
 {
-    q2pc_udp_conn_priv* new_priv = new_conn_priv();
+    q2pc_udp_conn_priv* new_priv = new_conn_priv(pool);
 
 
     conn->priv      = new_priv;
-    conn->beg_read  = conn_beg_read;
-    conn->end_read  = conn_end_read;
-    conn->beg_write = conn_beg_write;
-    conn->end_write = conn_end_write;
+    conn->beg_read  = udp_conn_beg_read;
+    conn->end_read  = udp_conn_end_read;
+    conn->beg_write = udp_conn_beg_write;
+    conn->end_write = udp_conn_end_write;
+    conn->end_writev = udp_conn_end_writev;
+    conn->get_drops = conn_get_drops;
+    conn->get_rx_ts = conn_get_rx_ts;
+    conn->get_fd    = conn_get_fd;
     conn->delete    = conn_delete;
 
     return new_priv;
@@ -265,7 +180,7 @@ static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
 
     if(!conn_priv){
 
-        q2pc_udp_conn_priv* new_priv = init_new_conn(conn);
+        q2pc_udp_conn_priv* new_priv = init_new_conn(conn, trans_priv->pool);
 
         new_priv->fd = socket(AF_INET,SOCK_DGRAM,0);
         if(new_priv->fd < 0 ){
@@ -305,6 +220,7 @@ static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
         if(setsockopt(new_priv->fd, SOL_SOCKET, SO_REUSEADDR, &reuse_opt, sizeof(int)) < 0) {
             ch_log_fatal("UDP set reuse address failed: %s\n",strerror(errno));
         }
+        trans_sock_options(new_priv->fd, &trans_priv->transport);
 
         int flags = 0;
         flags |= O_NONBLOCK;
@@ -325,7 +241,8 @@ static void serv_delete(struct q2pc_trans_s* this)
     if(this){
 
         if(this->priv){
-            //q2pc_udp_priv* priv = (q2pc_udp_priv*)this->priv;
+            q2pc_udp_priv* priv = (q2pc_udp_priv*)this->priv;
+            buf_pool_delete(priv->pool);
             free(this->priv);
         }
 
@@ -335,7 +252,6 @@ static void serv_delete(struct q2pc_trans_s* this)
 }
 
 
-#define BUFF_SIZE (4096 * 1024) //A 4MB buffer. Just because
 static void init(q2pc_udp_priv* priv)
 {
 
@@ -343,6 +259,7 @@ static void init(q2pc_udp_priv* priv)
 
     //Keep track of port numbers
     priv->connections = 1;
+    priv->pool        = buf_pool_new(priv->transport.msize, priv->transport.hugepages);
 
     ch_log_debug1("Done constructing UDP transport\n");
 
@@ -0,0 +1,190 @@
+/*
+ * q2pc_trans_udp_conn.h
+ */
+
+#ifndef Q2PC_TRANS_UDP_CONN_H_
+#define Q2PC_TRANS_UDP_CONN_H_
+
+#include <errno.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+#include "../../deps/chaste/chaste.h"
+#include "q2pc_transport.h"
+#include "buf_pool.h"
+#include "udp_frag.h"
+#include "../errors/errors.h"
+
+//The UDP connection fast path. It's here rather than in q2pc_trans_udp.c so that RUDP and the worker loops can have it
+//inlined instead of calling through the connection.
+
+typedef struct {
+    int fd; //Reading file descriptor
+
+    buf_pool* pool;
+
+    //For the reader
+    void* read_buffer;
+    i64   read_buffer_used;
+    i64   read_buffer_size;
+    char* overflow; //Set if the last message was too big for the read buffer
+    char* read_data; //Where the message we handed out is
+    udp_frag_reasm reasm;
+    buf_pool_rx_meta rx_meta; //Kernel drops and timestamps on fd
+
+    //For the writer
+    void* write_buffer;
+    i64   write_buffer_used;
+    i64   write_buffer_size;
+    u16   frag_id;
+
+    bool is_connected;
+    struct sockaddr_in src_addr;
+
+} q2pc_udp_conn_priv;
+
+
+i64 udp_conn_recv_first(q2pc_udp_conn_priv* priv);
+
+
+static inline int udp_conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_udp_conn_priv* priv = (q2pc_udp_conn_priv*)this->priv;
+    if( priv->read_buffer && priv->read_buffer_used){
+        *data_o = priv->read_data;
+        *len_o  = priv->read_buffer_used;
+        return Q2PC_ENONE;
+    }
+
+    //Keep reading until there is a whole message, or nothing left
+    for(;;){
+        i64 result = -1 ;
+        if(unlikely(!priv->is_connected)){
+            result = udp_conn_recv_first(priv);
+        }
+        else{
+            result = buf_pool_recv(priv->fd, priv->read_buffer, priv->read_buffer_size, NULL, &priv->overflow, &priv->rx_meta);
+        }
+
+        if(result < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                return Q2PC_EAGAIN; //Reading would have blocked, we don't want this
+            }
+
+            if(errno == ECONNREFUSED){
+                ch_log_warn("UDP beg read EFIN (%s)\n", strerror(errno));
+                return Q2PC_EFIN;
+            }
+
+            ch_log_fatal("udp read failed on fd=%i with errno=%i (%s)\n",priv->fd, errno, strerror(errno));
+        }
+
+
+
+        if(result == 0){
+            return Q2PC_EFIN;
+        }
+
+        priv->read_buffer_used = result;
+        priv->read_data        = priv->overflow ? priv->overflow : priv->read_buffer;
+
+        //Pieces of a bigger message are held back until it's all here
+        if(udp_frag_is_frag(priv->read_data, result)){
+            char* msg = NULL;
+            const i64 msg_len = udp_frag_add(&priv->reasm, priv->read_data, result, &msg);
+
+            priv->read_buffer_used = 0;
+            if(priv->overflow){
+                buf_pool_overflow_put(priv->overflow);
+                priv->overflow = NULL;
+            }
+
+            if(!msg_len){
+                continue; //Edge triggered, so the rest of it may already be waiting without an edge to show for it
+            }
+
+            priv->read_buffer_used = msg_len;
+            priv->read_data        = msg;
+        }
+
+        break;
+    }
+
+    *data_o = priv->read_data;
+    *len_o  = priv->read_buffer_used;
+    ch_log_debug3("Got %li bytes\n", priv->read_buffer_used);
+
+
+    return Q2PC_ENONE;
+}
+
+static inline int udp_conn_end_read(struct q2pc_trans_conn_s* this)
+{
+    q2pc_udp_conn_priv* priv = (q2pc_udp_conn_priv*)this->priv;
+    priv->read_buffer_used = 0;
+    if(priv->overflow){
+        buf_pool_overflow_put(priv->overflow);
+        priv->overflow = NULL;
+    }
+    return 0;
+}
+
+
+
+static inline int udp_conn_beg_write(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_udp_conn_priv* priv = (q2pc_udp_conn_priv*)this->priv;
+    *data_o = priv->write_buffer;
+    *len_o  = priv->write_buffer_size;
+    return 0;
+}
+
+
+//Send the message in iov straight from where it is. The write buffer is left alone for whoever has it.
+static inline int udp_conn_sendv(struct q2pc_trans_conn_s* this, const struct iovec* iov, int iov_count)
+{
+    q2pc_udp_conn_priv* priv = (q2pc_udp_conn_priv*)this->priv;
+
+    if(udp_frag_send(priv->fd, iov, iov_count, &priv->frag_id) < 0){
+        if(errno == ECONNREFUSED){
+            ch_log_debug3("UDP end write EFIN\n");
+            return Q2PC_EFIN;
+        }
+
+        ch_log_warn("UDP write failed with errorno=%i: %s\n", errno, strerror(errno));
+        return Q2PC_EFIN;
+    }
+
+    return Q2PC_ENONE;
+}
+
+
+//The payload goes out straight from where it is, behind the first len bytes of the write buffer
+static inline int udp_conn_end_writev(struct q2pc_trans_conn_s* this, i64 len, const struct iovec* payload, int payload_count)
+{
+    q2pc_udp_conn_priv* priv = (q2pc_udp_conn_priv*)this->priv;
+
+    if(len > priv->write_buffer_size){
+        ch_log_fatal("Error: Wrote more data than the buffer could handle. Memory corruption is likely\n ");
+    }
+
+    if(payload_count >= UDP_FRAG_IOV_MAX){
+        ch_log_fatal("Payload is in %i pieces, UDP can only send %i\n", payload_count, UDP_FRAG_IOV_MAX - 1);
+    }
+
+    struct iovec iov[UDP_FRAG_IOV_MAX] = { { .iov_base = priv->write_buffer, .iov_len = len } };
+    for(int i = 0; i < payload_count; i++){
+        iov[i + 1] = payload[i];
+    }
+
+    return udp_conn_sendv(this, iov, payload_count + 1);
+}
+
+
+static inline int udp_conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
+{
+    return udp_conn_end_writev(this, len, NULL, 0);
+}
+
+#endif /* Q2PC_TRANS_UDP_CONN_H_ */
@@ -0,0 +1,700 @@
+/*
+ * q2pc_trans_xdp.c
+ */
+
+ //#LINKFLAGS=-lpthread
+
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#include <errno.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <linux/if_xdp.h>
+#include <linux/if_link.h>
+#include <linux/bpf.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+
+#include "q2pc_trans_xdp.h"
+#include "udp_frame.h"
+#include "conn_vector.h"
+#include "../errors/errors.h"
+#include "../protocol/q2pc_protocol.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define XDP_FRAME_SIZE  2048
+#define XDP_FRAME_COUNT 4096
+#define XDP_RING_SIZE   2048 //Half the frames go to the fill ring, half to transmit
+#define XDP_MAP_SIZE    64
+
+
+typedef struct {
+    u32* producer;
+    u32* consumer;
+    u32* flags;
+    void* descs;
+    u32 mask;
+
+    void* map;
+    i64 map_len;
+} xsk_ring;
+
+
+struct q2pc_xdp_priv_s;
+
+typedef struct {
+    struct q2pc_xdp_priv_s* trans;
+
+    //For the reader
+    udp_inbox inbox;
+    udp_inbox_ent* read_ent;
+
+    //For the writer
+    u64 tx_addr;
+    bool tx_reserved;
+    udp_frame_addr dst;
+
+} q2pc_xdp_conn_priv;
+
+
+typedef struct q2pc_xdp_priv_s {
+    transport_s transport;
+
+    int ifindex;
+    udp_frame_addr src;
+
+    int xsk_fd;
+    int map_fd;
+    int prog_fd;
+    int link_fd;
+    bool zero_copy;
+    bool need_wakeup;
+
+    char* umem;
+    i64 umem_len;
+
+    xsk_ring fill;
+    xsk_ring comp;
+    xsk_ring rx;
+    xsk_ring tx;
+
+    pthread_spinlock_t rx_lock; //Protects the rx and fill rings
+    pthread_spinlock_t tx_lock; //Protects the tx and completion rings and the free list
+
+    u64* tx_free;
+    i64 tx_free_count;
+
+    q2pc_xdp_conn_priv** conns;
+    i64 connections;
+
+} q2pc_xdp_priv;
+
+
+/***************************************************************************************************************************/
+//Ring helpers, the kernel is on the other side of every one of these
+
+static inline u32 ring_avail(xsk_ring* r)
+{
+    return __atomic_load_n(r->producer, __ATOMIC_ACQUIRE) - *r->consumer;
+}
+
+static inline u32 ring_space(xsk_ring* r)
+{
+    return (r->mask + 1) - (*r->producer - __atomic_load_n(r->consumer, __ATOMIC_ACQUIRE));
+}
+
+static inline void ring_produce_addr(xsk_ring* r, u64 addr)
+{
+    ((u64*)r->descs)[*r->producer & r->mask] = addr;
+    __atomic_store_n(r->producer, *r->producer + 1, __ATOMIC_RELEASE);
+}
+
+
+//Hand a received frame back to the kernel. Must hold the rx lock.
+static inline void fill_return(q2pc_xdp_priv* priv, u64 addr)
+{
+    ring_produce_addr(&priv->fill, addr & ~((u64)XDP_FRAME_SIZE - 1));
+}
+
+
+//Drain the receive ring and sort the frames into the connection inboxes. Whoever gets the lock does the work for
+//everyone else, so there is exactly one syscall free pass over the ring no matter how many connections there are.
+static void rx_drain(q2pc_xdp_priv* priv)
+{
+    if(pthread_spin_trylock(&priv->rx_lock)){
+        return; //Someone else is draining for us
+    }
+
+    u32 avail = ring_avail(&priv->rx);
+    if(!avail){
+        if(priv->need_wakeup && (*priv->fill.flags & XDP_RING_NEED_WAKEUP)){
+            recvfrom(priv->xsk_fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+        }
+        pthread_spin_unlock(&priv->rx_lock);
+        return;
+    }
+
+    for(u32 i = 0; i < avail; i++){
+        const struct xdp_desc* desc = &((struct xdp_desc*)priv->rx.descs)[(*priv->rx.consumer + i) & priv->rx.mask];
+
+        char* payload = NULL;
+        u16 dport     = 0;
+        i64 len       = udp_frame_parse(priv->umem + desc->addr, desc->len, NULL, &dport, &payload);
+
+        //Servers listen on port + client id, clients on the broadcast port
+        i64 idx = priv->transport.server ? (i64)dport - priv->transport.port - 1 : (i64)dport - priv->transport.port;
+        if(len < 0 || idx < 0 || idx >= priv->connections || !priv->conns[idx]){
+            ch_log_debug3("Dropping frame for port %i\n", dport);
+            fill_return(priv, desc->addr);
+            continue;
+        }
+
+        if(!udp_inbox_push(&priv->conns[idx]->inbox, payload, len, desc->addr)){
+            ch_log_debug1("Inbox full on connection %li, dropping frame\n", idx);
+            fill_return(priv, desc->addr);
+        }
+    }
+
+    __atomic_store_n(priv->rx.consumer, *priv->rx.consumer + avail, __ATOMIC_RELEASE);
+    pthread_spin_unlock(&priv->rx_lock);
+}
+
+
+static int conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_xdp_conn_priv* priv = (q2pc_xdp_conn_priv*)this->priv;
+    if(priv->read_ent){
+        *data_o = priv->read_ent->data;
+        *len_o  = priv->read_ent->len;
+        return Q2PC_ENONE;
+    }
+
+    udp_inbox_ent* ent = udp_inbox_peek(&priv->inbox);
+    if(!ent){
+        rx_drain(priv->trans);
+        ent = udp_inbox_peek(&priv->inbox);
+        if(!ent){
+            return Q2PC_EAGAIN;
+        }
+    }
+
+    priv->read_ent = ent;
+    *data_o = ent->data;
+    *len_o  = ent->len;
+    ch_log_debug3("Got %li bytes\n", ent->len);
+
+    return Q2PC_ENONE;
+}
+
+
+static int conn_end_read(struct q2pc_trans_conn_s* this)
+{
+    q2pc_xdp_conn_priv* priv = (q2pc_xdp_conn_priv*)this->priv;
+    if(!priv->read_ent){
+        return Q2PC_ENONE;
+    }
+
+    pthread_spin_lock(&priv->trans->rx_lock);
+    fill_return(priv->trans, priv->read_ent->tag);
+    pthread_spin_unlock(&priv->trans->rx_lock);
+
+    priv->read_ent = NULL;
+    udp_inbox_pop(&priv->inbox);
+    return Q2PC_ENONE;
+}
+
+
+//Collect completed transmit frames back onto the free list. Must hold the tx lock.
+static void tx_reap(q2pc_xdp_priv* priv)
+{
+    u32 done = ring_avail(&priv->comp);
+    for(u32 i = 0; i < done; i++){
+        priv->tx_free[priv->tx_free_count++] = ((u64*)priv->comp.descs)[(*priv->comp.consumer + i) & priv->comp.mask];
+    }
+    __atomic_store_n(priv->comp.consumer, *priv->comp.consumer + done, __ATOMIC_RELEASE);
+}
+
+
+static void tx_kick(q2pc_xdp_priv* priv)
+{
+    //Copy mode only transmits from inside sendto(), so it always needs a kick
+    if(priv->zero_copy && priv->need_wakeup && !(*priv->tx.flags & XDP_RING_NEED_WAKEUP)){
+        return;
+    }
+
+    if(sendto(priv->xsk_fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0){
+        if(errno != EAGAIN && errno != EBUSY && errno != ENOBUFS && errno != ENETDOWN){
+            ch_log_fatal("XDP transmit kick failed: %s\n", strerror(errno));
+        }
+    }
+}
+
+
+//The frame is built directly in UMEM, so the caller writes straight into the memory the NIC will DMA from
+static int conn_beg_write(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_xdp_conn_priv* priv = (q2pc_xdp_conn_priv*)this->priv;
+    q2pc_xdp_priv* trans     = priv->trans;
+
+    if(!priv->tx_reserved){
+        pthread_spin_lock(&trans->tx_lock);
+        tx_reap(trans);
+        while(!trans->tx_free_count){
+            tx_kick(trans);
+            tx_reap(trans);
+        }
+        priv->tx_addr = trans->tx_free[--trans->tx_free_count];
+        pthread_spin_unlock(&trans->tx_lock);
+        priv->tx_reserved = true;
+    }
+
+    *data_o = trans->umem + priv->tx_addr + UDP_FRAME_HDR_LEN;
+    *len_o  = XDP_FRAME_SIZE - UDP_FRAME_HDR_LEN;
+    return Q2PC_ENONE;
+}
+
+
+static int conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
+{
+    q2pc_xdp_conn_priv* priv = (q2pc_xdp_conn_priv*)this->priv;
+    q2pc_xdp_priv* trans     = priv->trans;
+
+    if(!priv->tx_reserved){
+        ch_log_fatal("Error: XDP end write without a frame from begin write\n");
+    }
+
+    if(len > XDP_FRAME_SIZE - UDP_FRAME_HDR_LEN){
+        ch_log_fatal("Error: Wrote more data than the buffer could handle. Memory corruption is likely\n ");
+    }
+
+    udp_frame_build(trans->umem + priv->tx_addr, &trans->src, &priv->dst, len);
+
+    pthread_spin_lock(&trans->tx_lock);
+    while(!ring_space(&trans->tx)){
+        tx_kick(trans);
+    }
+    struct xdp_desc* desc = &((struct xdp_desc*)trans->tx.descs)[*trans->tx.producer & trans->tx.mask];
+    desc->addr    = priv->tx_addr;
+    desc->len     = UDP_FRAME_HDR_LEN + len;
+    desc->options = 0;
+    __atomic_store_n(trans->tx.producer, *trans->tx.producer + 1, __ATOMIC_RELEASE);
+    tx_kick(trans);
+    pthread_spin_unlock(&trans->tx_lock);
+
+    priv->tx_reserved = false;
+    return Q2PC_ENONE;
+}
+
+
+static void conn_delete(struct q2pc_trans_conn_s* this)
+{
+    if(this){
+        if(this->priv){
+            free(this->priv);
+        }
+
+        //XXX HACK!
+        //free(this);
+    }
+}
+
+
+
+/***************************************************************************************************************************/
+
+static int sys_bpf(int cmd, union bpf_attr* attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+
+#define INSN(CODE, DST, SRC, OFF, IMM) ((struct bpf_insn){ .code = (CODE), .dst_reg = (DST), .src_reg = (SRC), .off = (OFF), .imm = (IMM) })
+
+//Redirect UDP frames for ports [port_lo, port_lo + port_range] into the XSK on this queue, pass everything else up
+//the stack so ARP, SSH etc. keep working.
+static int load_prog(int map_fd, u16 port_lo, u16 port_range)
+{
+    const struct bpf_insn prog[] = {
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X,   BPF_REG_6, BPF_REG_1, 0, 0),                    // r6 = ctx
+        INSN(BPF_LDX | BPF_W | BPF_MEM,     BPF_REG_2, BPF_REG_6, 0, 0),                    // r2 = ctx->data
+        INSN(BPF_LDX | BPF_W | BPF_MEM,     BPF_REG_3, BPF_REG_6, 4, 0),                    // r3 = ctx->data_end
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X,   BPF_REG_4, BPF_REG_2, 0, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K,   BPF_REG_4, 0, 0, UDP_FRAME_HDR_LEN),
+        INSN(BPF_JMP | BPF_JGT | BPF_X,     BPF_REG_4, BPF_REG_3, 16, 0),                   // too short -> pass
+        INSN(BPF_LDX | BPF_H | BPF_MEM,     BPF_REG_4, BPF_REG_2, 12, 0),                   // ethertype
+        INSN(BPF_JMP | BPF_JNE | BPF_K,     BPF_REG_4, 0, 14, htons(0x0800)),
+        INSN(BPF_LDX | BPF_B | BPF_MEM,     BPF_REG_4, BPF_REG_2, 14, 0),                   // version/ihl
+        INSN(BPF_JMP | BPF_JNE | BPF_K,     BPF_REG_4, 0, 12, 0x45),
+        INSN(BPF_LDX | BPF_B | BPF_MEM,     BPF_REG_4, BPF_REG_2, 23, 0),                   // protocol
+        INSN(BPF_JMP | BPF_JNE | BPF_K,     BPF_REG_4, 0, 10, IPPROTO_UDP),
+        INSN(BPF_LDX | BPF_H | BPF_MEM,     BPF_REG_4, BPF_REG_2, 36, 0),                   // udp dest port
+        INSN(BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_4, 0, 0, 16),
+        INSN(BPF_ALU64 | BPF_SUB | BPF_K,   BPF_REG_4, 0, 0, port_lo),
+        INSN(BPF_JMP | BPF_JGT | BPF_K,     BPF_REG_4, 0, 6, port_range),                   // out of range -> pass
+        INSN(BPF_LD | BPF_DW | BPF_IMM,     BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd),       // r1 = xsks map
+        INSN(0, 0, 0, 0, 0),
+        INSN(BPF_LDX | BPF_W | BPF_MEM,     BPF_REG_2, BPF_REG_6, 16, 0),                   // r2 = rx_queue_index
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K,   BPF_REG_3, 0, 0, XDP_PASS),                     // pass if no socket
+        INSN(BPF_JMP | BPF_CALL,            0, 0, 0, BPF_FUNC_redirect_map),
+        INSN(BPF_JMP | BPF_EXIT,            0, 0, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K,   BPF_REG_0, 0, 0, XDP_PASS),                     // pass:
+        INSN(BPF_JMP | BPF_EXIT,            0, 0, 0, 0),
+    };
+
+    static char log_buf[64 * 1024];
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns     = (u64)(uintptr_t)prog;
+    attr.insn_cnt  = sizeof(prog) / sizeof(prog[0]);
+    attr.license   = (u64)(uintptr_t)"Dual BSD/GPL";
+    attr.log_buf   = (u64)(uintptr_t)log_buf;
+    attr.log_size  = sizeof(log_buf);
+    attr.log_level = 1;
+
+    int fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if(fd < 0){
+        ch_log_fatal("Could not load XDP redirect program: %s\n%s\n", strerror(errno), log_buf);
+    }
+
+    return fd;
+}
+
+
+static void attach_prog(q2pc_xdp_priv* priv)
+{
+    //Try native mode first, generic (skb) mode works everywhere including veth and loopback
+    const u32 modes[] = { XDP_FLAGS_DRV_MODE, XDP_FLAGS_SKB_MODE };
+    for(u32 i = 0; i < sizeof(modes) / sizeof(modes[0]); i++){
+        union bpf_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.link_create.prog_fd        = priv->prog_fd;
+        attr.link_create.target_ifindex = priv->ifindex;
+        attr.link_create.attach_type    = BPF_XDP;
+        attr.link_create.flags          = modes[i];
+
+        priv->link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+        if(priv->link_fd >= 0){
+            ch_log_debug1("Attached XDP program to %s in %s mode\n", priv->transport.iface, i ? "generic" : "native");
+            return;
+        }
+        ch_log_debug1("Could not attach XDP program in %s mode: %s\n", i ? "generic" : "native", strerror(errno));
+    }
+
+    ch_log_fatal("Could not attach XDP program to %s: %s\n", priv->transport.iface, strerror(errno));
+}
+
+
+static void map_ring(q2pc_xdp_priv* priv, xsk_ring* ring, const struct xdp_ring_offset* off, i64 desc_size, off_t pgoff)
+{
+    ring->map_len = off->desc + XDP_RING_SIZE * desc_size;
+    ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, priv->xsk_fd, pgoff);
+    if(ring->map == MAP_FAILED){
+        ch_log_fatal("Could not map XDP ring: %s\n", strerror(errno));
+    }
+
+    ring->producer = (u32*)((char*)ring->map + off->producer);
+    ring->consumer = (u32*)((char*)ring->map + off->consumer);
+    ring->flags    = (u32*)((char*)ring->map + off->flags);
+    ring->descs    = (char*)ring->map + off->desc;
+    ring->mask     = XDP_RING_SIZE - 1;
+}
+
+
+static void set_ring_size(int fd, int opt)
+{
+    int size = XDP_RING_SIZE;
+    if(setsockopt(fd, SOL_XDP, opt, &size, sizeof(size))){
+        ch_log_fatal("Could not set XDP ring size: %s\n", strerror(errno));
+    }
+}
+
+
+static void init_xsk(q2pc_xdp_priv* priv)
+{
+    priv->umem_len = (i64)XDP_FRAME_SIZE * XDP_FRAME_COUNT;
+    priv->umem = mmap(NULL, priv->umem_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if(priv->umem == MAP_FAILED){
+        ch_log_fatal("Could not allocate XDP UMEM: %s\n", strerror(errno));
+    }
+
+    priv->xsk_fd = socket(AF_XDP, SOCK_RAW, 0);
+    if(priv->xsk_fd < 0){
+        ch_log_fatal("Could not create XDP socket (%s)\n", strerror(errno));
+    }
+
+    struct xdp_umem_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.addr       = (u64)(uintptr_t)priv->umem;
+    reg.len        = priv->umem_len;
+    reg.chunk_size = XDP_FRAME_SIZE;
+    reg.headroom   = 0;
+    if(setsockopt(priv->xsk_fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg))){
+        ch_log_fatal("Could not register XDP UMEM: %s\n", strerror(errno));
+    }
+
+    set_ring_size(priv->xsk_fd, XDP_UMEM_FILL_RING);
+    set_ring_size(priv->xsk_fd, XDP_UMEM_COMPLETION_RING);
+    set_ring_size(priv->xsk_fd, XDP_RX_RING);
+    set_ring_size(priv->xsk_fd, XDP_TX_RING);
+
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    if(getsockopt(priv->xsk_fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen)){
+        ch_log_fatal("Could not get XDP ring offsets: %s\n", strerror(errno));
+    }
+
+    map_ring(priv, &priv->fill, &off.fr, sizeof(u64),             XDP_UMEM_PGOFF_FILL_RING);
+    map_ring(priv, &priv->comp, &off.cr, sizeof(u64),             XDP_UMEM_PGOFF_COMPLETION_RING);
+    map_ring(priv, &priv->rx,   &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING);
+    map_ring(priv, &priv->tx,   &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING);
+
+    //First half of UMEM is for receiving, second half for sending
+    for(i64 i = 0; i < XDP_RING_SIZE; i++){
+        ring_produce_addr(&priv->fill, i * XDP_FRAME_SIZE);
+    }
+
+    priv->tx_free = calloc(XDP_FRAME_COUNT - XDP_RING_SIZE, sizeof(u64));
+    if(!priv->tx_free){
+        ch_log_fatal("Malloc failed!\n");
+    }
+    for(i64 i = XDP_RING_SIZE; i < XDP_FRAME_COUNT; i++){
+        priv->tx_free[priv->tx_free_count++] = i * XDP_FRAME_SIZE;
+    }
+
+    //Zero copy where the driver supports it, otherwise fall back to copy mode (veth, loopback etc.)
+    const u16 bind_flags[] = { XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP, XDP_COPY | XDP_USE_NEED_WAKEUP, XDP_COPY };
+    for(u32 i = 0; i < sizeof(bind_flags) / sizeof(bind_flags[0]); i++){
+        struct sockaddr_xdp sxdp;
+        memset(&sxdp, 0, sizeof(sxdp));
+        sxdp.sxdp_family   = AF_XDP;
+        sxdp.sxdp_ifindex  = priv->ifindex;
+        sxdp.sxdp_queue_id = priv->transport.xdp_queue;
+        sxdp.sxdp_flags    = bind_flags[i];
+
+        if(!bind(priv->xsk_fd, (struct sockaddr*)&sxdp, sizeof(sxdp))){
+            priv->zero_copy   = (bind_flags[i] & XDP_ZEROCOPY) != 0;
+            priv->need_wakeup = (bind_flags[i] & XDP_USE_NEED_WAKEUP) != 0;
+            ch_log_info("XDP socket bound to %s queue %li in %s mode\n",
+                    priv->transport.iface, priv->transport.xdp_queue, priv->zero_copy ? "zero-copy" : "copy");
+            return;
+        }
+        ch_log_debug1("XDP bind with flags 0x%x failed: %s\n", bind_flags[i], strerror(errno));
+    }
+
+    ch_log_fatal("Could not bind XDP socket to %s queue %li: %s\n", priv->transport.iface, priv->transport.xdp_queue, strerror(errno));
+}
+
+
+//There is only the one socket, on --xdp-queue. Frames RSS spreads onto the other queues get passed up a stack with
+//nothing listening for them, and are lost without a trace. Say so, it's up to the user to steer them.
+static void check_queues(q2pc_xdp_priv* priv)
+{
+    const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(fd < 0){
+        return;
+    }
+
+    struct ethtool_channels channels = { .cmd = ETHTOOL_GCHANNELS };
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", priv->transport.iface);
+    ifr.ifr_data = (void*)&channels;
+    const int result = ioctl(fd, SIOCETHTOOL, &ifr);
+    close(fd);
+
+    if(result){
+        ch_log_debug1("Could not get the queues on %s: %s\n", priv->transport.iface, strerror(errno));
+        return;
+    }
+
+    const u32 rx_queues = channels.rx_count + channels.combined_count;
+    if(rx_queues > 1){
+        ch_log_warn("%s has %u receive queues, but XDP only listens on queue %li. Anything arriving on the others is "
+                "lost. Use \"ethtool -L %s combined 1\", or steer the Q2PC ports to queue %li with \"ethtool -N\".\n",
+                priv->transport.iface, rx_queues, priv->transport.xdp_queue, priv->transport.iface,
+                priv->transport.xdp_queue);
+    }
+}
+
+
+static void init_prog(q2pc_xdp_priv* priv)
+{
+    check_queues(priv);
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type    = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size    = sizeof(u32);
+    attr.value_size  = sizeof(u32);
+    attr.max_entries = XDP_MAP_SIZE;
+
+    priv->map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+    if(priv->map_fd < 0){
+        ch_log_fatal("Could not create XSK map: %s\n", strerror(errno));
+    }
+
+    const u16 port_lo    = priv->transport.server ? priv->transport.port + 1 : priv->transport.port;
+    const u16 port_range = priv->transport.server ? priv->transport.client_count - 1 : 0;
+    priv->prog_fd = load_prog(priv->map_fd, port_lo, port_range);
+
+    u32 key = priv->transport.xdp_queue;
+    u32 val = priv->xsk_fd;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = priv->map_fd;
+    attr.key    = (u64)(uintptr_t)&key;
+    attr.value  = (u64)(uintptr_t)&val;
+    if(sys_bpf(BPF_MAP_UPDATE_ELEM, &attr)){
+        ch_log_fatal("Could not add XDP socket to XSK map: %s\n", strerror(errno));
+    }
+
+    attach_prog(priv);
+}
+
+
+static q2pc_xdp_conn_priv* init_new_conn(q2pc_trans_conn* conn)
+{
+    q2pc_xdp_conn_priv* new_priv = calloc(1,sizeof(q2pc_xdp_conn_priv));
+    if(!new_priv){
+        ch_log_fatal("Malloc failed!\n");
+    }
+
+    conn->priv      = new_priv;
+    conn->beg_read  = conn_beg_read;
+    conn->end_read  = conn_end_read;
+    conn->beg_write = conn_beg_write;
+    conn->end_write = conn_end_write;
+    conn->delete    = conn_delete;
+
+    return new_priv;
+}
+
+
+//Connections are just a slot in the inbox table, there is only one socket underneath
+static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
+{
+    q2pc_xdp_priv* trans_priv = (q2pc_xdp_priv*)this->priv;
+
+    if(!conn->priv){
+        const i64 max_conns = trans_priv->transport.server ? trans_priv->transport.client_count : 1;
+        if(trans_priv->connections >= max_conns){
+            ch_log_fatal("Too many XDP connections, expected at most %li\n", max_conns);
+        }
+
+        q2pc_xdp_conn_priv* new_priv = init_new_conn(conn);
+        new_priv->trans = trans_priv;
+
+        if(trans_priv->transport.server){
+            //Send to the client(s) on the broadcast port
+            memset(new_priv->dst.mac, 0xFF, sizeof(new_priv->dst.mac));
+            new_priv->dst.ip   = inet_addr(trans_priv->transport.bcast);
+            new_priv->dst.port = trans_priv->transport.port;
+        }
+        else{
+            //Send to the server on the server port. We don't do ARP, so use the broadcast MAC and let the
+            //server's XDP program pick the frame up by port.
+            memset(new_priv->dst.mac, 0xFF, sizeof(new_priv->dst.mac));
+            new_priv->dst.ip   = inet_addr(trans_priv->transport.ip);
+            new_priv->dst.port = trans_priv->transport.port + trans_priv->transport.client_id;
+        }
+
+        __sync_synchronize(); //Make sure the connection is fully set up before the receive path can see it
+        trans_priv->conns[trans_priv->connections] = new_priv;
+        trans_priv->connections++;
+    }
+
+    return Q2PC_ENONE;
+}
+
+
+static void unmap_ring(xsk_ring* ring)
+{
+    if(ring->map){
+        munmap(ring->map, ring->map_len);
+    }
+}
+
+
+static void serv_delete(struct q2pc_trans_s* this)
+{
+    if(this){
+
+        if(this->priv){
+            q2pc_xdp_priv* priv = (q2pc_xdp_priv*)this->priv;
+            close(priv->link_fd); //Detaches the program
+            close(priv->prog_fd);
+            close(priv->map_fd);
+            unmap_ring(&priv->fill);
+            unmap_ring(&priv->comp);
+            unmap_ring(&priv->rx);
+            unmap_ring(&priv->tx);
+            close(priv->xsk_fd);
+            munmap(priv->umem, priv->umem_len);
+            free(priv->tx_free);
+            free(priv->conns);
+            free(this->priv);
+        }
+
+        free(this);
+    }
+
+}
+
+
+static void init(q2pc_xdp_priv* priv)
+{
+    ch_log_debug1("Constructing XDP transport\n");
+
+    pthread_spin_init(&priv->rx_lock, PTHREAD_PROCESS_PRIVATE);
+    pthread_spin_init(&priv->tx_lock, PTHREAD_PROCESS_PRIVATE);
+
+    const i64 max_conns = priv->transport.server ? priv->transport.client_count : 1;
+    priv->conns = calloc(max_conns, sizeof(q2pc_xdp_conn_priv*));
+    if(!priv->conns){
+        ch_log_fatal("Malloc failed!\n");
+    }
+
+    udp_frame_iface(priv->transport.iface, &priv->ifindex, &priv->src);
+    priv->src.port = priv->transport.server ? priv->transport.port : priv->transport.port + priv->transport.client_id;
+
+    init_xsk(priv);
+    init_prog(priv);
+
+    ch_log_debug1("Done constructing XDP transport\n");
+}
+
+
+q2pc_trans* q2pc_xdp_construct(const transport_s* transport)
+{
+    q2pc_trans* result = (q2pc_trans*)calloc(1,sizeof(q2pc_trans));
+    if(!result){
+        ch_log_fatal("Could not allocate XDP server structure\n");
+    }
+
+    q2pc_xdp_priv* priv = (q2pc_xdp_priv*)calloc(1,sizeof(q2pc_xdp_priv));
+    if(!priv){
+        ch_log_fatal("Could not allocate XDP server private structure\n");
+    }
+
+    result->priv          = priv;
+    result->connect       = doconnect;
+    result->delete        = serv_delete;
+    memcpy(&priv->transport,transport, sizeof(transport_s));
+    init(priv);
+
+
+    return result;
+}
@@ -5,12 +5,27 @@
  *      Author: mgrosvenor
  */
 
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <pthread.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
 
 #include "q2pc_transport.h"
 #include "q2pc_trans_tcp.h"
 #include "q2pc_trans_udp.h"
 #include "q2pc_trans_rudp.h"
 #include "q2pc_trans_qj.h"
+#include "q2pc_trans_xdp.h"
+#include "q2pc_trans_pkt.h"
+#include "q2pc_trans_mcast.h"
+#include "q2pc_trans_shm.h"
+#include "q2pc_trans_mem.h"
 
 
 q2pc_trans* trans_factory(const transport_s* transport)
@@ -20,9 +35,137 @@ q2pc_trans* trans_factory(const transport_s* transport)
         case udp_ln: return q2pc_udp_construct(transport);
         case rdp_ln: return q2pc_rudp_construct(transport);
         case udp_qj: return q2pc_qj_construct(transport);
+        case xdp_qj: return q2pc_xdp_construct(transport);
+        case pkt_qj: return q2pc_pkt_construct(transport);
+        case mcast_ln: return q2pc_mcast_construct(transport);
+        case shm_ln: return q2pc_shm_construct(transport);
+        case mem_lo: return q2pc_mem_construct(transport);
         default: ch_log_fatal("Not implemented\n");
     }
 
     return NULL;
 }
 
+
+
+//Hardware stamps have to be switched on at the NIC, once. Without root, or a NIC that can, we get software stamps.
+//The NIC's settings are shared with anything else using its clock (ptp4l), so they're put back the way they were when
+//we exit.
+static const transport_s* hw_stamp_transport = NULL;
+static struct hwtstamp_config hw_stamp_saved;
+
+static int hw_stamp_ioctl(int request, struct hwtstamp_config* config)
+{
+    const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(fd < 0){
+        return -1;
+    }
+
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", hw_stamp_transport->iface);
+    ifr.ifr_data = (void*)config;
+    const int result = ioctl(fd, request, &ifr);
+    close(fd);
+    return result;
+}
+
+
+static void hw_stamp_restore()
+{
+    struct hwtstamp_config config = hw_stamp_saved;
+    if(hw_stamp_ioctl(SIOCSHWTSTAMP, &config)){
+        ch_log_warn("Could not restore the hardware timestamp settings on %s: %s\n", hw_stamp_transport->iface, strerror(errno));
+    }
+}
+
+
+static void hw_stamp_enable()
+{
+    if(hw_stamp_ioctl(SIOCGHWTSTAMP, &hw_stamp_saved)){
+        ch_log_warn("Cannot read the hardware timestamp settings on %s, leaving them alone: %s\n", hw_stamp_transport->iface, strerror(errno));
+        return;
+    }
+
+    if(hw_stamp_saved.rx_filter == HWTSTAMP_FILTER_ALL){
+        return;
+    }
+
+    //Leave transmit stamps as they are, someone else may be using them
+    struct hwtstamp_config config = { .tx_type = hw_stamp_saved.tx_type, .rx_filter = HWTSTAMP_FILTER_ALL };
+    if(hw_stamp_ioctl(SIOCSHWTSTAMP, &config)){
+        ch_log_warn("No hardware timestamps on %s, using software ones: %s\n", hw_stamp_transport->iface, strerror(errno));
+        return;
+    }
+
+    atexit(hw_stamp_restore);
+}
+
+
+static void sock_timestamps(int fd, const transport_s* transport)
+{
+    if(!transport->timestamping){
+        return;
+    }
+
+    //The NIC's clock is only comparable with the time the coordinator stamped the request if something keeps it on
+    //system time. The kernel leaves the raw hardware stamp out unless we ask for it, so we only ask if we've been told.
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if(transport->timestamping > 1 && transport->phc_synced){
+        static pthread_once_t once = PTHREAD_ONCE_INIT;
+        hw_stamp_transport = transport;
+        pthread_once(&once, hw_stamp_enable);
+        flags |= SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+    }
+
+    if(setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags))){
+        ch_log_warn("Could not timestamp receives on fd=%i: %s\n", fd, strerror(errno));
+    }
+}
+
+
+void trans_sock_options(int fd, const transport_s* transport)
+{
+    //Only a warning, the kernel caps these at net.core.rmem_max and wmem_max anyway
+    int rcvbuf = transport->sock_rcvbuf;
+    if(rcvbuf && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf))){
+        ch_log_warn("Could not set receive buffer to %iB on fd=%i: %s\n", rcvbuf, fd, strerror(errno));
+    }
+
+    int sndbuf = transport->sock_sndbuf;
+    if(sndbuf && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf))){
+        ch_log_warn("Could not set send buffer to %iB on fd=%i: %s\n", sndbuf, fd, strerror(errno));
+    }
+
+    int ovfl = 1;
+    if(setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &ovfl, sizeof(ovfl))){
+        ch_log_warn("Could not count drops on fd=%i: %s\n", fd, strerror(errno));
+    }
+
+    sock_timestamps(fd, transport);
+}
+
+
+#define TRANS_FDS_SPARE 64
+
+void trans_reserve_fds(const transport_s* transport, i64 conn_count)
+{
+    //Q-Jump has a writer for every traffic class. The server's broadcast writers are shared by all its connections
+    i64 per_conn = 2;
+    i64 shared   = 0;
+    if(transport->type == udp_qj){
+        per_conn = transport->server ? 1 : 1 + Q2PC_CLASS_COUNT;
+        shared   = transport->server ? Q2PC_CLASS_COUNT : 0;
+    }
+    const rlim_t needed = per_conn * conn_count + shared + TRANS_FDS_SPARE;
+
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) || limit.rlim_cur >= needed){
+        return;
+    }
+
+    limit.rlim_cur = MIN(needed, limit.rlim_max);
+    if(setrlimit(RLIMIT_NOFILE, &limit) || limit.rlim_cur < needed){
+        ch_log_warn("Can only open %li files, %li connections may need more\n", (i64)limit.rlim_cur, conn_count);
+    }
+}
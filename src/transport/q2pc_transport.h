@@ -8,12 +8,16 @@
 #ifndef Q2PC_TRANSPORT_H_
 #define Q2PC_TRANSPORT_H_
 
+#include <sys/uio.h>
+
 #include "../../deps/chaste/chaste.h"
 #include "conn_array.h"
 #include "conn_vector.h"
+#include "../errors/errors.h"
+#include "../protocol/q2pc_protocol.h"
 
 
-typedef enum { udp_ln = 0, tcp_ln, rdp_ln, udp_qj } transport_e;
+typedef enum { udp_ln = 0, tcp_ln, rdp_ln, udp_qj, xdp_qj, pkt_qj, mcast_ln, shm_ln, mem_lo } transport_e;
 
 typedef struct {
     transport_e type;
@@ -28,10 +32,33 @@ typedef struct {
     char* iface;
     i64 rto_us;
     i64 msize;
+    i64 payload_size;
+    i64 sock_rcvbuf;        //Socket buffer sizes (bytes), 0 for the kernel's default
+    i64 sock_sndbuf;
+    i64 timestamping;       //Kernel receive timestamps, 0 for none, 1 software, 2 hardware where the NIC has them
+    bool phc_synced;        //The NIC's clock is kept on system time, hardware stamps are only used if it is
+    i64 vote_window_us;     //Participants spread their votes over this, 0 to vote straight away
+    i64 vote_slots;
+    i64 xdp_queue;
+    char* mcast_group;
+    bool shm_doorbell;
+    bool tcp_nagle;
+    bool tcp_zero_copy;
+    bool hugepages;
 
 } transport_s;
 
 
+//Traffic classes, most urgent first. Decisions and their acks release the participants' locks, so they go ahead of
+//everything. Bulk is whatever carries a payload, and only costs throughput if it waits.
+typedef enum {
+    q2pc_class_decision = 0,
+    q2pc_class_control,
+    q2pc_class_bulk,
+    Q2PC_CLASS_COUNT
+} q2pc_class_e;
+
+
 typedef struct q2pc_trans_conn_s {
     int (*beg_read)(struct q2pc_trans_conn_s* this, char** data, i64* len_o);
     int (*end_read)(struct q2pc_trans_conn_s* this);
@@ -39,6 +66,32 @@ typedef struct q2pc_trans_conn_s {
     int (*beg_write)(struct q2pc_trans_conn_s* this, char** data, i64* len_o);
     int (*end_write)(struct q2pc_trans_conn_s* this, i64 len);
 
+    //Optional, may be NULL. Like end_write, but the message carries on past the first len bytes of the write buffer
+    //with the payload in iov. The payload is sent from where it is, so it must not change until the write is flushed, or
+    //on a reliable transport, acknowledged.
+    int (*end_writev)(struct q2pc_trans_conn_s* this, i64 len, const struct iovec* iov, int iov_count);
+
+    //Optional, may be NULL. The class the writes after it go out in, until it's set again. Connections start out in
+    //q2pc_class_control. Transports without it send everything alike.
+    void (*set_class)(struct q2pc_trans_conn_s* this, q2pc_class_e cls);
+
+    //Optional, may be NULL. Transports that queue writes push them out here. Reliable transports that send ahead of
+    //their acks (RUDP) retransmit from here, without reading. They return Q2PC_EAGAIN while anything is unacknowledged
+    //and Q2PC_RTOFIRED if anything has been retransmitted since the last flush, neither is a failure.
+    int (*flush)(struct q2pc_trans_conn_s* this);
+
+    //Optional, may be NULL. How many datagrams the kernel has dropped so far for want of room in the connection's
+    //receive buffer. Only counted as they're noticed, on the reads after them.
+    i64 (*get_drops)(struct q2pc_trans_conn_s* this);
+
+    //Optional, may be NULL. When the kernel received the message beg_read() last handed out (ns, CLOCK_REALTIME), or 0
+    //if it wasn't timestamped. Still there after end_read().
+    i64 (*get_rx_ts)(struct q2pc_trans_conn_s* this);
+
+    //Optional, may be NULL. A descriptor that polls readable when beg_read() may have something, or -1 if there isn't
+    //one and the connection has to be polled by calling beg_read().
+    int (*get_fd)(struct q2pc_trans_conn_s* this);
+
     void (*delete)(struct q2pc_trans_conn_s* this);
 
     void* priv;
@@ -56,4 +109,55 @@ typedef struct q2pc_trans_s {
 
 q2pc_trans* trans_factory(const transport_s* transport);
 
+//Each connection has a socket or few of its own, thousands of them soon run past the default limit on open files.
+//Raise it as far as we're allowed.
+void trans_reserve_fds(const transport_s* transport, i64 conn_count);
+
+
+//Size a datagram socket's buffers as configured, have it count what it drops (SO_RXQ_OVFL), and timestamp what it
+//receives if asked to
+void trans_sock_options(int fd, const transport_s* transport);
+
+
+//Push out anything end_write() has queued on the connection
+static inline int trans_conn_flush(q2pc_trans_conn* conn)
+{
+    return conn->flush ? conn->flush(conn) : Q2PC_ENONE;
+}
+
+static inline void trans_conn_set_class(q2pc_trans_conn* conn, q2pc_class_e cls)
+{
+    if(conn->set_class){
+        conn->set_class(conn, cls);
+    }
+}
+
+//The class a message goes out in
+static inline q2pc_class_e trans_msg_class(q2pc_msg_type_t type, i64 payload_len)
+{
+    switch(type){
+        case q2pc_commit_msg:
+        case q2pc_cancel_msg:
+        case q2pc_ack_msg:
+            return q2pc_class_decision;
+        default:
+            return payload_len ? q2pc_class_bulk : q2pc_class_control;
+    }
+}
+
+static inline i64 trans_conn_drops(q2pc_trans_conn* conn)
+{
+    return conn->get_drops ? conn->get_drops(conn) : 0;
+}
+
+static inline i64 trans_conn_rx_ts(q2pc_trans_conn* conn)
+{
+    return conn->get_rx_ts ? conn->get_rx_ts(conn) : 0;
+}
+
+static inline int trans_conn_fd(q2pc_trans_conn* conn)
+{
+    return conn->get_fd ? conn->get_fd(conn) : -1;
+}
+
 #endif /* Q2PC_TRANSPORT_H_ */
@@ -0,0 +1,140 @@
+/*
+ * spsc_ring.h
+ */
+
+#ifndef SPSC_RING_H_
+#define SPSC_RING_H_
+
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "../../deps/chaste/chaste.h"
+
+//A lock free, single producer, single consumer ring of fixed size slots. Readers and writers work on the slots in
+//place. The ring holds no pointers, only offsets, so it can live in memory shared between processes. The slots
+//follow the header directly.
+//
+//The doorbell lets a consumer sleep on an empty ring. It's optional, a producer only pays for the wake up if the
+//consumer has said it's sleeping.
+#define SPSC_RING_CACHELINE 64
+
+typedef struct {
+    //Consumer side
+    volatile u64 head     __attribute__((aligned(SPSC_RING_CACHELINE)));
+    volatile u32 sleeping;
+
+    //Producer side
+    volatile u64 tail     __attribute__((aligned(SPSC_RING_CACHELINE)));
+    volatile u32 doorbell;
+
+    //Read only once set up
+    i64 slots             __attribute__((aligned(SPSC_RING_CACHELINE))); //Must be a power of 2
+    i64 slot_size;  //Usable bytes in each slot
+    i64 slot_stride;
+
+} spsc_ring;
+
+typedef struct {
+    i64 len;
+    char data[] __attribute__((aligned(16)));
+} spsc_ring_slot;
+
+
+static inline i64 spsc_ring_stride(i64 slot_size)
+{
+    const i64 bytes = sizeof(spsc_ring_slot) + slot_size;
+    return (bytes + SPSC_RING_CACHELINE - 1) & ~(SPSC_RING_CACHELINE - 1);
+}
+
+static inline i64 spsc_ring_bytes(i64 slots, i64 slot_size)
+{
+    return sizeof(spsc_ring) + slots * spsc_ring_stride(slot_size);
+}
+
+static inline void spsc_ring_init(spsc_ring* ring, i64 slots, i64 slot_size)
+{
+    if(slots & (slots - 1)){
+        ch_log_fatal("Ring slot count (%li) must be a power of 2\n", slots);
+    }
+
+    memset(ring, 0, sizeof(spsc_ring));
+    ring->slots       = slots;
+    ring->slot_size   = slot_size;
+    ring->slot_stride = spsc_ring_stride(slot_size);
+}
+
+static inline spsc_ring_slot* spsc_ring_slot_at(spsc_ring* ring, u64 idx)
+{
+    return (spsc_ring_slot*)((char*)(ring + 1) + (idx & (ring->slots - 1)) * ring->slot_stride);
+}
+
+
+//Producer. Returns false if the ring is full.
+static inline bool spsc_ring_beg_write(spsc_ring* ring, char** data_o, i64* len_o)
+{
+    if(ring->tail - ring->head >= (u64)ring->slots){
+        return false;
+    }
+
+    *data_o = spsc_ring_slot_at(ring, ring->tail)->data;
+    *len_o  = ring->slot_size;
+    return true;
+}
+
+static inline void spsc_ring_end_write(spsc_ring* ring, i64 len)
+{
+    spsc_ring_slot_at(ring, ring->tail)->len = len;
+    __sync_synchronize(); //Slot contents must be visible before the tail moves
+    ring->tail++;
+}
+
+
+//Consumer. Returns false if the ring is empty.
+static inline bool spsc_ring_beg_read(spsc_ring* ring, char** data_o, i64* len_o)
+{
+    if(ring->head == ring->tail){
+        return false;
+    }
+
+    __sync_synchronize(); //Don't read the slot before we've seen the tail move
+    spsc_ring_slot* slot = spsc_ring_slot_at(ring, ring->head);
+    *data_o = slot->data;
+    *len_o  = slot->len;
+    return true;
+}
+
+static inline void spsc_ring_end_read(spsc_ring* ring)
+{
+    __sync_synchronize(); //Finish with the slot before the producer can have it back
+    ring->head++;
+}
+
+
+//Doorbell. Waits up to timeout_us for the producer to ring. Returns true if the ring has something in it.
+static inline bool spsc_ring_wait(spsc_ring* ring, i64 timeout_us, bool shared)
+{
+    const u32 bell = ring->doorbell;
+    ring->sleeping = 1;
+    __sync_synchronize(); //Producer must see we're sleeping, or we must see its tail
+
+    if(ring->head == ring->tail){
+        struct timespec ts = { .tv_sec = timeout_us / (1000 * 1000), .tv_nsec = (timeout_us % (1000 * 1000)) * 1000 };
+        syscall(SYS_futex, &ring->doorbell, shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE, bell, &ts, NULL, 0);
+    }
+
+    ring->sleeping = 0;
+    return ring->head != ring->tail;
+}
+
+static inline void spsc_ring_ring(spsc_ring* ring, bool shared)
+{
+    __sync_synchronize();
+    if(ring->sleeping){
+        __sync_fetch_and_add(&ring->doorbell, 1);
+        syscall(SYS_futex, &ring->doorbell, shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+#endif /* SPSC_RING_H_ */
@@ -0,0 +1,44 @@
+/*
+ * tsc.c
+ */
+
+ //#LINKFLAGS=-lpthread
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tsc.h"
+
+#define TSC_CALIBRATE_US (10 * 1000)
+
+static u64 hz                   = 0;
+static pthread_once_t hz_once   = PTHREAD_ONCE_INIT;
+
+
+static i64 time_now_ns()
+{
+    struct timespec ts_now = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts_now);
+    return ts_now.tv_sec * 1000 * 1000 * 1000 + ts_now.tv_nsec;
+}
+
+
+static void calibrate()
+{
+    const i64 ns_start  = time_now_ns();
+    const u64 tsc_start = tsc_read();
+    usleep(TSC_CALIBRATE_US);
+    const u64 tsc_end   = tsc_read();
+    const i64 ns_end    = time_now_ns();
+
+    hz = (u64)((double)(tsc_end - tsc_start) / (double)(ns_end - ns_start) * 1000 * 1000 * 1000);
+    ch_log_debug1("TSC runs at %lu Hz\n", hz);
+}
+
+
+u64 tsc_hz()
+{
+    pthread_once(&hz_once, calibrate);
+    return hz;
+}
@@ -0,0 +1,22 @@
+/*
+ * tsc.h
+ */
+
+#ifndef TSC_H_
+#define TSC_H_
+
+#include "../../deps/chaste/chaste.h"
+
+//Read the time stamp counter. Cheap enough for every message, but only comparable on the core it was taken on unless
+//the counter is invariant, which it is on anything recent.
+static inline u64 tsc_read()
+{
+    u32 lo, hi;
+    __asm__ volatile("rdtsc" : "=a" (lo), "=d" (hi));
+    return (u64)hi << 32 | lo;
+}
+
+//Counter ticks per second. Measured against the monotonic clock the first time it's asked for, which takes ~10ms.
+u64 tsc_hz();
+
+#endif /* TSC_H_ */
@@ -0,0 +1,150 @@
+/*
+ * udp_frag.c
+ */
+
+#include <sys/socket.h>
+#include <errno.h>
+
+#include "udp_frag.h"
+
+
+static i64 send_all(int fd, struct msghdr* msg)
+{
+    i64 result;
+    while( (result = sendmsg(fd, msg, 0)) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ){
+        //Keep trying until we succeed
+    }
+
+    return result;
+}
+
+
+i64 udp_frag_send(int fd, const struct iovec* iov, int iov_count, u16* msg_id)
+{
+    i64 total = 0;
+    for(int i = 0; i < iov_count; i++){
+        total += iov[i].iov_len;
+    }
+
+    if(total <= UDP_FRAG_SIZE){
+        struct msghdr msg = { .msg_iov = (struct iovec*)iov, .msg_iovlen = iov_count };
+        return send_all(fd, &msg);
+    }
+
+    const i64 count = (total + UDP_FRAG_DATA - 1) / UDP_FRAG_DATA;
+    if(count > 0xFFFF){
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    q2pc_frag_hdr hdr = {
+        .ver_flags = (Q2PC_VERSION << Q2PC_VERSION_SHIFT) | Q2PC_FLAG_FRAG,
+        .count     = htole16(count),
+        .msg_id    = htole16(*msg_id),
+    };
+    (*msg_id)++;
+
+    //Walk the source iovs, cutting off a fragment's worth each time round
+    int src     = 0;
+    i64 src_off = 0;
+    for(i64 i = 0; i < count; i++){
+        struct iovec frag[UDP_FRAG_IOV_MAX] = { { .iov_base = &hdr, .iov_len = sizeof(hdr) } };
+        int frag_count = 1;
+        hdr.idx        = htole16(i);
+
+        for(i64 want = MIN(UDP_FRAG_DATA, total - i * UDP_FRAG_DATA); want; ){
+            const i64 take = MIN(want, (i64)iov[src].iov_len - src_off);
+            if(take){
+                if(frag_count == UDP_FRAG_IOV_MAX){
+                    errno = EMSGSIZE;
+                    return -1;
+                }
+
+                frag[frag_count].iov_base = (char*)iov[src].iov_base + src_off;
+                frag[frag_count].iov_len  = take;
+                frag_count++;
+            }
+
+            want    -= take;
+            src_off += take;
+            if(src_off == (i64)iov[src].iov_len){
+                src++;
+                src_off = 0;
+            }
+        }
+
+        struct msghdr msg = { .msg_iov = frag, .msg_iovlen = frag_count };
+        if(send_all(fd, &msg) < 0){
+            return -1;
+        }
+    }
+
+    ch_log_debug3("Sent %liB in %li fragments\n", total, count);
+    return total;
+}
+
+
+i64 udp_frag_add(udp_frag_reasm* reasm, const char* dgram, i64 len, char** msg_o)
+{
+    const q2pc_frag_hdr* hdr = (const q2pc_frag_hdr*)dgram;
+    const i64 idx            = le16toh(hdr->idx);
+    const i64 count          = le16toh(hdr->count);
+    const u16 msg_id         = le16toh(hdr->msg_id);
+    const i64 data_len       = len - sizeof(q2pc_frag_hdr);
+
+    //Everything but the last fragment is full
+    if(idx >= count || data_len > UDP_FRAG_DATA || (idx < count - 1 && data_len != UDP_FRAG_DATA)){
+        ch_log_debug1("Dropping bad fragment %li of %li with %liB\n", idx, count, data_len);
+        return 0;
+    }
+
+    if(reasm->count && msg_id == reasm->msg_id && (reasm->done || count != reasm->count)){
+        ch_log_debug2("Dropping stray fragment %li of message %u\n", idx, msg_id);
+        return 0;
+    }
+
+    //First fragment of a new message. Whatever we had of the last one is lost.
+    if(msg_id != reasm->msg_id || !reasm->count){
+        if(count > reasm->capacity){
+            reasm->buff = realloc(reasm->buff, count * UDP_FRAG_DATA);
+            reasm->seen = realloc(reasm->seen, count);
+            if(!reasm->buff || !reasm->seen){
+                ch_log_fatal("Could not allocate %liB to reassemble a message\n", count * UDP_FRAG_DATA);
+            }
+            reasm->capacity = count;
+        }
+
+        bzero(reasm->seen, count);
+        reasm->msg_id = msg_id;
+        reasm->count  = count;
+        reasm->got    = 0;
+        reasm->done   = false;
+    }
+
+    if(reasm->seen[idx]){
+        return 0;
+    }
+
+    memcpy(reasm->buff + idx * UDP_FRAG_DATA, dgram + sizeof(q2pc_frag_hdr), data_len);
+    reasm->seen[idx] = 1;
+    reasm->got++;
+    if(idx == count - 1){
+        reasm->len = idx * UDP_FRAG_DATA + data_len;
+    }
+
+    if(reasm->got < count){
+        return 0;
+    }
+
+    reasm->done = true;
+    *msg_o      = reasm->buff;
+    return reasm->len;
+}
+
+
+void udp_frag_free(udp_frag_reasm* reasm)
+{
+    free(reasm->buff);
+    free(reasm->seen);
+    bzero(reasm, sizeof(udp_frag_reasm));
+}
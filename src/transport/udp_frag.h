@@ -0,0 +1,56 @@
+/*
+ * udp_frag.h
+ */
+
+#ifndef UDP_FRAG_H_
+#define UDP_FRAG_H_
+
+#include <sys/uio.h>
+
+#include "../../deps/chaste/chaste.h"
+#include "../protocol/q2pc_protocol.h"
+
+//Messages bigger than a datagram that fits an Ethernet MTU (less the IP and UDP headers) are sent in fragments, each
+//with a header that looks like a Q2PC message header with the fragment flag set. Anything up to that size goes out
+//whole, as before.
+#define UDP_FRAG_SIZE 1472
+#define UDP_FRAG_IOV_MAX 16
+
+typedef struct __attribute__((__packed__)) {
+    u8  ver_flags;  //Lines up with q2pc_msg, Q2PC_FLAG_FRAG is always set
+    u8  pad;
+    u16 idx;
+    u16 count;
+    u16 msg_id;
+} q2pc_frag_hdr;
+
+#define UDP_FRAG_DATA (UDP_FRAG_SIZE - (i64)sizeof(q2pc_frag_hdr))
+
+
+typedef struct {
+    char* buff;
+    u8*   seen;     //One per fragment
+    i64   capacity; //Fragments that will fit
+    i64   count;
+    i64   got;
+    i64   len;
+    u16   msg_id;
+    bool  done;     //Keep the id of the last message, so late copies of its fragments aren't delivered twice
+} udp_frag_reasm;
+
+
+//Send the message in iov on a connected socket, in fragments if it has to be. msg_id is bumped for each fragmented
+//message. Returns the bytes sent, or -1 and errno like sendmsg().
+i64 udp_frag_send(int fd, const struct iovec* iov, int iov_count, u16* msg_id);
+
+static inline bool udp_frag_is_frag(const char* dgram, i64 len)
+{
+    return len >= (i64)sizeof(q2pc_frag_hdr) && (dgram[0] & Q2PC_FLAG_FRAG);
+}
+
+//Add a fragment. Returns the length of the whole message, which is in *msg_o until the next call, once the last
+//missing fragment arrives, 0 until then.
+i64 udp_frag_add(udp_frag_reasm* reasm, const char* dgram, i64 len, char** msg_o);
+void udp_frag_free(udp_frag_reasm* reasm);
+
+#endif /* UDP_FRAG_H_ */
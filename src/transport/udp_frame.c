@@ -0,0 +1,131 @@
+/*
+ * udp_frame.c
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+
+#include "udp_frame.h"
+
+
+void udp_frame_iface(const char* iface, int* ifindex_o, udp_frame_addr* addr_o)
+{
+    int fd = socket(AF_INET,SOCK_DGRAM,0);
+    if(fd < 0){
+        ch_log_fatal("Could not create interface query socket (%s)\n", strerror(errno));
+    }
+
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", iface);
+
+    if(ioctl(fd, SIOCGIFINDEX, &ifr)){
+        ch_log_fatal("Could not get index of interface %s: %s\n", iface, strerror(errno));
+    }
+    *ifindex_o = ifr.ifr_ifindex;
+
+    if(ioctl(fd, SIOCGIFHWADDR, &ifr)){
+        ch_log_fatal("Could not get MAC address of interface %s: %s\n", iface, strerror(errno));
+    }
+    memcpy(addr_o->mac, ifr.ifr_hwaddr.sa_data, sizeof(addr_o->mac));
+
+    if(ioctl(fd, SIOCGIFADDR, &ifr)){
+        ch_log_fatal("Could not get IP address of interface %s: %s\n", iface, strerror(errno));
+    }
+    addr_o->ip = ((struct sockaddr_in*)&ifr.ifr_addr)->sin_addr.s_addr;
+
+    close(fd);
+}
+
+
+static u16 ip_checksum(const u8* hdr, i64 len)
+{
+    u32 sum = 0;
+    for(i64 i = 0; i < len; i += 2){
+        sum += (hdr[i] << 8) | hdr[i+1];
+    }
+
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return htons(~sum & 0xFFFF);
+}
+
+
+i64 udp_frame_build(char* frame, const udp_frame_addr* src, const udp_frame_addr* dst, i64 payload_len)
+{
+    u8* eth = (u8*)frame;
+    u8* ip  = eth + 14;
+    u8* udp = ip + 20;
+
+    //Ethernet
+    memcpy(eth + 0, dst->mac, 6);
+    memcpy(eth + 6, src->mac, 6);
+    eth[12] = 0x08;
+    eth[13] = 0x00;
+
+    //IPv4, no options, don't fragment
+    const u16 ip_len = htons(20 + 8 + payload_len);
+    ip[0]  = 0x45;
+    ip[1]  = 0;
+    memcpy(ip + 2, &ip_len, 2);
+    ip[4]  = 0; ip[5] = 0;       //ID
+    ip[6]  = 0x40; ip[7] = 0;    //DF
+    ip[8]  = 64;                 //TTL
+    ip[9]  = IPPROTO_UDP;
+    ip[10] = 0; ip[11] = 0;      //Checksum, filled below
+    memcpy(ip + 12, &src->ip, 4);
+    memcpy(ip + 16, &dst->ip, 4);
+    const u16 csum = ip_checksum(ip, 20);
+    memcpy(ip + 10, &csum, 2);
+
+    //UDP, a zero checksum is legal over IPv4 and saves us touching the payload again
+    const u16 sport   = htons(src->port);
+    const u16 dport   = htons(dst->port);
+    const u16 udp_len = htons(8 + payload_len);
+    memcpy(udp + 0, &sport, 2);
+    memcpy(udp + 2, &dport, 2);
+    memcpy(udp + 4, &udp_len, 2);
+    udp[6] = 0; udp[7] = 0;
+
+    return UDP_FRAME_HDR_LEN;
+}
+
+
+i64 udp_frame_parse(char* frame, i64 len, udp_frame_addr* src_o, u16* dport_o, char** payload_o)
+{
+    if(len < UDP_FRAME_HDR_LEN){
+        return -1;
+    }
+
+    u8* eth = (u8*)frame;
+    u8* ip  = eth + 14;
+    u8* udp = ip + 20;
+
+    if(eth[12] != 0x08 || eth[13] != 0x00 || ip[0] != 0x45 || ip[9] != IPPROTO_UDP){
+        return -1;
+    }
+
+    u16 sport, dport, udp_len;
+    memcpy(&sport, udp + 0, 2);
+    memcpy(&dport, udp + 2, 2);
+    memcpy(&udp_len, udp + 4, 2);
+    udp_len = ntohs(udp_len);
+    if(udp_len < 8 || udp_len - 8 > len - UDP_FRAME_HDR_LEN){
+        return -1;
+    }
+
+    if(src_o){
+        memcpy(src_o->mac, eth + 6, 6);
+        memcpy(&src_o->ip, ip + 12, 4);
+        src_o->port = ntohs(sport);
+    }
+
+    *dport_o   = ntohs(dport);
+    *payload_o = (char*)udp + 8;
+    return udp_len - 8;
+}
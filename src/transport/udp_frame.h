@@ -0,0 +1,82 @@
+/*
+ * udp_frame.h
+ */
+
+#ifndef UDP_FRAME_H_
+#define UDP_FRAME_H_
+
+#include "../../deps/chaste/chaste.h"
+
+//Raw Ethernet/IPv4/UDP framing for the kernel bypass transports. We only ever build and accept plain frames,
+//no VLAN tags, no IP options, so the header is always the same size.
+#define UDP_FRAME_HDR_LEN (14 + 20 + 8)
+
+typedef struct {
+    u8  mac[6];
+    u32 ip;     //Network order
+    u16 port;   //Host order
+} udp_frame_addr;
+
+
+//Look up the index, MAC and IPv4 address of the named interface
+void udp_frame_iface(const char* iface, int* ifindex_o, udp_frame_addr* addr_o);
+
+//Write the Ethernet, IP and UDP headers for a frame with the given payload length. Returns the header length.
+i64 udp_frame_build(char* frame, const udp_frame_addr* src, const udp_frame_addr* dst, i64 payload_len);
+
+//Check that a frame is an IPv4/UDP frame and find its payload. Returns the payload length or -1 if the frame
+//is not one of ours.
+i64 udp_frame_parse(char* frame, i64 len, udp_frame_addr* src_o, u16* dport_o, char** payload_o);
+
+
+
+//A tiny single producer, single consumer queue of received frames. The receive side of the bypass
+//transports drains a shared ring and sorts frames into these, one per connection.
+#define UDP_INBOX_SIZE 16 //Must be a power of 2
+
+typedef struct {
+    char* data;
+    i64   len;
+    u64   tag;  //Transport specific, used to hand the frame back when we're done with it
+} udp_inbox_ent;
+
+typedef struct {
+    udp_inbox_ent ents[UDP_INBOX_SIZE];
+    volatile u64 head;
+    volatile u64 tail;
+    i64 dropped;
+} udp_inbox;
+
+
+static inline bool udp_inbox_push(udp_inbox* box, char* data, i64 len, u64 tag)
+{
+    if(box->tail - box->head >= UDP_INBOX_SIZE){
+        box->dropped++;
+        return false;
+    }
+
+    udp_inbox_ent* ent = &box->ents[box->tail & (UDP_INBOX_SIZE - 1)];
+    ent->data = data;
+    ent->len  = len;
+    ent->tag  = tag;
+    __sync_synchronize();
+    box->tail++;
+    return true;
+}
+
+static inline udp_inbox_ent* udp_inbox_peek(udp_inbox* box)
+{
+    if(box->head == box->tail){
+        return NULL;
+    }
+
+    return &box->ents[box->head & (UDP_INBOX_SIZE - 1)];
+}
+
+static inline void udp_inbox_pop(udp_inbox* box)
+{
+    __sync_synchronize();
+    box->head++;
+}
+
+#endif /* UDP_FRAME_H_ */